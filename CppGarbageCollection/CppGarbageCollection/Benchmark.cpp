@@ -0,0 +1,313 @@
+#include "gc_ptr.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+using namespace vczh;
+
+class Node : ENABLE_GC
+{
+public:
+	gc_ptr<Node>	left;
+	gc_ptr<Node>	right;
+	int				value;
+
+	Node(int _value = 0)
+		:value(_value)
+	{
+	}
+};
+
+//////////////////////////////////////////////////////////////////
+// measuring
+//////////////////////////////////////////////////////////////////
+
+struct workload_result
+{
+	string				name;
+	long long			operations = 0;
+	double				seconds = 0;
+	gc_statistics		stats;
+	vector<double>		pauses;
+	size_t				peak_rss = 0;
+};
+
+mutex					pause_lock;
+vector<double>			pauses;
+
+void record_pause(double milliseconds)
+{
+	lock_guard<mutex> guard(pause_lock);
+	pauses.push_back(milliseconds);
+}
+
+void reset_peak_rss()
+{
+#ifdef __linux__
+	// writing 5 to clear_refs resets the high water mark of the resident size
+	ofstream clear_refs("/proc/self/clear_refs");
+	clear_refs << "5";
+#endif
+}
+
+size_t read_peak_rss()
+{
+#ifdef __linux__
+	ifstream status("/proc/self/status");
+	string line;
+	while (getline(status, line))
+	{
+		if (line.compare(0, 6, "VmHWM:") == 0)
+		{
+			return (size_t)stoull(line.substr(6)) * 1024;
+		}
+	}
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+	{
+		return (size_t)usage.ru_maxrss * 1024;
+	}
+#endif
+	return 0;
+}
+
+double percentile(const vector<double>& sorted, double p)
+{
+	if (sorted.empty()) return 0;
+	size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+	return sorted[index];
+}
+
+// each workload runs in a fresh collector and returns the number of operations it did
+template<typename TWorkload>
+workload_result run_workload(const string& name, const TWorkload& workload)
+{
+	cerr << "running " << name << "..." << endl;
+	workload_result result;
+	result.name = name;
+
+	pauses.clear();
+	reset_peak_rss();
+	gc_start(0x00400000, 0x10000000);
+	gc_set_pause_callback(&record_pause);
+
+	auto start = chrono::steady_clock::now();
+	result.operations = workload();
+	gc_force_collect();
+	result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	result.stats = gc_get_statistics();
+	result.peak_rss = read_peak_rss();
+	gc_set_pause_callback(nullptr);
+	gc_stop();
+
+	result.pauses = pauses;
+	sort(result.pauses.begin(), result.pauses.end());
+	return result;
+}
+
+//////////////////////////////////////////////////////////////////
+// workloads
+//////////////////////////////////////////////////////////////////
+
+// short-lived objects that die immediately
+long long allocation(int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		make_gc<Node>(i);
+	}
+	return count;
+}
+
+long long batch_allocation(int count, int batch)
+{
+	for (int i = 0; i < count; i += batch)
+	{
+		make_gc_n<Node>(batch);
+	}
+	return count;
+}
+
+// overwrite pointers between a fixed set of objects
+long long pointer_write(int objects, int writes)
+{
+	auto nodes = make_gc_n<Node>(objects);
+	unsigned seed = 1;
+	for (int i = 0; i < writes; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		auto a = nodes[(seed >> 8) % objects];
+		auto b = nodes[(seed >> 16) % objects];
+		if (i % 2 == 0)
+		{
+			a->left = b;
+		}
+		else
+		{
+			a->right = b;
+		}
+	}
+	return writes;
+}
+
+// GCBench: a long-lived tree and a stream of temporary trees of different depths
+gc_ptr<Node> make_tree(int depth, long long& nodes)
+{
+	auto node = make_gc<Node>(depth);
+	nodes++;
+	if (depth > 0)
+	{
+		node->left = make_tree(depth - 1, nodes);
+		node->right = make_tree(depth - 1, nodes);
+	}
+	return node;
+}
+
+long long binary_tree(int long_lived_depth, int max_depth)
+{
+	long long nodes = 0;
+	auto long_lived = make_tree(long_lived_depth, nodes);
+	for (int depth = 4; depth <= max_depth; depth += 2)
+	{
+		int iterations = 1 << (max_depth - depth + 2);
+		for (int i = 0; i < iterations; i++)
+		{
+			make_tree(depth, nodes);
+		}
+	}
+	return nodes;
+}
+
+// a large live set that is slowly replaced, while most allocations die young
+long long long_lived_heap(int live, int iterations)
+{
+	auto heap = make_gc_n<Node>(live);
+	unsigned seed = 1;
+	for (int i = 0; i < iterations; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		auto temp = make_gc<Node>(i);
+		temp->left = heap[(seed >> 8) % live];
+		if (i % 100 == 0)
+		{
+			heap.set((seed >> 16) % live, temp);
+		}
+	}
+	return iterations;
+}
+
+// several threads allocating short chains at the same time
+long long multi_threaded(int threads, int count)
+{
+	vector<thread> workers;
+	for (int t = 0; t < threads; t++)
+	{
+		workers.push_back(thread([=]()
+		{
+			for (int i = 0; i < count; i += 10)
+			{
+				auto head = make_gc<Node>(i);
+				for (int j = 1; j < 10; j++)
+				{
+					auto node = make_gc<Node>(i + j);
+					node->left = head;
+					head = node;
+				}
+			}
+		}));
+	}
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+	return (long long)threads * count;
+}
+
+// rings that only become garbage as a whole
+long long cycles(int rings, int size)
+{
+	for (int r = 0; r < rings; r++)
+	{
+		auto nodes = make_gc_n<Node>(size);
+		for (int i = 0; i < size; i++)
+		{
+			nodes[i]->left = nodes[(i + 1) % size];
+			nodes[i]->right = nodes[(i + size - 1) % size];
+		}
+	}
+	return (long long)rings * size;
+}
+
+//////////////////////////////////////////////////////////////////
+// reporting
+//////////////////////////////////////////////////////////////////
+
+string to_json(const vector<workload_result>& results)
+{
+	ostringstream o;
+	o << "{" << endl;
+	o << "  \"benchmark\": \"CppGarbageCollection\"," << endl;
+	o << "  \"workloads\": [" << endl;
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		auto& r = results[i];
+		o << "    {" << endl;
+		o << "      \"name\": \"" << r.name << "\"," << endl;
+		o << "      \"operations\": " << r.operations << "," << endl;
+		o << "      \"seconds\": " << r.seconds << "," << endl;
+		o << "      \"ops_per_sec\": " << (r.seconds > 0 ? r.operations / r.seconds : 0) << "," << endl;
+		o << "      \"collections\": " << r.stats.collections << "," << endl;
+		o << "      \"collected_objects\": " << r.stats.collected_objects << "," << endl;
+		o << "      \"pause_ms\": {"
+			<< "\"total\": " << r.stats.total_pause
+			<< ", \"max\": " << r.stats.max_pause
+			<< ", \"p50\": " << percentile(r.pauses, 0.5)
+			<< ", \"p90\": " << percentile(r.pauses, 0.9)
+			<< ", \"p99\": " << percentile(r.pauses, 0.99)
+			<< "}," << endl;
+		o << "      \"peak_gc_bytes\": " << r.stats.peak_size << "," << endl;
+		o << "      \"peak_rss_bytes\": " << r.peak_rss << endl;
+		o << "    }" << (i + 1 == results.size() ? "" : ",") << endl;
+	}
+	o << "  ]" << endl;
+	o << "}" << endl;
+	return o.str();
+}
+
+// usage: Benchmark [output.json], the report goes to stdout without a file name
+int main(int argc, char* argv[])
+{
+	int threads = max(2, min(4, (int)thread::hardware_concurrency()));
+
+	vector<workload_result> results;
+	results.push_back(run_workload("allocation", [](){return allocation(200000); }));
+	results.push_back(run_workload("batch_allocation", [](){return batch_allocation(200000, 1000); }));
+	results.push_back(run_workload("pointer_write", [](){return pointer_write(10000, 200000); }));
+	results.push_back(run_workload("binary_tree", [](){return binary_tree(14, 14); }));
+	results.push_back(run_workload("long_lived_heap", [](){return long_lived_heap(50000, 200000); }));
+	results.push_back(run_workload("multi_threaded", [=](){return multi_threaded(threads, 50000); }));
+	results.push_back(run_workload("cycles", [](){return cycles(100, 2000); }));
+
+	auto json = to_json(results);
+	if (argc > 1)
+	{
+		ofstream file(argv[1]);
+		file << json;
+	}
+	else
+	{
+		cout << json;
+	}
+	return 0;
+}
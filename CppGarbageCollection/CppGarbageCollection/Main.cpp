@@ -11,6 +11,8 @@
 using namespace std;
 using namespace vczh;
 
+int objects = 0;				// number of living A
+
 class A : ENABLE_GC
 {
 public:
@@ -18,11 +20,13 @@ public:
 
 	A(int a)
 	{
+		objects++;
 	}
 
 	~A()
 	{
 		assert(next.operator->() == nullptr);
+		objects--;
 	}
 };
 
@@ -65,11 +69,8 @@ public:
 	}
 };
 
-int main()
+void test_cycles()
 {
-	int step_size = 1024;		// collect whenever the increment of the memory exceeds <step_size> bytes
-	int max_size = 8192;		// collect whenever the total memory used exceeds <max_size> bytes
-	gc_start(step_size, max_size);
 	for (int i = 0; i < 65536; i++)
 	{
 		auto x = make_gc<B>(1);
@@ -87,7 +88,232 @@ int main()
 			cout << i << endl;
 		}
 	}
+}
+
+void test_weak()
+{
+	gc_weak_ptr<A> cache;
+	{
+		auto x = make_gc<B>(1);
+		cache = x;
+		assert(cache.lock());
+		assert(dynamic_gc_cast<B>(cache.lock()));
+	}
+	// a weak pointer does not keep its target alive
+	gc_force_collect();
+	assert(cache.expired());
+	assert(!cache.lock());
+
+	auto y = make_gc<C>(2);
+	auto z = make_gc<D>(3);
+	y->next = z;
+	z->next = y;
+	gc_weak_ptr<A> weak_y = y;
+	gc_weak_ptr<A> weak_z = weak_y;
+	weak_z = z;
+	gc_force_collect();
+	assert(weak_y.lock() && weak_z.lock());
+
+	// a pointer upgraded from a weak pointer keeps its target alive
+	auto locked = weak_y.lock();
+	y = gc_ptr<C>();
+	z = gc_ptr<D>();
+	gc_force_collect();
+	assert(weak_y.lock() && weak_z.lock());
+
+	locked = gc_ptr<A>();
+	gc_force_collect();
+	assert(weak_y.expired() && weak_z.expired());
+}
+
+class E : ENABLE_GC, public virtual A
+{
+public:
+	gc_vector<A>	children;
+
+	E(int a) :A(a)
+	{
+	}
+};
+
+class F : ENABLE_GC, public virtual A
+{
+public:
+	static int		remaining;		// number of objects constructed before throwing
+
+	F(int a) :A(a)
+	{
+		if (remaining-- == 0) throw a;
+	}
+};
+
+int F::remaining = 0;
+
+void test_vector()
+{
+	gc_force_collect();
+	int base = objects;
+	{
+		gc_vector<A> xs;
+		for (int i = 0; i < 100; i++)
+		{
+			xs.push_back(make_gc<B>(i));
+		}
+		gc_force_collect();
+		assert(objects == base + 100);
+		for (int i = 0; i < 100; i++)
+		{
+			assert(dynamic_gc_cast<B>(xs[i]));
+		}
+
+		gc_vector<A> ys = xs;
+		xs.resize(10);
+		gc_force_collect();
+		assert(objects == base + 100);
+		ys.clear();
+		gc_force_collect();
+		assert(objects == base + 10);
+	}
+	gc_force_collect();
+	assert(objects == base);
+
+	{
+		// cycles through a vector in a gc object
+		auto e = make_gc<E>(0);
+		for (int i = 0; i < 10; i++)
+		{
+			auto x = make_gc<C>(i);
+			x->next = e;
+			e->children.push_back(x);
+		}
+		gc_force_collect();
+		assert(objects == base + 11);
+		for (int i = 0; i < 10; i++)
+		{
+			assert(dynamic_gc_cast<E>(e->children[i]->next));
+		}
+	}
+	gc_force_collect();
+	assert(objects == base);
+
+	{
+		auto xs = make_gc_array<D>(10, 3);
+		assert(xs.size() == 10);
+		for (int i = 0; i < 10; i++)
+		{
+			xs[i]->next = xs[(i + 1) % 10];
+		}
+		gc_ptr<A> x = xs[5];
+		xs.clear();
+		gc_force_collect();
+		assert(objects == base + 10);
+		assert(dynamic_gc_cast<D>(x->next));
+	}
+	gc_force_collect();
+	assert(objects == base);
+
+	{
+		auto xs = make_gc_n<B>(100, 1);
+		assert(xs.size() == 100);
+		for (int i = 0; i < 100; i++)
+		{
+			xs[i]->next = xs[i ^ 1];
+		}
+		gc_ptr<A> x = xs[99];
+		xs.resize(50);
+		gc_force_collect();
+		assert(objects == base + 52);
+		x = gc_ptr<A>();
+		gc_force_collect();
+		assert(objects == base + 50);
+		xs.clear();
+		gc_force_collect();
+		assert(objects == base);
+	}
+
+	{
+		// a throwing constructor destroys the objects constructed so far and enables collections again
+		F::remaining = 5;
+		bool thrown = false;
+		try
+		{
+			make_gc_n<F>(10, 1);
+		}
+		catch (int)
+		{
+			thrown = true;
+		}
+		assert(thrown);
+		assert(objects == base);
+
+		F::remaining = 5;
+		thrown = false;
+		try
+		{
+			make_gc_array<F>(10, 1);
+		}
+		catch (int)
+		{
+			thrown = true;
+		}
+		assert(thrown);
+		assert(objects == base);
+
+		size_t collections = gc_get_statistics().collections;
+		for (int i = 0; i < 100; i++)
+		{
+			make_gc<B>(i);
+		}
+		assert(gc_get_statistics().collections > collections);
+		gc_force_collect();
+		assert(objects == base);
+	}
+}
+
+void test_memory_limited()
+{
+	// the process already uses more than 1MB, so without a cgroup limit the pressure is critical and a collection runs after the first sample (64KB)
+	// with a cgroup limit, the max size is still respected
+	size_t max_size = 0x100000;
+	gc_start_memory_limited(max_size, max_size);
+	int base = objects;
+	for (int i = 0; i < 100000 && gc_get_statistics().collections == 0; i++)
+	{
+		make_gc<B>(i);
+	}
+
+	auto stats = gc_get_statistics();
+	assert(stats.collections > 0);
+	assert(stats.collected_objects > 0);
+	assert(stats.peak_size <= max_size + 0x1000);
+	gc_force_collect();
+	assert(objects == base);
+	gc_stop();
+}
+
+int main()
+{
+	int step_size = 1024;		// collect whenever the increment of the memory exceeds <step_size> bytes
+	int max_size = 8192;		// collect whenever the total memory used exceeds <max_size> bytes
+	gc_start(step_size, max_size);
+	test_cycles();
+	test_weak();
+	test_vector();
+	{
+		auto stats = gc_get_statistics();
+		assert(stats.collections > 0);
+		assert(stats.collected_objects > 0);
+		assert(stats.peak_size >= stats.current_size);
+		assert(stats.max_pause <= stats.total_pause);
+	}
 	gc_stop();
+
+	int memory_limit = 0x10000000;	// collect more and more aggressively when the process approaches its cgroup memory limit, or <memory_limit> bytes
+	gc_start_memory_limited(step_size, memory_limit);
+	test_cycles();
+	gc_stop();
+
+	test_memory_limited();
 #ifdef _MSC_VER
 	_CrtDumpMemoryLeaks();
 #endif
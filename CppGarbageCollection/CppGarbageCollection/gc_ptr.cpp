@@ -5,6 +5,16 @@
 #include <vector>
 #include <mutex>
 #include <atomic>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <string.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#ifdef __linux__
+#include <unistd.h>
+#endif
 
 using namespace std;
 
@@ -39,7 +49,11 @@ namespace vczh
 		gc_record						record;
 		multiset<gc_handle*>			references;
 		multiset<void**>				handle_references;
+		multiset<void**>				weak_references;
 		bool							mark = false;
+
+		void*							(*trace)(void*) = nullptr;	// set for blocks of pointers, which are scanned instead of tracked
+		int								count = 1;					// number of objects in an array allocation
 	};
 
 	struct gc_handle_dummy
@@ -74,6 +88,57 @@ namespace vczh
 	size_t								gc_max_size = 0;
 	size_t								gc_last_current_size = 0;
 	size_t								gc_current_size = 0;
+	int									gc_suppress_count = 0;		// number of batches being constructed by make_gc_n
+	gc_statistics						gc_stats;
+	void								(*gc_pause_callback)(double) = nullptr;
+
+	struct gc_collection
+	{
+		vector<gc_handle*>					garbages;
+		bool								collected = false;
+		bool								release = false;		// give memory back to the system after destroying garbages
+		chrono::steady_clock::time_point	start;
+	};
+
+	// memory-limited mode: collect more aggressively when the process approaches its memory limit
+	bool								gc_memory_limited = false;
+	size_t								gc_memory_limit = 0;
+	size_t								gc_sampled_usage = 0;
+	size_t								gc_sampled_current_size = 0;
+
+	// gc_current_size also counts the bookkeeping of each object, not only the object itself
+	const size_t						gc_malloc_overhead = 2 * sizeof(size_t);
+	const size_t						gc_node_overhead = 4 * sizeof(void*) + gc_malloc_overhead;
+	const size_t						gc_handle_overhead = sizeof(gc_handle) + gc_node_overhead + 2 * gc_malloc_overhead;
+
+	template<typename T>
+	void gc_insert_unsafe(multiset<T>& container, const T& value)
+	{
+		container.insert(value);
+		gc_current_size += gc_node_overhead;
+	}
+
+	template<typename T>
+	void gc_erase_one_unsafe(multiset<T>& container, const T& value)
+	{
+		auto it = container.find(value);
+		if (it != container.end())
+		{
+			container.erase(it);
+			gc_current_size -= gc_node_overhead;
+		}
+	}
+
+	template<typename T>
+	void gc_erase_all_unsafe(multiset<T>& container, const T& value)
+	{
+		gc_current_size -= container.erase(value) * gc_node_overhead;
+	}
+
+	size_t gc_size_of_unsafe(gc_handle* handle)
+	{
+		return handle->record.length + gc_handle_overhead + (handle->references.size() + handle->handle_references.size() + handle->weak_references.size()) * gc_node_overhead;
+	}
 
 	gc_handle* gc_find_unsafe(void* handle)
 	{
@@ -101,18 +166,14 @@ namespace vczh
 		{
 			if (parent = gc_find_parent_unsafe(handle_reference))
 			{
-				parent->handle_references.insert(handle_reference);
+				gc_insert_unsafe(parent->handle_references, handle_reference);
 			}
 		}
 		if (auto target = gc_find_unsafe(handle))
 		{
 			if (parent || (parent = gc_find_parent_unsafe(handle_reference)))
 			{
-				parent->references.insert(target);
-				if (alloc)
-				{
-					parent->handle_references.insert(handle_reference);
-				}
+				gc_insert_unsafe(parent->references, target);
 			}
 			else
 			{
@@ -128,18 +189,14 @@ namespace vczh
 		{
 			if (parent = gc_find_parent_unsafe(handle_reference))
 			{
-				parent->handle_references.insert(handle_reference);
+				gc_erase_all_unsafe(parent->handle_references, handle_reference);
 			}
 		}
 		if (auto target = gc_find_unsafe(handle))
 		{
 			if (parent || (parent = gc_find_parent_unsafe(handle_reference)))
 			{
-				if (dealloc)
-				{
-					parent->handle_references.erase(handle_reference);
-				}
-				parent->references.erase(target);
+				gc_erase_one_unsafe(parent->references, target);
 			}
 			else
 			{
@@ -148,6 +205,37 @@ namespace vczh
 		}
 	}
 
+	void gc_weak_disconnect_unsafe(void** weak_reference)
+	{
+		if (auto target = gc_find_unsafe(weak_reference[1]))
+		{
+			gc_erase_all_unsafe(target->weak_references, weak_reference);
+		}
+		weak_reference[0] = nullptr;
+		weak_reference[1] = nullptr;
+	}
+
+	void gc_weak_connect_unsafe(void** weak_reference, void* reference, void* handle)
+	{
+		if (auto target = gc_find_unsafe(handle))
+		{
+			gc_insert_unsafe(target->weak_references, weak_reference);
+			weak_reference[0] = reference;
+			weak_reference[1] = handle;
+		}
+	}
+
+	void gc_sweep_weak_unsafe(gc_handle* handle)
+	{
+		// called while the lock is held, so lock() never observes a target that is about to be destroyed
+		for (auto weak_reference : handle->weak_references)
+		{
+			weak_reference[0] = nullptr;
+			weak_reference[1] = nullptr;
+		}
+		handle->weak_references.clear();
+	}
+
 	void gc_destroy_disconnect_unsafe(gc_handle* handle)
 	{
 		for (auto handle_reference : handle->handle_references)
@@ -159,12 +247,26 @@ namespace vczh
 
 	void gc_destroy_unsafe(gc_handle* handle)
 	{
-		handle->record.handle->~enable_gc();
-		gc_current_size -= handle->record.length;
+		if (auto e = handle->record.handle)
+		{
+			size_t stride = handle->record.length / handle->count;
+			for (int i = 0; i < handle->count; i++)
+			{
+				reinterpret_cast<enable_gc*>(reinterpret_cast<char*>(e) + i * stride)->~enable_gc();
+			}
+		}
 		free(handle->record.start);
 		delete handle;
 	}
 
+	void gc_release_memory()
+	{
+#ifdef __GLIBC__
+		// give freed objects and handles back to the system, otherwise the resident size never shrinks
+		malloc_trim(0);
+#endif
+	}
+
 	void gc_destroy_unsafe(vector<gc_handle*>& garbages)
 	{
 		for (auto handle : garbages)
@@ -175,11 +277,13 @@ namespace vczh
 		{
 			gc_destroy_unsafe(handle);
 		}
-		gc_last_current_size = gc_current_size;
 	}
 
-	void gc_force_collect_unsafe(vector<gc_handle*>& garbages)
+	void gc_force_collect_unsafe(gc_collection& collection)
 	{
+		auto& garbages = collection.garbages;
+		collection.collected = true;
+		collection.start = chrono::steady_clock::now();
 		vector<gc_handle*> markings;
 
 		for (auto handle : *gc_handles)
@@ -201,6 +305,22 @@ namespace vczh
 					markings.push_back(child);
 				}
 			}
+
+			if (ref->trace)
+			{
+				auto slots = reinterpret_cast<void**>(ref->record.start);
+				int count = ref->record.length / sizeof(void*);
+				for (int j = 0; j < count; j++)
+				{
+					if (!slots[j]) continue;
+					auto child = gc_find_unsafe(ref->trace(slots[j]));
+					if (child && !child->mark)
+					{
+						child->mark = true;
+						markings.push_back(child);
+					}
+				}
+			}
 		}
 
 		for (auto it = gc_handles->begin(); it != gc_handles->end();)
@@ -209,6 +329,8 @@ namespace vczh
 			{
 				auto it2 = it++;
 				garbages.push_back(*it2);
+				gc_current_size -= gc_size_of_unsafe(*it2);
+				gc_sweep_weak_unsafe(*it2);
 				gc_handles->erase(it2);
 			}
 			else
@@ -216,33 +338,205 @@ namespace vczh
 				it++;
 			}
 		}
+		gc_last_current_size = gc_current_size;
+		gc_stats.collections++;
+		gc_stats.collected_objects += garbages.size();
+	}
+
+	void gc_finish_collection(gc_collection& collection)
+	{
+		gc_destroy_unsafe(collection.garbages);
+		if (collection.release)
+		{
+			gc_release_memory();
+		}
+
+		if (collection.collected)
+		{
+			double pause = chrono::duration<double, milli>(chrono::steady_clock::now() - collection.start).count();
+			void(*callback)(double) = nullptr;
+			{
+				lock_guard<mutex> guard(gc_lock);
+				gc_stats.total_pause += pause;
+				if (gc_stats.max_pause < pause) gc_stats.max_pause = pause;
+				callback = gc_pause_callback;
+			}
+			if (callback)
+			{
+				callback(pause);
+			}
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// memory limit
+	//////////////////////////////////////////////////////////////////
+
+	size_t gc_read_number(const string& path)
+	{
+		ifstream file(path);
+		string text;
+		if (!(file >> text) || text == "max") return 0;
+		return (size_t)stoull(text);
+	}
+
+	size_t gc_read_memory_limit()
+	{
+		size_t limit = 0;
+#ifdef __linux__
+		// cgroup v2 exposes memory.max for the cgroup listed as "0::<path>", cgroup v1 exposes memory.limit_in_bytes
+		string v2_path, v1_path;
+		ifstream cgroup("/proc/self/cgroup");
+		string line;
+		while (getline(cgroup, line))
+		{
+			if (line.compare(0, 3, "0::") == 0)
+			{
+				v2_path = line.substr(3);
+			}
+			else if (line.find(":memory:") != string::npos)
+			{
+				v1_path = line.substr(line.find(":memory:") + 8);
+			}
+		}
+
+		const char* candidates[] =
+		{
+			"/sys/fs/cgroup", "/memory.max",
+			"/sys/fs/cgroup/memory", "/memory.limit_in_bytes",
+		};
+		string paths[] = { v2_path, v1_path };
+		for (int i = 0; i < 2 && limit == 0; i++)
+		{
+			limit = gc_read_number(candidates[i * 2] + paths[i] + candidates[i * 2 + 1]);
+			if (limit == 0)
+			{
+				limit = gc_read_number(string(candidates[i * 2]) + candidates[i * 2 + 1]);
+			}
+		}
+
+		// cgroup v1 reports "no limit" as a huge page-aligned number
+		if (limit >= ((size_t)1 << (sizeof(size_t) * 8 - 2)))
+		{
+			limit = 0;
+		}
+#endif
+		return limit;
+	}
+
+	size_t gc_read_memory_usage()
+	{
+#ifdef __linux__
+		ifstream statm("/proc/self/statm");
+		size_t pages = 0, resident = 0;
+		if (statm >> pages >> resident)
+		{
+			return resident * (size_t)sysconf(_SC_PAGESIZE);
+		}
+#endif
+		return gc_current_size;
+	}
+
+	enum class gc_pressure
+	{
+		none,
+		moderate,
+		high,
+		critical,
+	};
+
+	gc_pressure gc_memory_pressure_unsafe(bool& sampled)
+	{
+		if (gc_current_size < gc_sampled_current_size)
+		{
+			// collected memory is assumed to be released until the next sample
+			size_t released = gc_sampled_current_size - gc_current_size;
+			gc_sampled_usage = gc_sampled_usage > released ? gc_sampled_usage - released : 0;
+			gc_sampled_current_size = gc_current_size;
+		}
+
+		// reading the usage touches the file system, so it is sampled only after the heap grows by 1/16 of a step (at least 64KB)
+		sampled = gc_current_size - gc_sampled_current_size > max(gc_step_size / 16, (size_t)0x10000);
+		if (sampled)
+		{
+			gc_sampled_usage = gc_read_memory_usage();
+			gc_sampled_current_size = gc_current_size;
+		}
+
+		size_t usage = gc_sampled_usage + (gc_current_size - gc_sampled_current_size);
+		if (usage < gc_current_size) usage = gc_current_size;
+
+		if (usage >= gc_memory_limit / 10 * 9) return gc_pressure::critical;
+		if (usage >= gc_memory_limit / 4 * 3) return gc_pressure::high;
+		if (usage >= gc_memory_limit / 2) return gc_pressure::moderate;
+		return gc_pressure::none;
+	}
+
+	void gc_collect_if_necessary_unsafe(gc_collection& collection)
+	{
+		if (gc_stats.peak_size < gc_current_size) gc_stats.peak_size = gc_current_size;
+		if (gc_suppress_count > 0) return;
+
+		size_t step_size = gc_step_size;
+		if (gc_memory_limited)
+		{
+			bool sampled = false;
+			switch (gc_memory_pressure_unsafe(sampled))
+			{
+			case gc_pressure::moderate:
+				step_size /= 4;
+				break;
+			case gc_pressure::critical:
+				// a full collection is only worth it when the usage is measured, not estimated
+				if (sampled)
+				{
+					gc_force_collect_unsafe(collection);
+					collection.release = true;
+					return;
+				}
+				step_size /= 16;
+				break;
+			case gc_pressure::high:
+				step_size /= 16;
+				break;
+			default:;
+			}
+		}
+
+		if (gc_current_size > gc_max_size)
+		{
+			gc_force_collect_unsafe(collection);
+		}
+		else if (gc_current_size > gc_last_current_size && gc_current_size - gc_last_current_size > step_size)
+		{
+			gc_force_collect_unsafe(collection);
+		}
 	}
 
+
 	namespace unsafe_functions
 	{
 		void gc_alloc(gc_record record)
+		{
+			gc_alloc_block(record, nullptr);
+		}
+
+		void gc_alloc_block(gc_record record, void* (*trace)(void* reference))
 		{
 			assert(gc_handles);
 			auto handle = new gc_handle;
 			handle->record = record;
 			handle->counter = 1;
+			handle->trace = trace;
 
-			vector<gc_handle*> garbages;
+			gc_collection collection;
 			{
 				lock_guard<mutex> guard(gc_lock);
 				gc_handles->insert(handle);
-				gc_current_size += handle->record.length;
-
-				if (gc_current_size > gc_max_size)
-				{
-					gc_force_collect_unsafe(garbages);
-				}
-				else if (gc_current_size - gc_last_current_size > gc_step_size)
-				{
-					gc_force_collect_unsafe(garbages);
-				}
+				gc_current_size += gc_size_of_unsafe(handle);
+				gc_collect_if_necessary_unsafe(collection);
 			}
-			gc_destroy_unsafe(garbages);
+			gc_finish_collection(collection);
 		}
 
 		void gc_register(void* reference, enable_gc* handle)
@@ -253,6 +547,16 @@ namespace vczh
 			gc_find_unsafe(reference)->record.handle = handle;
 		}
 
+		void gc_register_array(void* reference, enable_gc* handle, int count)
+		{
+			assert(gc_handles);
+
+			lock_guard<mutex> guard(gc_lock);
+			auto target = gc_find_unsafe(reference);
+			target->record.handle = handle;
+			target->count = count;
+		}
+
 		void gc_ref_alloc(void** handle_reference, void* handle)
 		{
 			assert(gc_handles);
@@ -277,6 +581,144 @@ namespace vczh
 			gc_ref_disconnect_unsafe(handle_reference, old_handle, false);
 			gc_ref_connect_unsafe(handle_reference, new_handle, false);
 		}
+
+		void gc_weak_ref(void** weak_reference, void* reference, void* handle)
+		{
+			assert(gc_handles);
+
+			lock_guard<mutex> guard(gc_lock);
+			gc_weak_disconnect_unsafe(weak_reference);
+			gc_weak_connect_unsafe(weak_reference, reference, handle);
+		}
+
+		void gc_weak_copy(void** weak_reference, void** source_weak_reference)
+		{
+			assert(gc_handles);
+
+			lock_guard<mutex> guard(gc_lock);
+			gc_weak_disconnect_unsafe(weak_reference);
+			gc_weak_connect_unsafe(weak_reference, source_weak_reference[0], source_weak_reference[1]);
+		}
+
+		void gc_weak_dealloc(void** weak_reference)
+		{
+			assert(gc_handles);
+
+			lock_guard<mutex> guard(gc_lock);
+			gc_weak_disconnect_unsafe(weak_reference);
+		}
+
+		void gc_weak_lock(void** weak_reference, void** handle_reference)
+		{
+			assert(gc_handles);
+
+			lock_guard<mutex> guard(gc_lock);
+			if (weak_reference[1])
+			{
+				*handle_reference = weak_reference[0];
+				gc_ref_connect_unsafe(handle_reference, weak_reference[1], false);
+			}
+		}
+
+		void gc_alloc_n(const gc_record* records, int count)
+		{
+			assert(gc_handles);
+
+			lock_guard<mutex> guard(gc_lock);
+			for (int i = 0; i < count; i++)
+			{
+				auto handle = new gc_handle;
+				handle->record = records[i];
+				handle->counter = 1;
+				gc_handles->insert(handle);
+				gc_current_size += gc_size_of_unsafe(handle);
+			}
+			gc_suppress_count++;
+		}
+
+		void gc_register_n(const gc_record* records, int count)
+		{
+			assert(gc_handles);
+
+			gc_collection collection;
+			{
+				lock_guard<mutex> guard(gc_lock);
+				for (int i = 0; i < count; i++)
+				{
+					auto target = gc_find_unsafe(records[i].start);
+					target->record.handle = records[i].handle;
+					target->counter--;
+				}
+				gc_suppress_count--;
+				gc_collect_if_necessary_unsafe(collection);
+			}
+			gc_finish_collection(collection);
+		}
+
+		void gc_unregister_n(const gc_record* records, int count)
+		{
+			assert(gc_handles);
+
+			// undoes gc_alloc_n when constructing the objects failed
+			{
+				lock_guard<mutex> guard(gc_lock);
+				for (int i = 0; i < count; i++)
+				{
+					auto target = gc_find_unsafe(records[i].start);
+					gc_current_size -= gc_size_of_unsafe(target);
+					gc_sweep_weak_unsafe(target);
+					gc_handles->erase(target);
+					delete target;
+				}
+				gc_suppress_count--;
+			}
+			for (int i = 0; i < count; i++)
+			{
+				free(records[i].start);
+			}
+		}
+
+		void gc_block_write(void** slot, void* reference)
+		{
+			assert(gc_handles);
+
+			lock_guard<mutex> guard(gc_lock);
+			*slot = reference;
+		}
+
+		void gc_block_copy(void* target, const void* source, size_t size)
+		{
+			assert(gc_handles);
+
+			// a null source clears the target
+			lock_guard<mutex> guard(gc_lock);
+			if (source)
+			{
+				memmove(target, source, size);
+			}
+			else
+			{
+				memset(target, 0, size);
+			}
+		}
+
+		void gc_block_free(void* handle)
+		{
+			assert(gc_handles);
+
+			// only called by the single owner of a block, so nothing else can reach it
+			gc_handle* target = nullptr;
+			{
+				lock_guard<mutex> guard(gc_lock);
+				target = gc_find_unsafe(handle);
+				if (!target) return;
+				gc_current_size -= gc_size_of_unsafe(target);
+				gc_sweep_weak_unsafe(target);
+				gc_handles->erase(target);
+			}
+			free(handle);
+			delete target;
+		}
 	}
 
 	void gc_start(size_t step_size, size_t max_size)
@@ -289,6 +731,24 @@ namespace vczh
 		gc_max_size = max_size;
 		gc_last_current_size = 0;
 		gc_current_size = 0;
+		gc_stats = gc_statistics();
+	}
+
+	void gc_start_memory_limited(size_t step_size, size_t max_size)
+	{
+		gc_start(step_size, max_size);
+
+		lock_guard<mutex> guard(gc_lock);
+		gc_memory_limited = true;
+		gc_memory_limit = gc_read_memory_limit();
+		if (gc_memory_limit == 0)
+		{
+			// without a cgroup limit, max_size is treated as the limit of the whole process
+			gc_memory_limit = max_size;
+		}
+		gc_max_size = min(max_size, gc_memory_limit);
+		gc_sampled_usage = gc_read_memory_usage();
+		gc_sampled_current_size = 0;
 	}
 
 	void gc_stop()
@@ -303,9 +763,15 @@ namespace vczh
 		gc_max_size = 0;
 		gc_last_current_size = 0;
 		gc_current_size = 0;
+		gc_suppress_count = 0;
+		gc_memory_limited = false;
+		gc_memory_limit = 0;
+		gc_sampled_usage = 0;
+		gc_sampled_current_size = 0;
 
 		for (auto handle : *garbages)
 		{
+			gc_sweep_weak_unsafe(handle);
 			gc_destroy_disconnect_unsafe(handle);
 		}
 		for (auto handle : *garbages)
@@ -319,11 +785,25 @@ namespace vczh
 	{
 		assert(gc_handles);
 		
-		vector<gc_handle*> garbages;
+		gc_collection collection;
 		{
 			lock_guard<mutex> guard(gc_lock);
-			gc_force_collect_unsafe(garbages);
+			gc_force_collect_unsafe(collection);
 		}
-		gc_destroy_unsafe(garbages);
+		gc_finish_collection(collection);
+	}
+
+	gc_statistics gc_get_statistics()
+	{
+		lock_guard<mutex> guard(gc_lock);
+		auto stats = gc_stats;
+		stats.current_size = gc_current_size;
+		return stats;
+	}
+
+	void gc_set_pause_callback(void(*callback)(double milliseconds))
+	{
+		lock_guard<mutex> guard(gc_lock);
+		gc_pause_callback = callback;
 	}
 }
\ No newline at end of file
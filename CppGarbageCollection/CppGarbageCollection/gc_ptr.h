@@ -1,5 +1,8 @@
 #pragma once
+#include <stdlib.h>
 #include <memory>
+#include <new>
+#include <vector>
 
 namespace vczh
 {
@@ -7,6 +10,10 @@ namespace vczh
 	class enable_gc;
 	template<typename T>
 	class gc_ptr;
+	template<typename T>
+	class gc_weak_ptr;
+	template<typename T>
+	class gc_vector;
 
 	struct gc_record
 	{
@@ -15,6 +22,16 @@ namespace vczh
 		enable_gc*			handle = nullptr;
 	};
 
+	struct gc_statistics
+	{
+		size_t				collections = 0;
+		size_t				collected_objects = 0;
+		size_t				current_size = 0;		// bytes of objects and their bookkeeping
+		size_t				peak_size = 0;
+		double				total_pause = 0;		// milliseconds spent in collections, including destroying garbages
+		double				max_pause = 0;
+	};
+
 	class enable_gc
 	{
 		template<typename T>
@@ -22,6 +39,12 @@ namespace vczh
 
 		template<typename T, typename ...TArgs>
 		friend gc_ptr<T> make_gc(TArgs&& ...args);
+
+		template<typename T, typename ...TArgs>
+		friend gc_vector<T> make_gc_array(int count, const TArgs& ...args);
+
+		template<typename T, typename ...TArgs>
+		friend gc_vector<T> make_gc_n(int count, const TArgs& ...args);
 	private:
 		gc_record			record;
 
@@ -34,14 +57,29 @@ namespace vczh
 	namespace unsafe_functions
 	{
 		extern void gc_alloc(gc_record record);
+		extern void gc_alloc_block(gc_record record, void* (*trace)(void* reference));
 		extern void gc_register(void* reference, enable_gc* handle);
+		extern void gc_register_array(void* reference, enable_gc* handle, int count);
+		extern void gc_alloc_n(const gc_record* records, int count);
+		extern void gc_register_n(const gc_record* records, int count);
+		extern void gc_unregister_n(const gc_record* records, int count);
 		extern void gc_ref_alloc(void** handle_reference, void* handle);
 		extern void gc_ref_dealloc(void** handle_reference, void* handle);
 		extern void gc_ref(void** handle_reference, void* old_handle, void* new_handle);
+		extern void gc_weak_ref(void** weak_reference, void* reference, void* handle);
+		extern void gc_weak_copy(void** weak_reference, void** source_weak_reference);
+		extern void gc_weak_dealloc(void** weak_reference);
+		extern void gc_weak_lock(void** weak_reference, void** handle_reference);
+		extern void gc_block_write(void** slot, void* reference);
+		extern void gc_block_copy(void* target, const void* source, size_t size);
+		extern void gc_block_free(void* handle);
 	}
 	extern void gc_start(size_t step_size, size_t max_size);
+	extern void gc_start_memory_limited(size_t step_size, size_t max_size);
 	extern void gc_stop();
 	extern void gc_force_collect();
+	extern gc_statistics gc_get_statistics();
+	extern void gc_set_pause_callback(void(*callback)(double milliseconds));
 
 	template<typename T>
 	class gc_ptr
@@ -49,6 +87,12 @@ namespace vczh
 		template<typename T2>
 		friend class gc_ptr;
 
+		template<typename T2>
+		friend class gc_weak_ptr;
+
+		template<typename T2>
+		friend class gc_vector;
+
 		template<typename T2, typename ...TArgs>
 		friend gc_ptr<T2> make_gc(TArgs&& ...args);
 
@@ -122,6 +166,254 @@ namespace vczh
 		}
 	};
 
+	template<typename T>
+	class gc_weak_ptr
+	{
+		template<typename T2>
+		friend class gc_weak_ptr;
+	private:
+		// both fields are cleared by the collector when the target is swept
+		T*					reference = nullptr;
+		void*				handle = nullptr;
+
+	public:
+		gc_weak_ptr()
+		{
+		}
+
+		gc_weak_ptr(const gc_weak_ptr<T>& ptr)
+		{
+			unsafe_functions::gc_weak_copy((void**)this, (void**)&ptr);
+		}
+
+		template<typename U>
+		gc_weak_ptr(const gc_ptr<U>& ptr)
+		{
+			T* target = ptr.reference;
+			unsafe_functions::gc_weak_ref((void**)this, target, gc_ptr<T>::handle_of(target));
+		}
+
+		~gc_weak_ptr()
+		{
+			unsafe_functions::gc_weak_dealloc((void**)this);
+		}
+
+		gc_weak_ptr<T>& operator=(const gc_weak_ptr<T>& ptr)
+		{
+			if (this != &ptr)
+			{
+				unsafe_functions::gc_weak_copy((void**)this, (void**)&ptr);
+			}
+			return *this;
+		}
+
+		template<typename U>
+		gc_weak_ptr<T>& operator=(const gc_ptr<U>& ptr)
+		{
+			T* target = ptr.reference;
+			unsafe_functions::gc_weak_ref((void**)this, target, gc_ptr<T>::handle_of(target));
+			return *this;
+		}
+
+		void reset()
+		{
+			unsafe_functions::gc_weak_ref((void**)this, nullptr, nullptr);
+		}
+
+		bool expired()const
+		{
+			return reference == nullptr;
+		}
+
+		gc_ptr<T> lock()const
+		{
+			gc_ptr<T> ptr;
+			unsafe_functions::gc_weak_lock((void**)this, (void**)&ptr);
+			return ptr;
+		}
+	};
+
+	template<typename T>
+	class gc_vector
+	{
+		template<typename T2, typename ...TArgs>
+		friend gc_vector<T2> make_gc_array(int count, const TArgs& ...args);
+
+		template<typename T2, typename ...TArgs>
+		friend gc_vector<T2> make_gc_n(int count, const TArgs& ...args);
+	private:
+		// the block is one gc allocation holding T* slots, the collector scans it instead of tracking each slot
+		void*				block = nullptr;
+		int					count = 0;
+		int					capacity = 0;
+
+		static void* trace(void* reference)
+		{
+			return gc_ptr<T>::handle_of((T*)reference);
+		}
+
+		T** items()const
+		{
+			return (T**)block;
+		}
+
+		void reallocate(int new_capacity)
+		{
+			void* old_block = block;
+			void* new_block = nullptr;
+			if (new_capacity > 0)
+			{
+				new_block = calloc(new_capacity, sizeof(T*));
+				if (!new_block) throw std::bad_alloc();
+				gc_record record;
+				record.start = new_block;
+				record.length = new_capacity * sizeof(T*);
+				unsafe_functions::gc_alloc_block(record, &trace);
+				unsafe_functions::gc_block_copy(new_block, old_block, count * sizeof(T*));
+			}
+
+			block = new_block;
+			capacity = new_capacity;
+			unsafe_functions::gc_ref((void**)this, old_block, new_block);
+			if (new_block)
+			{
+				unsafe_functions::gc_ref(nullptr, new_block, nullptr);
+			}
+			if (old_block)
+			{
+				unsafe_functions::gc_block_free(old_block);
+			}
+		}
+
+		void assign(T* const* references, int size)
+		{
+			if (size > capacity)
+			{
+				count = 0;
+				reallocate(size);
+			}
+			unsafe_functions::gc_block_copy(block, references, size * sizeof(T*));
+			if (size < count)
+			{
+				unsafe_functions::gc_block_copy(items() + size, nullptr, (count - size) * sizeof(T*));
+			}
+			count = size;
+		}
+	public:
+		gc_vector()
+		{
+			unsafe_functions::gc_ref_alloc((void**)this, nullptr);
+		}
+
+		gc_vector(int size)
+		{
+			unsafe_functions::gc_ref_alloc((void**)this, nullptr);
+			resize(size);
+		}
+
+		gc_vector(const gc_vector<T>& xs)
+		{
+			unsafe_functions::gc_ref_alloc((void**)this, nullptr);
+			assign(xs.items(), xs.count);
+		}
+
+		gc_vector(gc_vector<T>&& xs)
+			:block(xs.block), count(xs.count), capacity(xs.capacity)
+		{
+			unsafe_functions::gc_ref_alloc((void**)this, block);
+			xs.block = nullptr;
+			xs.count = 0;
+			xs.capacity = 0;
+			unsafe_functions::gc_ref((void**)&xs, block, nullptr);
+		}
+
+		~gc_vector()
+		{
+			void* old_block = block;
+			unsafe_functions::gc_ref_dealloc((void**)this, old_block);
+			if (old_block)
+			{
+				unsafe_functions::gc_block_free(old_block);
+			}
+		}
+
+		gc_vector<T>& operator=(const gc_vector<T>& xs)
+		{
+			if (this != &xs)
+			{
+				assign(xs.items(), xs.count);
+			}
+			return *this;
+		}
+
+		int size()const
+		{
+			return count;
+		}
+
+		bool empty()const
+		{
+			return count == 0;
+		}
+
+		gc_ptr<T> operator[](int index)const
+		{
+			return gc_ptr<T>(items()[index]);
+		}
+
+		gc_ptr<T> get(int index)const
+		{
+			return gc_ptr<T>(items()[index]);
+		}
+
+		void set(int index, const gc_ptr<T>& ptr)
+		{
+			unsafe_functions::gc_block_write((void**)(items() + index), ptr.reference);
+		}
+
+		void push_back(const gc_ptr<T>& ptr)
+		{
+			if (count == capacity)
+			{
+				reserve(capacity < 4 ? 4 : capacity * 2);
+			}
+			unsafe_functions::gc_block_write((void**)(items() + count), ptr.reference);
+			count++;
+		}
+
+		void pop_back()
+		{
+			unsafe_functions::gc_block_write((void**)(items() + count - 1), nullptr);
+			count--;
+		}
+
+		void reserve(int size)
+		{
+			if (size > capacity)
+			{
+				reallocate(size);
+			}
+		}
+
+		void resize(int size)
+		{
+			if (size > capacity)
+			{
+				reallocate(size > capacity * 2 ? size : capacity * 2);
+			}
+			else if (size < count)
+			{
+				unsafe_functions::gc_block_copy(items() + size, nullptr, (count - size) * sizeof(T*));
+			}
+			count = size;
+		}
+
+		void clear()
+		{
+			resize(0);
+		}
+	};
+
 	template<typename T, typename ...TArgs>
 	gc_ptr<T> make_gc(TArgs&& ...args)
 	{
@@ -142,6 +434,116 @@ namespace vczh
 		return ptr;
 	}
 
+	template<typename T, typename ...TArgs>
+	gc_vector<T> make_gc_array(int count, const TArgs& ...args)
+	{
+		gc_vector<T> xs;
+		if (count <= 0) return xs;
+
+		// all objects share one allocation, they are collected together when none of them is reachable
+		void* memory = malloc(sizeof(T) * count);
+		if (!memory) throw std::bad_alloc();
+		gc_record record;
+		record.start = memory;
+		record.length = sizeof(T) * count;
+		unsafe_functions::gc_alloc(record);
+
+		T* references = (T*)memory;
+		int constructed = 0;
+		try
+		{
+			for (; constructed < count; constructed++)
+			{
+				new(references + constructed)T(args...);
+			}
+		}
+		catch (...)
+		{
+			// the block is only referenced here, it is destroyed and freed before anything else could reach it
+			for (int i = 0; i < constructed; i++)
+			{
+				references[i].~T();
+			}
+			unsafe_functions::gc_block_free(memory);
+			throw;
+		}
+		record.handle = static_cast<enable_gc*>(references);
+		for (int i = 0; i < count; i++)
+		{
+			static_cast<enable_gc*>(references + i)->set_record(record);
+		}
+		unsafe_functions::gc_register_array(memory, record.handle, count);
+
+		try
+		{
+			std::vector<T*> items(count);
+			for (int i = 0; i < count; i++)
+			{
+				items[i] = references + i;
+			}
+			xs.assign(&items[0], count);
+		}
+		catch (...)
+		{
+			// the objects are complete, so they are left to the collector
+			unsafe_functions::gc_ref(nullptr, memory, nullptr);
+			throw;
+		}
+		unsafe_functions::gc_ref(nullptr, memory, nullptr);
+		return xs;
+	}
+
+	template<typename T, typename ...TArgs>
+	gc_vector<T> make_gc_n(int count, const TArgs& ...args)
+	{
+		gc_vector<T> xs;
+		if (count <= 0) return xs;
+
+		// objects are collected separately, but registered with one lock and no collection until all of them are constructed
+		std::vector<gc_record> records(count);
+		std::vector<T*> items(count);
+		for (int i = 0; i < count; i++)
+		{
+			records[i].start = malloc(sizeof(T));
+			records[i].length = sizeof(T);
+			if (!records[i].start)
+			{
+				for (int j = 0; j < i; j++)
+				{
+					free(records[j].start);
+				}
+				throw std::bad_alloc();
+			}
+		}
+		unsafe_functions::gc_alloc_n(&records[0], count);
+
+		int constructed = 0;
+		try
+		{
+			for (; constructed < count; constructed++)
+			{
+				T* reference = new(records[constructed].start)T(args...);
+				enable_gc* e = static_cast<enable_gc*>(reference);
+				records[constructed].handle = e;
+				e->set_record(records[constructed]);
+				items[constructed] = reference;
+			}
+			xs.assign(&items[0], count);
+		}
+		catch (...)
+		{
+			// nothing outside can reach these objects yet, they are destroyed and freed before collection is allowed again
+			for (int i = 0; i < constructed; i++)
+			{
+				items[i]->~T();
+			}
+			unsafe_functions::gc_unregister_n(&records[0], count);
+			throw;
+		}
+		unsafe_functions::gc_register_n(&records[0], count);
+		return xs;
+	}
+
 	template<typename T, typename U>
 	gc_ptr<T> static_gc_cast(const gc_ptr<U>& ptr)
 	{
@@ -0,0 +1,608 @@
+#include "linq.h"
+#include "linq_file.h"
+#include <chrono>
+#include <iostream>
+#include <fstream>
+#include <new>
+#include <stdlib.h>
+
+using namespace std;
+using namespace vczh;
+
+//////////////////////////////////////////////////////////////////
+// measuring
+//////////////////////////////////////////////////////////////////
+
+size_t allocations = 0;
+
+void* operator new(size_t size)
+{
+	allocations++;
+	if (void* memory = malloc(size)) return memory;
+	throw bad_alloc();
+}
+
+void operator delete(void* memory)noexcept
+{
+	free(memory);
+}
+
+void operator delete(void* memory, size_t)noexcept
+{
+	free(memory);
+}
+
+volatile long long sink = 0;
+
+template<typename TFunction>
+void measure(const char* name, int count, const TFunction& f)
+{
+	size_t before = allocations;
+	auto start = chrono::steady_clock::now();
+	sink += f();
+	double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	cout << name << ": " << ms << " ms, " << ms * 1000000 / count << " ns/element, " << allocations - before << " allocations" << endl;
+}
+
+//////////////////////////////////////////////////////////////////
+// benchmarks
+//////////////////////////////////////////////////////////////////
+
+// iterating a linq<T> costs one indirect call per operation and no allocation
+void hide_type(const vector<int>& xs)
+{
+	int count = (int)xs.size();
+	measure("typed select", count, [&]()
+	{
+		long long sum = 0;
+		for (auto x : from(xs).select([](int x){return x * 2; }))
+		{
+			sum += x;
+		}
+		return sum;
+	});
+	measure("linq<int> select", count, [&]()
+	{
+		linq<int> hidden = from(xs).select([](int x){return x * 2; });
+		long long sum = 0;
+		for (auto x : hidden)
+		{
+			sum += x;
+		}
+		return sum;
+	});
+	measure("linq<int> where", count, [&]()
+	{
+		linq<int> hidden = from(xs).where([](int x){return x % 3 != 0; });
+		long long sum = 0;
+		for (auto x : hidden)
+		{
+			sum += x;
+		}
+		return sum;
+	});
+	measure("linq<int> nested", count, [&]()
+	{
+		linq<int> hidden = from(xs);
+		linq<int> nested = hidden.select([](int x){return x + 1; });
+		return (long long)nested.count();
+	});
+}
+
+// sorting precomputed keys in one contiguous buffer
+void ordering(const vector<int>& xs)
+{
+	int count = (int)xs.size();
+	measure("order_by", count, [&]()
+	{
+		return (long long)from(xs).order_by([](int x){return (x * 7919) % 1000; }).count();
+	});
+	measure("order_by then_by", count, [&]()
+	{
+		return (long long)from(xs)
+			.order_by([](int x){return (x * 7919) % 1000; })
+			.then_by_descending([](int x){return x; })
+			.first();
+	});
+}
+
+// keeping a bounded heap instead of sorting everything
+void top_k(const vector<int>& xs)
+{
+	int count = (int)xs.size();
+	measure("order_by take(100)", count, [&]()
+	{
+		return (long long)from(xs).order_by([](int x){return (x * 7919) % 1000003; }).take(100).first();
+	});
+	measure("top_k(100)", count, [&]()
+	{
+		return (long long)from(xs).top_k(100, [](int x){return (x * 7919) % 1000003; }).first();
+	});
+}
+
+// hash based set operators against std::set
+void set_operators(const vector<int>& xs)
+{
+	int count = (int)xs.size();
+	measure("distinct", count, [&]()
+	{
+		return (long long)from(xs).select([](int x){return (x * 7919) % 1000003; }).distinct().count();
+	});
+	measure("distinct with std::set", count, [&]()
+	{
+		return (long long)from(xs).select([](int x){return (x * 7919) % 1000003; }).to_set().size();
+	});
+	measure("except_with", count, [&]()
+	{
+		return (long long)from(xs).except_with(from(xs).where([](int x){return x % 2 == 0; })).count();
+	});
+}
+
+// joining a million rows against a hundred thousand keys
+void joining(const vector<int>& xs)
+{
+	int count = (int)xs.size();
+	vector<int> ys(xs.begin(), xs.begin() + count / 10);
+	measure("join", count, [&]()
+	{
+		return (long long)from(xs).join(ys, [](int x){return x % 100000; }, [](int y){return y; }).count();
+	});
+	measure("group_join", count, [&]()
+	{
+		return (long long)from(ys).group_join(xs, [](int y){return y; }, [](int x){return x % 100000; }).count();
+	});
+}
+
+// flattening a hundred thousand small collections
+void flattening(const vector<int>& xs)
+{
+	int count = (int)xs.size();
+	measure("select_many", count, [&]()
+	{
+		return (long long)from(xs).select_many([](int x){return from_values({ x, x + 1, x + 2 }); }).count();
+	});
+}
+
+// counting and indexing random access pipelines without iterating them
+void random_access(const vector<int>& xs)
+{
+	int count = (int)xs.size();
+	measure("random access count", count, [&]()
+	{
+		auto e = from(xs).select([](int x){return x * 2; }).skip(10).take(count / 2);
+		return (long long)e.count() + e.element_at(count / 4) + e.last();
+	});
+	measure("to_vector", count, [&]()
+	{
+		return (long long)from(xs).select([](int x){return x * 2; }).to_vector().size();
+	});
+}
+
+// terminal operators push elements through the pipeline instead of pulling them with begin/end iterators
+void pushing(const vector<int>& xs)
+{
+	int count = (int)xs.size();
+	auto odd = [](int x){return x % 2 == 1; };
+	auto square = [](int x){return (long long)x * x; };
+	measure("hand written loop", count, [&]()
+	{
+		long long sum = 0;
+		for (auto x : xs)
+		{
+			if (odd(x)) sum += square(x);
+		}
+		return sum;
+	});
+	measure("pull where select", count, [&]()
+	{
+		long long sum = 0;
+		for (auto x : from(xs).where(odd).select(square))
+		{
+			sum += x;
+		}
+		return sum;
+	});
+	measure("push where select aggregate", count, [&]()
+	{
+		return from(xs).where(odd).select(square).aggregate(0LL, [](long long a, long long b){return a + b; });
+	});
+	measure("push where select for_each", count, [&]()
+	{
+		long long sum = 0;
+		from(xs).where(odd).select(square).for_each([&](long long x){sum += x; });
+		return sum;
+	});
+	measure("pull where count", count, [&]()
+	{
+		int counter = 0;
+		for (auto it = from(xs).where(odd).begin(), end = from(xs).where(odd).end(); it != end; ++it)
+		{
+			counter++;
+		}
+		return (long long)counter;
+	});
+	measure("push where count", count, [&]()
+	{
+		return (long long)from(xs).where(odd).count();
+	});
+	measure("push where to_vector", count, [&]()
+	{
+		return (long long)from(xs).where(odd).to_vector().size();
+	});
+	measure("push any (last element)", count, [&]()
+	{
+		int last = xs.back();
+		return (long long)from(xs).select([](int x){return x + 1; }).any([=](int x){return x == last + 1; });
+	});
+	measure("pull linq<T> where select", count, [&]()
+	{
+		linq<long long> hidden = from(xs).where(odd).select(square);
+		long long sum = 0;
+		for (auto x : hidden)
+		{
+			sum += x;
+		}
+		return sum;
+	});
+	measure("push linq<T> where select", count, [&]()
+	{
+		linq<long long> hidden = from(xs).where(odd).select(square);
+		return hidden.aggregate(0LL, [](long long a, long long b){return a + b; });
+	});
+	measure("push concat select_many", count, [&]()
+	{
+		auto pairs = from(xs).take(count / 2).concat(from(xs).skip(count / 2)).select_many([](int x){return std::vector<int>(1, x); });
+		return pairs.aggregate(0LL, [](long long a, int b){return a + b; });
+	});
+}
+
+// chunks of a random access source run on a work stealing pool
+void parallel(const vector<int>& xs)
+{
+	int count = (int)xs.size();
+	auto heavy = [](int x){double y = x; for (int i = 0; i < 16; i++) y = y * 0.5 + 1.0 / (y + 1); return y; };
+	auto plus = [](double a, double b){return a + b; };
+	measure("sequential heavy select sum", count, [&]()
+	{
+		return (long long)from(xs).select(heavy).aggregate(0.0, plus);
+	});
+	for (int threads = 2; threads <= 8; threads *= 2)
+	{
+		string name = "parallel(" + to_string(threads) + ") heavy select sum";
+		measure(name.c_str(), count, [&]()
+		{
+			return (long long)from(xs).as_parallel(threads).select(heavy).sum();
+		});
+	}
+	measure("parallel deterministic heavy select sum", count, [&]()
+	{
+		return (long long)from(xs).as_parallel().as_deterministic().select(heavy).sum();
+	});
+	measure("sequential where to_vector", count, [&]()
+	{
+		return (long long)from(xs).where([](int x){return x % 3 == 0; }).to_vector().size();
+	});
+	measure("parallel where to_vector", count, [&]()
+	{
+		return (long long)from(xs).as_parallel().where([](int x){return x % 3 == 0; }).to_vector().size();
+	});
+	measure("parallel unordered where to_vector", count, [&]()
+	{
+		return (long long)from(xs).as_parallel().as_unordered().where([](int x){return x % 3 == 0; }).to_vector().size();
+	});
+}
+
+// sum, min and max of contiguous int, float and double sources use SIMD kernels
+void vectorization(const vector<int>& xs)
+{
+	int count = (int)xs.size();
+	vector<float> fs(xs.begin(), xs.end());
+	vector<double> ds(xs.begin(), xs.end());
+	measure("scalar int sum", count, [&]()
+	{
+		return (long long)from(xs).aggregate(0, [](int a, int b){return a + b; });
+	});
+	measure("simd int sum", count, [&]()
+	{
+		return (long long)from(xs).sum();
+	});
+	measure("simd int max", count, [&]()
+	{
+		return (long long)from(xs).max();
+	});
+	measure("scalar float sum", count, [&]()
+	{
+		return (long long)from(fs).aggregate(0.0f, [](float a, float b){return a + b; });
+	});
+	measure("simd float sum", count, [&]()
+	{
+		return (long long)from(fs).sum();
+	});
+	measure("scalar double min", count, [&]()
+	{
+		return (long long)from(ds).aggregate([](double a, double b){return a < b ? a : b; });
+	});
+	measure("simd double min", count, [&]()
+	{
+		return (long long)from(ds).min();
+	});
+	measure("simd double average", count, [&]()
+	{
+		return (long long)from(ds).average<double>();
+	});
+}
+
+// repeated passes over a cached query compute each element once
+void caching(const vector<int>& xs)
+{
+	int count = (int)xs.size();
+	auto heavy = [](int x){double y = x; for (int i = 0; i < 16; i++) y = y * 0.5 + 1.0 / (y + 1); return y; };
+	measure("three passes without cache", count, [&]()
+	{
+		auto e = from(xs).select(heavy);
+		return (long long)(e.count() + e.max() + e.sum());
+	});
+	measure("three passes with cache", count, [&]()
+	{
+		auto e = from(xs).select(heavy).cache();
+		return (long long)(e.count() + e.max() + e.sum());
+	});
+	measure("three passes with materialize", count, [&]()
+	{
+		auto e = from(xs).select(heavy).materialize();
+		return (long long)(e.count() + e.max() + e.sum());
+	});
+}
+
+// reading lines through a memory mapping without copying them
+void files(const vector<int>& xs)
+{
+	int count = (int)xs.size();
+	const char* path = "linq_benchmark_lines.txt";
+	{
+		ofstream output(path);
+		for (auto x : xs)
+		{
+			output << "line " << x << "\n";
+		}
+	}
+	measure("getline into vector<string>", count, [&]()
+	{
+		ifstream input(path);
+		vector<string> lines;
+		string line;
+		while (getline(input, line))
+		{
+			lines.push_back(line);
+		}
+		return (long long)from(lines).where([](const string& s){return s.back() == '7'; }).count();
+	});
+	measure("from_lines", count, [&]()
+	{
+		return (long long)from_lines(path).where([](const string_slice& s){return s[s.size() - 1] == '7'; }).count();
+	});
+	measure("from_lines as_parallel", count, [&]()
+	{
+		return (long long)from_lines(path).as_parallel().where([](const string_slice& s){return s[s.size() - 1] == '7'; }).count();
+	});
+	remove(path);
+}
+
+// batches of a buffered source reuse one buffer, so memory is bounded by the batch size instead of the source
+void batching(const vector<int>& xs)
+{
+	int count = (int)xs.size();
+	auto odd = [](int x){return x % 2 == 1; };
+	measure("sum of groups of 1024 by group_by", count, [&]()
+	{
+		return from(xs).where(odd).group_by([](int x){return x / 2048; }).select([](const group_pair<int, int>& p){return p.second.sum(); }).max();
+	});
+	measure("sum of groups of 1024 by batch", count, [&]()
+	{
+		return from(xs).where(odd).batch(1024).select([](array_slice<int> s){return from(s).sum(); }).max();
+	});
+	measure("sum of sliding windows of 16 by window", count, [&]()
+	{
+		return from(xs).window(16).select([](array_slice<int> s){return from(s).sum(); }).max();
+	});
+}
+
+// aggregating by keys keeps one accumulator for each key instead of all elements
+void aggregating_by(const vector<int>& xs)
+{
+	int count = (int)xs.size();
+	auto key = [](int x){return x % 1000; };
+	measure("sum of 1000 groups by group_by", count, [&]()
+	{
+		return from(xs).group_by(key).select([](const group_pair<int, int>& p){return p.second.aggregate(0LL, [](long long a, int b){return a + b; }); }).max();
+	});
+	measure("sum of 1000 groups by sum_by", count, [&]()
+	{
+		return from(xs).sum_by(key, [](int x){return (long long)x; }).select([](const zip_pair<int, long long>& p){return p.second; }).max();
+	});
+	measure("count of 1000 groups by count_by", count, [&]()
+	{
+		return (long long)from(xs).count_by(key).select([](const zip_pair<int, int>& p){return p.second; }).max();
+	});
+}
+
+// adjacent operators are fused into one iterator or a cheaper terminal loop
+void fusing(const vector<int>& xs)
+{
+	int count = (int)xs.size();
+	auto odd = [](int x){return x % 2 == 1; };
+	auto small = [](int x){return x < 8000000; };
+	auto positive = [](int x){return x > 0; };
+	measure("range for over where(f).where(g).where(h)", count, [&]()
+	{
+		long long sum = 0;
+		for (auto x : from(xs).where(odd).where(small).where(positive)) sum += x;
+		return sum;
+	});
+	measure("range for over select(f).select(g).select(h)", count, [&]()
+	{
+		long long sum = 0;
+		for (auto x : from(xs).select([](int x){return x + 1; }).select([](int x){return x * 3; }).select([](int x){return x ^ 1; })) sum += x;
+		return sum;
+	});
+	measure("where(f).count()", count, [&]()
+	{
+		return (long long)from(xs).where(odd).count();
+	});
+	measure("select(f).sum()", count, [&]()
+	{
+		return (long long)from(xs).select([](int x){return x & 0xFF; }).sum();
+	});
+	measure("order_by(f).first()", count, [&]()
+	{
+		return (long long)from(xs).order_by([](int x){return -x; }).first();
+	});
+}
+
+// intermediate buffers of a request could come from an arena that is released at once
+void memory(const vector<int>& xs)
+{
+	int count = (int)xs.size();
+	auto request = [&](int i)
+	{
+		return (long long)from(xs.begin() + i, xs.begin() + i + 100)
+			.select([](int x){return x % 37; })
+			.distinct()
+			.group_by([](int x){return x % 10; })
+			.select([](const group_pair<int, int>& p){return p.second.order_by([](int x){return -x; }).first(); })
+			.sum();
+	};
+	measure("requests of 100 elements with the global allocator", count, [&]()
+	{
+		long long sum = 0;
+		for (int i = 0; i < count; i += 100) sum += request(i);
+		return sum;
+	});
+	measure("requests of 100 elements with linq_monotonic_resource", count, [&]()
+	{
+		long long sum = 0;
+		for (int i = 0; i < count; i += 100)
+		{
+			linq_monotonic_resource arena;
+			linq_memory_scope scope(&arena);
+			sum += request(i);
+		}
+		return sum;
+	});
+}
+
+// sorted runs in a temporary file merged while iterating, compared with sorting in memory
+void external_ordering(const vector<int>& xs)
+{
+	int count = (int)xs.size();
+	auto key = [](int x){return (x * 7919) % 1000003; };
+	measure("order_by in memory", count, [&]()
+	{
+		return (long long)from(xs).order_by(key).aggregate(0LL, [](long long a, int b){return a * 31 + b; });
+	});
+	measure("order_by 16MB budget", count, [&]()
+	{
+		return (long long)from(xs).order_by(key).with_memory_budget(16 << 20).aggregate(0LL, [](long long a, int b){return a * 31 + b; });
+	});
+	measure("order_by 1MB budget", count, [&]()
+	{
+		return (long long)from(xs).order_by(key).with_memory_budget(1 << 20).aggregate(0LL, [](long long a, int b){return a * 31 + b; });
+	});
+	measure("order_by 64KB budget", count, [&]()
+	{
+		return (long long)from(xs).order_by(key).with_memory_budget(64 << 10).aggregate(0LL, [](long long a, int b){return a * 31 + b; });
+	});
+}
+
+// cost of counting and timing every element of a stage
+void profiling(const vector<int>& xs)
+{
+	int count = (int)xs.size();
+	measure("where select order_by take", count, [&]()
+	{
+		return (long long)from(xs)
+			.where([](int x){return x % 3 != 0; })
+			.select([](int x){return (x * 7919) % 1000003; })
+			.order_by([](int x){return x; })
+			.take(10)
+			.sum();
+	});
+	linq_profiler profiler;
+	measure("profiled where select order_by take", count, [&]()
+	{
+		return (long long)from(xs)
+			.profile(profiler, "source")
+			.where([](int x){return x % 3 != 0; })
+			.profile(profiler, "where")
+			.select([](int x){return (x * 7919) % 1000003; })
+			.profile(profiler, "select")
+			.order_by([](int x){return x; })
+			.take(10)
+			.profile(profiler, "order_by take")
+			.sum();
+	});
+	printf("%s", profiler.report().c_str());
+}
+
+// partitioned hash aggregation on all cores, compared with the sequential query
+void parallel_grouping(const vector<int>& xs)
+{
+	int count = (int)xs.size();
+	auto many = [](int x){return (x * 7919) % 1000003; };
+	auto few = [](int x){return x % 1000; };
+	auto value = [](int x){return (long long)x; };
+	measure("sum_by 1M keys", count, [&]()
+	{
+		return (long long)from(xs).sum_by(many, value).count();
+	});
+	measure("parallel sum_by 1M keys", count, [&]()
+	{
+		return (long long)from(xs).as_parallel().sum_by(many, value).count();
+	});
+	measure("sum_by 1000 keys", count, [&]()
+	{
+		return (long long)from(xs).sum_by(few, value).count();
+	});
+	measure("parallel sum_by 1000 keys", count, [&]()
+	{
+		return (long long)from(xs).as_parallel().sum_by(few, value).count();
+	});
+	measure("group_by 1M keys", count, [&]()
+	{
+		return (long long)from(xs).group_by(many).count();
+	});
+	measure("parallel group_by 1M keys", count, [&]()
+	{
+		return (long long)from(xs).as_parallel().group_by(many).count();
+	});
+}
+
+int main()
+{
+	int count = 10000000;
+	vector<int> xs;
+	for (int i = 0; i < count; i++)
+	{
+		xs.push_back(i);
+	}
+	hide_type(xs);
+	ordering(vector<int>(xs.begin(), xs.begin() + count / 10));
+	top_k(xs);
+	set_operators(xs);
+	joining(vector<int>(xs.begin(), xs.begin() + count / 10));
+	flattening(vector<int>(xs.begin(), xs.begin() + count / 100));
+	random_access(xs);
+	pushing(xs);
+	parallel(xs);
+	vectorization(xs);
+	caching(vector<int>(xs.begin(), xs.begin() + count / 10));
+	files(xs);
+	batching(xs);
+	aggregating_by(xs);
+	fusing(xs);
+	memory(vector<int>(xs.begin(), xs.begin() + count / 10));
+	external_ordering(vector<int>(xs.begin(), xs.begin() + count / 10));
+	profiling(vector<int>(xs.begin(), xs.begin() + count / 10));
+	parallel_grouping(xs);
+	return 0;
+}
@@ -5,7 +5,9 @@
 #endif
 #include <assert.h>
 #include "linq.h"
+#include "linq_file.h"
 #include <iostream>
+#include <algorithm>
 
 using namespace std;
 using namespace vczh;
@@ -23,6 +25,67 @@ struct pet
 	person		owner;
 };
 
+class counting_resource : public linq_memory_resource
+{
+public:
+	int			allocations = 0;
+	int			deallocations = 0;
+	size_t		bytes = 0;
+	size_t		peak = 0;			// the largest number of bytes in use at the same time
+
+protected:
+	void* do_allocate(size_t size, size_t alignment)override
+	{
+		allocations++;
+		bytes += size;
+		if (peak < bytes) peak = bytes;
+		return linq_default_resource()->allocate(size, alignment);
+	}
+
+	void do_deallocate(void* p, size_t size, size_t alignment)override
+	{
+		deallocations++;
+		bytes -= size;
+		linq_default_resource()->deallocate(p, size, alignment);
+	}
+
+	bool do_is_equal(const linq_memory_resource& other)const noexcept override
+	{
+		return this == &other;
+	}
+};
+
+namespace vczh
+{
+	template<>
+	struct linq_serializer<string>
+	{
+		static bool write(FILE* file, const string* values, int count)
+		{
+			for (int i = 0; i < count; i++)
+			{
+				int size = (int)values[i].size();
+				if (fwrite(&size, sizeof(size), 1, file) != 1) return false;
+				if ((int)fwrite(values[i].data(), 1, size, file) != size) return false;
+			}
+			return true;
+		}
+
+		static bool read(FILE* file, linq_vector<string>& values, int count)
+		{
+			for (int i = 0; i < count; i++)
+			{
+				int size = 0;
+				if (fread(&size, sizeof(size), 1, file) != 1) return false;
+				string value(size, ' ');
+				if ((int)fread(&value[0], 1, size, file) != size) return false;
+				values.push_back(value);
+			}
+			return true;
+		}
+	};
+}
+
 int main()
 {
 	test();
@@ -155,6 +218,20 @@ int test()
 		linq<int> hidden = from(xs).select([](int x){return x * 2; });
 		assert(hidden.sequence_equal({ 2, 4, 6, 8, 10 }));
 	}
+	{
+		// iterators too large to be stored inside hide_type_iterator
+		struct large { int values[64]; } l = { { 1 } };
+		int xs[] = { 1, 2, 3, 4, 5 };
+		linq<int> hidden = from(xs).select([l](int x){return x * 2 * l.values[0]; });
+		linq<int> copied = hidden;
+		assert(copied.sequence_equal({ 2, 4, 6, 8, 10 }));
+		assert(linq<int>(hidden.where([](int x){return x > 4; })).sequence_equal({ 6, 8, 10 }));
+		auto it = hidden.begin();
+		auto it2 = it++;
+		assert(*it2 == 2 && *it == 4);
+		it2 = it;
+		assert(it2 == it && *++it2 == 6 && it2 != it);
+	}
 	//////////////////////////////////////////////////////////////////
 	// where
 	//////////////////////////////////////////////////////////////////
@@ -184,6 +261,53 @@ int test()
 		assert(from(xs).concat(empty).sequence_equal(xs));
 		assert(from(empty).concat(xs).sequence_equal(xs));
 		assert(from(empty).concat(empty).sequence_equal(empty));
+
+		// pushing calls predicates once for every element, as pulling does
+		int calls = 0;
+		auto odd = from(xs).where([&](int a){calls++; return a % 2 == 1; });
+		assert(odd.sum() == 9 && calls == 5);
+		calls = 0;
+		auto small = from(xs).take_while([&](int a){calls++; return a < 4; });
+		assert(small.sum() == 6 && calls == 4);
+	}
+	//////////////////////////////////////////////////////////////////
+	// random access
+	//////////////////////////////////////////////////////////////////
+	{
+		vector<int> xs = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+		int ys[] = { 1, 2, 3 };
+		auto f = [](int x){return x * 10; };
+		auto g = [](int x){return x % 2 == 0; };
+		auto e = from(xs).select(f).skip(2).take(5);
+		static_assert(is_random_access<decltype(e.begin())>::value, "select, skip and take should keep random access.");
+		static_assert(is_random_access<decltype(from(ys).zip_with(e).begin())>::value, "zip should keep random access.");
+		static_assert(!is_random_access<decltype(from(xs).where(g).begin())>::value, "where should not be random access.");
+
+		assert(e.sequence_equal({ 30, 40, 50, 60, 70 }));
+		assert(e.count() == 5);
+		assert(e.size_hint() == 5);
+		assert(from(xs).where(g).size_hint() == -1);
+		assert(e.element_at(0) == 30);
+		assert(e.element_at(4) == 70);
+		try{ e.element_at(5); assert(false); }
+		catch (const linq_exception&){}
+		assert(e.last() == 70);
+		assert(e.skip(5).last_or_default(0) == 0);
+		assert(e.skip(3).sequence_equal({ 60, 70 }));
+		assert(e.take(10).count() == 5);
+		assert(e.take(-1).empty());
+		assert(from(xs).skip(8).take(5).sequence_equal({ 9, 10 }));
+		assert(from(xs).where(g).take(2).sequence_equal({ 2, 4 }));
+		assert(from(xs).where(g).last() == 10);
+		assert(from(xs).select(f).take_while([](int x){return x < 40; }).sequence_equal({ 10, 20, 30 }));
+		assert(from(xs).take_while([](int x){return x < 4; }).skip(1).sequence_equal({ 2, 3 }));
+		assert(from(xs).take_while([](int x){return true; }).sequence_equal(xs));
+
+		assert(from(ys).zip_with(e).count() == 3);
+		assert((from(ys).zip_with(e).last() == zip_pair<int, int>(3, 50)));
+		assert(e.zip_with(ys).select([](const zip_pair<int, int>& p){return p.first + p.second; }).sequence_equal({ 31, 42, 53 }));
+		assert(from(xs).where(g).zip_with(ys).count() == 3);
+		assert(from(xs).order_by([](int x){return -x; }).take(3).last() == 8);
 	}
 	//////////////////////////////////////////////////////////////////
 	// counting
@@ -294,6 +418,147 @@ int test()
 		catch (const linq_exception&){}
 		try{ from(ys).average<int>(); assert(false); }
 		catch (const linq_exception&){}
+
+		int visited = 0;
+		from(xs).where([](int x){return x % 2 == 1; }).for_each([&](int x){visited += x; });
+		assert(visited == 9);
+
+		visited = 0;
+		assert(from(xs).select([&](int x){visited++; return x; }).any([](int x){return x == 2; }) == true);
+		assert(visited == 2);
+		visited = 0;
+		assert(from(xs).select([&](int x){visited++; return x; }).all([](int x){return x < 3; }) == false);
+		assert(visited == 3);
+		assert(from(xs).contains(3) && !from(xs).contains(6));
+
+		visited = 0;
+		auto counted = from(xs).select([&](int x){visited++; return x; });
+		assert(counted.take(2).sum() == 3 && visited == 2);
+		assert(from(xs).take_while([](int x){return x < 4; }).sum() == 6);
+		assert(from(xs).skip(1).skip_while([](int x){return x < 3; }).product() == 60);
+		assert(from(xs).concat(from(xs).take(0)).concat({ 6 }).sum() == 21);
+		assert(from(xs).take(0).concat(from(xs)).count() == 5);
+		assert(from(xs).select_many([](int x){return vector<int>(x, x); }).sum() == 55);
+		assert(from(xs).select_many([](int x){return vector<int>(x % 2, x); }).to_vector() == vector<int>({ 1, 3, 5 }));
+		assert(linq<int>(from(xs).where([](int x){return x > 1; })).aggregate([](int a, int b){return a * b; }) == 120);
+		assert(from(xs).order_by([](int x){return -x; }).skip(1).to_list() == list<int>({ 4, 3, 2, 1 }));
+
+		vector<long long> bigs = { 3000000000LL, 4000000000LL };
+		assert(from(bigs).sum() == 7000000000LL);
+		assert(from(bigs).where([](long long x){return x > 0; }).sum() == 7000000000LL);
+		assert(from(vector<double>{ 0.5, 0.25 }).sum() == 0.75);
+		assert(from(ys).sum() == 0);
+
+		auto doubled = from(xs).select_many([](int x){return vector<int>(2, x); });
+		auto it = doubled.begin();
+		++it;
+		assert(from(it, doubled.end()).sum() == 29);
+	}
+	//////////////////////////////////////////////////////////////////
+	// fusion
+	//////////////////////////////////////////////////////////////////
+	{
+		int xs[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+		auto odd = [](int x){return x % 2 == 1; };
+		auto small = [](int x){return x < 8; };
+		auto twice = [](int x){return x * 2; };
+		auto next = [](int x){return x + 1; };
+
+		auto ww = from(xs).where(odd).where(small);
+		static_assert(is_same<decltype(ww.begin()), types::where_it<const int*, fusion::conjunction<decltype(odd), decltype(small)>>>::value, "where(f).where(g) should be one iterator.");
+		assert(ww.sequence_equal({ 1, 3, 5, 7 }));
+		assert(from(xs).where(odd).where(small).where([](int x){return x > 1; }).sequence_equal({ 3, 5, 7 }));
+
+		auto ss = from(xs).select(twice).select(next);
+		static_assert(is_same<decltype(ss.begin()), types::select_it<const int*, fusion::composition<decltype(twice), decltype(next)>>>::value, "select(f).select(g) should be one iterator.");
+		assert(ss.sequence_equal({ 3, 5, 7, 9, 11, 13, 15, 17, 19, 21 }));
+		assert(from(xs).select(twice).select([](int x){return to_string(x); }).select([](const string& x){return x.size(); }).sum() == 16);
+
+		auto st = from(xs).select(twice).take(3);
+		static_assert(is_same<decltype(st.begin()), types::select_it<types::take_it<const int*>, decltype(twice)>>::value, "select(f).take(n) should be take(n).select(f).");
+		assert(st.sequence_equal({ 2, 4, 6 }));
+		assert(from(xs).where(odd).select(twice).take(2).sequence_equal({ 2, 6 }));
+		assert(from(xs).select(twice).take(0).empty() && from(xs).select(twice).take(20).count() == 10);
+
+		int calls = 0;
+		auto counted = [&](int x){calls++; return x; };
+		assert(from(xs).where(odd).count() == 5 && from(xs).where(odd).where(small).count() == 4);
+		assert(from(xs).where([](int x){return x > 100; }).count() == 0 && from(xs).where(small).where(odd).count() == 4);
+		assert(from(xs).where(odd).select(counted).count() == 5 && calls == 0);
+
+		assert(from(xs).select(twice).sum() == 110 && from(xs).select(next).select(twice).sum() == 130);
+		assert(from(xs).select([](int x){return x * 0.5; }).sum() == 27.5);
+		assert(from(xs).take(3).select(twice).sum() == 12 && from(xs).where(odd).select(twice).sum() == 50);
+		assert(from_empty<int>().select(twice).sum() == 0 && from(vector<int>()).select(twice).sum() == 0);
+
+		int ys[] = { 7, 1, 12, 2, 8, 3, 11, 4, 9, 5, 13, 6, 10 };
+		assert(from(ys).order_by([](int x){return x % 10; }).first() == 10);
+		assert(from(ys).order_by([](int x){return x % 10; }).then_by_descending([](int x){return x; }).first() == 10);
+		assert(from(ys).order_by_descending([](int x){return x % 5; }).first() == 4);
+		assert(from_empty<int>().order_by([](int x){return x; }).first_or_default(-1) == -1);
+	}
+	//////////////////////////////////////////////////////////////////
+	// vectorization
+	//////////////////////////////////////////////////////////////////
+	{
+		static_assert(is_contiguous<vector<int>::const_iterator>::value, "vector iterators are contiguous.");
+		static_assert(is_contiguous<const double*>::value, "pointers are contiguous.");
+		static_assert(!is_contiguous<list<int>::const_iterator>::value, "list iterators are not contiguous.");
+		static_assert(!is_contiguous<vector<bool>::const_iterator>::value, "bool is not arithmetic here.");
+
+		vector<int> is;
+		vector<int> ps;
+		vector<float> fs;
+		vector<double> ds;
+		for (int i = 0; i < 1000; i++)
+		{
+			is.push_back(i * 7919 % 1009 - 500);
+			ps.push_back(i % 3 == 0 ? -1 : 1);
+			fs.push_back((float)(i % 17) - 8.5f);
+			ds.push_back((i * 7919 % 1009) * 0.25 - 100);
+		}
+
+		for (int count = 1; count <= 100; count += 11)
+		{
+			auto i = from(is.begin(), is.begin() + count);
+			auto f = from(fs.begin(), fs.begin() + count);
+			auto d = from(ds.begin(), ds.begin() + count);
+			auto il = i.to_list();
+			auto fl = f.to_list();
+			auto dl = d.to_list();
+			assert(i.sum() == from(il).sum() && i.min() == from(il).min() && i.max() == from(il).max());
+			auto pl = from(ps.begin(), ps.begin() + count).to_list();
+			assert(from(ps.begin(), ps.begin() + count).product() == from(pl).product());
+			assert(f.sum() == from(fl).sum() && f.min() == from(fl).min() && f.max() == from(fl).max());
+			assert(d.sum() == from(dl).sum() && d.min() == from(dl).min() && d.max() == from(dl).max());
+			assert(from_values(make_shared<vector<int>>(il.begin(), il.end())).sum() == from(il).sum());
+			assert(d.average<double>() == from(dl).average<double>());
+		}
+
+		// each kernel against the scalar loop, when the CPU supports it
+		int n = (int)is.size();
+#ifdef LINQ_SIMD_X86
+		if (simd::level() >= 1)
+		{
+			assert((simd::reduce_sse<simd::sse_int, simd::add>(&is[0], n, 1) == simd::reduce_scalar<simd::add>(&is[0], n, 1)));
+			assert((simd::reduce_sse<simd::sse_int, simd::multiply>(&ps[0], n, 1) == simd::reduce_scalar<simd::multiply>(&ps[0], n, 1)));
+			assert((simd::reduce_sse<simd::sse_int, simd::minimum>(&is[0], n, 0) == simd::reduce_scalar<simd::minimum>(&is[0], n, 0)));
+			assert((simd::reduce_sse<simd::sse_int, simd::maximum>(&is[0], n, 0) == simd::reduce_scalar<simd::maximum>(&is[0], n, 0)));
+			assert((simd::reduce_sse<simd::sse_float, simd::maximum>(&fs[0], n, 0.0f) == 7.5f));
+			assert((simd::reduce_sse<simd::sse_double, simd::minimum>(&ds[0], n, 0.0) == -100));
+		}
+		if (simd::level() >= 2)
+		{
+			assert((simd::reduce_avx2<simd::avx2_int, simd::add>(&is[0], n, 1) == simd::reduce_scalar<simd::add>(&is[0], n, 1)));
+			assert((simd::reduce_avx2<simd::avx2_int, simd::multiply>(&ps[0], n, 1) == simd::reduce_scalar<simd::multiply>(&ps[0], n, 1)));
+			assert((simd::reduce_avx2<simd::avx2_int, simd::minimum>(&is[0], n, 0) == simd::reduce_scalar<simd::minimum>(&is[0], n, 0)));
+			assert((simd::reduce_avx2<simd::avx2_int, simd::maximum>(&is[0], n, 0) == simd::reduce_scalar<simd::maximum>(&is[0], n, 0)));
+			assert((simd::reduce_avx2<simd::avx2_float, simd::minimum>(&fs[0], n, 0.0f) == -8.5f));
+			assert((simd::reduce_avx2<simd::avx2_double, simd::maximum>(&ds[0], n, 0.0) == 1008 * 0.25 - 100));
+		}
+#endif
+		assert(from(ds).as_parallel(3).sum() == from(ds).sum());
+		assert(from(is).as_parallel(3).min() == -500);
 	}
 	//////////////////////////////////////////////////////////////////
 	// set
@@ -307,6 +572,36 @@ int test()
 		assert(from(xs).intersect_with(ys).sequence_equal({ 2, 3 }));
 		assert(from(xs).union_with(ys).sequence_equal({ 1, 2, 3, 4 }));
 	}
+	{
+		string xs[] = { "b", "A", "a", "B", "c", "b" };
+		auto hash = [](const string& s){return std::hash<char>()((char)tolower(s[0])); };
+		auto equal = [](const string& a, const string& b){return tolower(a[0]) == tolower(b[0]); };
+		assert(from(xs).distinct().sequence_equal({ "b", "A", "a", "B", "c" }));
+		assert(from(xs).distinct(hash, equal).sequence_equal({ "b", "A", "c" }));
+		assert(from(xs).distinct_by([](const string& s){return tolower(s[0]); }).sequence_equal({ "b", "A", "c" }));
+		assert(from(xs).distinct_by([](const string& s){return s; }, hash, equal).sequence_equal({ "b", "A", "c" }));
+		assert(from(xs).except_with({ "a", "b" }).sequence_equal({ "A", "B", "c" }));
+		assert(from(xs).intersect_with({ "c", "b" }).sequence_equal({ "b", "c" }));
+
+		zip_pair<int, int> ps[] = { { 1, 2 }, { 2, 1 }, { 1, 2 } };
+		assert(from(ps).distinct().count() == 2);
+		assert(from(ps).distinct_by([](const zip_pair<int, int>& p){return p.first + p.second; }).count() == 1);
+
+		vector<int> ys, zs;
+		for (int i = 0; i < 10000; i++)
+		{
+			ys.push_back((i * 7919) % 3001);
+		}
+		for (auto y : ys)
+		{
+			if (find(zs.begin(), zs.end(), y) == zs.end())
+			{
+				zs.push_back(y);
+			}
+		}
+		assert(from(ys).distinct().sequence_equal(zs));
+		assert(from(ys).except_with(from(zs).where([](int x){return x % 2 == 0; })).sequence_equal(from(zs).where([](int x){return x % 2 == 1; })));
+	}
 	//////////////////////////////////////////////////////////////////
 	// restructuring
 	//////////////////////////////////////////////////////////////////
@@ -321,12 +616,112 @@ int test()
 		assert(g.select([](zip_pair<int, linq<int>> p){return p.first; }).sequence_equal({ 0, 1 }));
 		assert(g.first().second.sequence_equal({ 2, 4 }));
 		assert(g.last().second.sequence_equal({ 1, 3, 5 }));
+		assert(g.first().second.sum() == 6 && g.last().second.element_at(2) == 5);
+
+		// keys are sorted, and values keep their order in the source
+		auto h = from_values({ 7, 3, 10, 4, 1, 9 }).group_by([](int x){return x % 3 == 0 ? string("c") : x % 3 == 1 ? string("b") : string("a"); });
+		assert(h.select([](const group_pair<string, int>& p){return p.first; }).sequence_equal({ "b", "c" }));
+		assert(h.first().second.sequence_equal({ 7, 10, 4, 1 }) && h.last().second.sequence_equal({ 3, 9 }));
+		linq<zip_pair<string, linq<int>>> hidden = h;
+		assert(hidden.last().second.sequence_equal({ 3, 9 }));
+		assert(from(xs).group_by([](int x){return vector<int>(1, -x); }).select([](const group_pair<vector<int>, int>& p){return p.second.first(); }).sequence_equal({ 5, 4, 3, 2, 1 }));
+		assert(from_empty<int>().group_by([](int x){return x; }).empty());
+
+		// keys of aggregating operators keep the order they first appear
+		int ws[] = { 5, 2, 8, 3, 6, 11, 4 };
+		auto mod3 = [](int x){return x % 3; };
+		auto self = [](int x){return x; };
+		assert(from(ws).count_by(mod3).sequence_equal({ zip_pair<int, int>(2, 4), zip_pair<int, int>(0, 2), zip_pair<int, int>(1, 1) }));
+		assert(from(ws).sum_by(mod3, self).sequence_equal({ zip_pair<int, int>(2, 26), zip_pair<int, int>(0, 9), zip_pair<int, int>(1, 4) }));
+		assert(from(ws).sum_by(mod3, [](int x){return x * 0.5; }).select([](const zip_pair<int, double>& p){return p.second; }).sequence_equal({ 13.0, 4.5, 2.0 }));
+		assert(from(ws).min_by(mod3, self).sequence_equal({ zip_pair<int, int>(2, 2), zip_pair<int, int>(0, 3), zip_pair<int, int>(1, 4) }));
+		assert(from(ws).max_by(mod3, self).sequence_equal({ zip_pair<int, int>(2, 11), zip_pair<int, int>(0, 6), zip_pair<int, int>(1, 4) }));
+		assert(
+			from(ws)
+			.aggregate_by([](int x){return x % 2 == 0 ? string("even") : string("odd"); }, string(), [](const string& a, int x){return a + to_string(x); })
+			.sequence_equal({ zip_pair<string, string>("odd", "5311"), zip_pair<string, string>("even", "2864") })
+			);
+		assert(from(ws).where([](int x){return x > 100; }).count_by(mod3).empty());
+		assert(from(ws).count_by([](int x){return vector<int>(1, x % 2); }).count() == 2);
 
 		assert(
 			from_values({ 1, 2, 3 })
 			.select_many([](int x){return from_values({ x, x*x, x*x*x }); })
 			.sequence_equal({ 1, 1, 1, 2, 4, 8, 3, 9, 27 })
 			);
+		assert(
+			from_values({ 0, 1, 0, 2, 0 })
+			.select_many([](int x){return vector<int>(x, x); })
+			.sequence_equal({ 1, 2, 2 })
+			);
+		assert(from_values({ 0, 0 }).select_many([](int x){return vector<int>(x, x); }).empty());
+		assert(from(xs).group_by([](int x){return x % 2; })
+			.select_many([](const zip_pair<int, linq<int>>& p){return p.second; })
+			.sequence_equal({ 2, 4, 1, 3, 5 }));
+
+		auto many = from(xs).select_many([](int x){return from_values({ x, -x }); });
+		auto it = many.begin();
+		auto it2 = it++;
+		assert(*it2 == 1 && *it == -1 && it != it2 && ++it2 == it);
+		assert(many.begin() == many.begin() && ++many.begin() == it);
+
+		// the function is not called until elements are read
+		int calls = 0;
+		auto lazy = from(xs).select_many([&](int x){calls++; return vector<int>(x, x); });
+		auto lazyBegin = lazy.begin();
+		auto lazyEnd = lazy.end();
+		assert(calls == 0);
+		assert(lazyBegin != lazyEnd && calls == 1);
+		assert(*lazyBegin == 1 && calls == 1);
+		assert(lazy.count() == 15 && calls == 6);
+		assert(from_values({ 100000 }).select_many([](int x){return from_values(make_shared<vector<int>>(x, 1)).select([](int y){return vector<int>(1, y); }); }).count() == 100000);
+	}
+	//////////////////////////////////////////////////////////////////
+	// batching
+	//////////////////////////////////////////////////////////////////
+	{
+		int xs[] = { 1, 2, 3, 4, 5, 6, 7 };
+		auto copy = [](array_slice<int> s){return s.to_vector(); };
+		auto sum = [](array_slice<int> s){return from(s).sum(); };
+		auto key = [](const zip_pair<int, array_slice<int>>& p){return p.first; };
+		auto copyChunk = [](const zip_pair<int, array_slice<int>>& p){return p.second.to_vector(); };
+
+		// contiguous sources are sliced directly, others are copied to a buffer
+		assert(from(xs).batch(3).select(copy).sequence_equal({ vector<int>{ 1, 2, 3 }, vector<int>{ 4, 5, 6 }, vector<int>{ 7 } }));
+		assert(from(xs).select([](int x){return x; }).batch(3).select(copy).sequence_equal({ vector<int>{ 1, 2, 3 }, vector<int>{ 4, 5, 6 }, vector<int>{ 7 } }));
+		assert(from(xs).where([](int x){return x > 1; }).batch(2).select(sum).sequence_equal({ 5, 9, 13 }));
+		assert(from(xs).batch(7).count() == 1 && from(xs).batch(100).first().size() == 7);
+		assert(from_empty<int>().batch(3).empty());
+		assert(from(xs).batch(1).select(copy).select([](const vector<int>& v){return v[0]; }).sequence_equal(xs));
+
+		assert(from(xs).window(3).select(sum).sequence_equal({ 6, 9, 12, 15, 18 }));
+		assert(from(xs).select([](int x){return x; }).window(3).select(sum).sequence_equal({ 6, 9, 12, 15, 18 }));
+		assert(from(xs).window(2, 3).select(copy).sequence_equal({ vector<int>{ 1, 2 }, vector<int>{ 4, 5 } }));
+		assert(from(xs).where([](int x){return true; }).window(2, 3).select(copy).sequence_equal({ vector<int>{ 1, 2 }, vector<int>{ 4, 5 } }));
+		assert(from(xs).where([](int x){return true; }).window(3, 2).select(sum).sequence_equal({ 6, 12, 18 }));
+		assert(from(xs).window(7).count() == 1 && from(xs).window(8).empty());
+		assert(from(xs).where([](int x){return true; }).window(7).count() == 1 && from(xs).where([](int x){return true; }).window(8).empty());
+
+		int ys[] = { 1, 1, 2, 3, 3, 3, 1 };
+		assert(from(ys).chunk_by([](int x){return x; }).select(key).sequence_equal({ 1, 2, 3, 1 }));
+		assert(from(ys).chunk_by([](int x){return x; }).select(copyChunk).sequence_equal({ vector<int>{ 1, 1 }, vector<int>{ 2 }, vector<int>{ 3, 3, 3 }, vector<int>{ 1 } }));
+		assert(from(xs).chunk_by([](int x){return x / 3; }).select(copyChunk).sequence_equal({ vector<int>{ 1, 2 }, vector<int>{ 3, 4, 5 }, vector<int>{ 6, 7 } }));
+		assert(from_values({ 1, 2 }).chunk_by([](int x){return x; }).count() == 2);
+		assert(from_empty<int>().chunk_by([](int x){return x; }).empty());
+
+		auto chunks = from(ys).chunk_by([](int x){return x; });
+		auto it = chunks.begin();
+		auto it2 = it++;
+		assert((*it2).first == 1 && (*it).first == 2 && it != it2 && ++it2 == it);
+
+		try
+		{
+			from(xs).batch(0);
+			assert(false);
+		}
+		catch (const linq_exception&)
+		{
+		}
 	}
 	//////////////////////////////////////////////////////////////////
 	// ordering
@@ -337,6 +732,127 @@ int test()
 		int zs[] = { 10, 1, 11, 2, 12, 3, 13, 4, 5, 6, 7, 8, 9 };
 
 		assert(from(xs).order_by([](int x){return x; }).sequence_equal(ys));
+		assert(from(xs).order_by_descending([](int x){return -x; }).sequence_equal(ys));
+		assert(from(xs).order_by([](int x){return x % 10; }).then_by([](int x){return x / 10; }).sequence_equal(zs));
+		assert(from(xs).order_by_descending([](int x){return x % 10; }).sequence_equal({ 9, 8, 7, 6, 5, 4, 3, 13, 12, 2, 1, 11, 10 }));
+		assert(from(xs).order_by([](int x){return x % 10; }).then_by_descending([](int x){return x / 10; }).sequence_equal({ 10, 11, 1, 12, 2, 13, 3, 4, 5, 6, 7, 8, 9 }));
+		assert(from(xs).order_by([](int x){return x % 2; }).then_by([](int x){return x % 3; }).then_by([](int x){return x; }).sequence_equal({ 6, 12, 4, 10, 2, 8, 3, 9, 1, 7, 13, 5, 11 }));
+		assert(from(xs).order_by([](int x){return 0; }).sequence_equal(xs));
+		assert(from_empty<int>().order_by([](int x){return x; }).then_by([](int x){return x; }).empty());
+
+		assert(from(xs).order_by([](int x){return x % 10; }).take(5).sequence_equal({ 10, 1, 11, 12, 2 }));
+		assert(from(xs).order_by([](int x){return x % 10; }).then_by_descending([](int x){return x / 10; }).take(3).sequence_equal({ 10, 11, 1 }));
+		assert(from(xs).order_by([](int x){return x; }).take(0).empty());
+		assert(from(xs).order_by([](int x){return x; }).take(20).sequence_equal(ys));
+		assert(from(xs).top_k(3, [](int x){return x; }).sequence_equal({ 13, 12, 11 }));
+
+		// take, first and with_memory_budget read the source when they are called, and a sorted result keeps its copy after the first iteration
+		// so they outlive the container and ignore later changes
+		auto sorted3 = []()
+		{
+			vector<int> container = { 3, 1, 2 };
+			auto ordered = from(container).order_by([](int x){return x; });
+			assert(ordered.count() == 3);
+			return ordered;
+		};
+		auto top2 = []()
+		{
+			vector<int> container = { 3, 1, 2 };
+			return from(container).order_by([](int x){return x; }).then_by_descending([](int x){return x; }).take(2);
+		};
+		auto external3 = []()
+		{
+			vector<int> container = { 3, 1, 2 };
+			return from(container).order_by([](int x){return x; }).with_memory_budget(sizeof(int));
+		};
+		assert(sorted3().sequence_equal({ 1, 2, 3 }));
+		assert(top2().sequence_equal({ 1, 2 }));
+		assert(external3().sequence_equal({ 1, 2, 3 }));
+		vector<int> changing = { 3, 1, 2 };
+		auto snapshot = from(changing).order_by([](int x){return x; });
+		auto best = from(changing).top_k(1, [](int x){return x; });
+		assert(snapshot.first() == 1);
+		assert(snapshot.sequence_equal({ 1, 2, 3 }));
+		changing.push_back(0);
+		changing[0] = 4;
+		assert(snapshot.sequence_equal({ 1, 2, 3 }) && best.sequence_equal({ 3 }));
+
+		// take and top_k keep a heap of <count> elements instead of copying the source
+		{
+			vector<int> many;
+			for (int i = 0; i < 100000; i++)
+			{
+				many.push_back(i * 7919 % 100003);
+			}
+			counting_resource counting;
+			linq_memory_scope scope(&counting);
+			assert(from(many).order_by([](int x){return x; }).take(3).sequence_equal({ 0, 1, 2 }));
+			assert(from(many).top_k(2, [](int x){return x; }).sequence_equal({ 100002, 100001 }));
+			assert(from(many).order_by_descending([](int x){return x; }).first() == 100002);
+			assert(counting.peak < 1024);
+		}
+		{
+			// runs are written while the source is streamed, so the buffers are bounded by the budget instead of the source
+			vector<int> many;
+			for (int i = 0; i < 100000; i++)
+			{
+				many.push_back(i * 7919 % 100003);
+			}
+			counting_resource counting;
+			linq_memory_scope scope(&counting);
+			auto external = from(many).order_by([](int x){return x; }).with_memory_budget(4096);
+			assert(external.take(3).sequence_equal({ 0, 1, 2 }));
+			assert(external.count() == 100000);
+			assert(counting.peak < 64 * 1024);
+		}
+
+		unsigned seed = 1;
+		vector<int> random;
+		for (int i = 0; i < 200; i++)
+		{
+			seed = seed * 1103515245 + 12345;
+			random.push_back((seed >> 16) % 50);
+		}
+		auto sorted = from(random).order_by([](int x){return x / 5; }).then_by_descending([](int x){return x % 2; }).to_vector();
+		for (int k = 0; k <= 201; k += 7)
+		{
+			auto top = from(random).order_by([](int x){return x / 5; }).then_by_descending([](int x){return x % 2; }).take(k);
+			assert(top.sequence_equal(from(sorted).take(k)));
+		}
+		for (int budget : { 1, 4, 64, 799, 800, 1 << 20 })
+		{
+			auto external = from(random).order_by([](int x){return x / 5; }).then_by_descending([](int x){return x % 2; }).with_memory_budget(budget);
+			assert(external.sequence_equal(sorted));
+			assert(external.sequence_equal(sorted));
+		}
+		{
+			auto external = from(xs).order_by([](int x){return x; }).with_memory_budget(12);
+			auto it = external.begin();
+			auto copy = it++;
+			assert(*copy == 1 && *it == 2);
+			assert(*++copy == 2 && *++copy == 3);
+			assert(linq_enumerable<decltype(it)>(it, external.end()).sequence_equal(from(ys).skip(1)));
+			assert(external.sequence_equal(ys));
+		}
+		{
+			// iterators in different threads read the same temporary file
+			auto external = from(random).order_by([](int x){return x / 5; }).then_by_descending([](int x){return x % 2; }).with_memory_budget(64);
+			bool equal[4];
+			vector<thread> threads;
+			for (int i = 0; i < 4; i++)
+			{
+				threads.push_back(thread([&, i](){equal[i] = external.sequence_equal(sorted); }));
+			}
+			for (auto& t : threads)
+			{
+				t.join();
+			}
+			assert(equal[0] && equal[1] && equal[2] && equal[3]);
+		}
+		assert(from_empty<int>().order_by([](int x){return x; }).with_memory_budget(4).empty());
+		vector<string> words = { "vczh", "linq", "", "cpp", "sort", "external", "a" };
+		vector<string> sortedWords = { "", "a", "cpp", "vczh", "linq", "sort", "external" };
+		assert(from(words).order_by([](const string& x){return x.size(); }).with_memory_budget(2 * sizeof(string)).sequence_equal(sortedWords));
 		assert(
 			flatten(
 				from(xs)
@@ -404,6 +920,415 @@ int test()
 			assert(xs[3].second.second.name == whiskers.name);
 		}
 	}
+	{
+		int xs[] = { 5, 1, 3, 11, 4 };
+		int ys[] = { 21, 6, 13, 2, 33, 12 };
+		auto k1 = [](int x){return x % 10; };
+		auto k2 = [](int y){return y % 10; };
+
+		auto f = from(xs).full_join(ys, k1, k2);
+		assert(f.select([](const join_pair<int, linq<int>, linq<int>>& p){return p.first; }).sequence_equal({ 1, 2, 3, 4, 5, 6 }));
+		assert(f.element_at(0).second.first.sequence_equal({ 1, 11 }));
+		assert(f.element_at(0).second.second.sequence_equal({ 21 }));
+		assert(f.element_at(1).second.first.empty());
+		assert(f.element_at(1).second.second.sequence_equal({ 2, 12 }));
+		assert(f.element_at(2).second.second.sequence_equal({ 13, 33 }));
+		assert(f.element_at(3).second.second.empty());
+		// keys only in the second source are kept even when they are larger than every key in the first source
+		assert(f.element_at(5).first == 6);
+		assert(f.element_at(5).second.first.empty());
+		assert(f.element_at(5).second.second.sequence_equal({ 6 }));
+		auto h = from(ys).full_join(xs, k2, k1);
+		assert(h.select([](const join_pair<int, linq<int>, linq<int>>& p){return p.first; }).sequence_equal({ 1, 2, 3, 4, 5, 6 }));
+		assert(h.element_at(3).second.first.empty());
+		assert(h.element_at(3).second.second.sequence_equal({ 4 }));
+		assert(h.element_at(4).second.second.sequence_equal({ 5 }));
+
+		auto g = from(xs).group_join(ys, k1, k2);
+		assert(g.select([](const join_pair<int, int, linq<int>>& p){return p.second.first; }).sequence_equal({ 1, 11, 3, 4, 5 }));
+		assert(g.select([](const join_pair<int, int, linq<int>>& p){return p.second.second.count(); }).sequence_equal({ 1, 1, 2, 0, 0 }));
+
+		auto j = from(xs).join(ys, k1, k2);
+		assert(j.select([](const join_pair<int, int, int>& p){return p.second.first * 100 + p.second.second; }).sequence_equal({ 121, 1121, 313, 333 }));
+
+		// keys without std::hash
+		auto p1 = [](int x){return zip_pair<int, int>(x % 2, x % 3); };
+		auto p2 = [](int y){return zip_pair<int, int>(y % 2, y % 3); };
+		assert(from(xs).join(ys, p1, p2).select([](const join_pair<zip_pair<int, int>, int, int>& p){return p.second.first * 100 + p.second.second; }).sequence_equal({ 321, 333, 113 }));
+
+		// the hash table is built on the smaller source, results are ordered by keys, then outer values, then inner values either way
+		auto pair = [](const join_pair<int, int, int>& p){return p.second.first * 100 + p.second.second; };
+		assert(from(ys).join(xs, k2, k1).select(pair).sequence_equal({ 2101, 2111, 1303, 3303 }));
+		int as[] = { 1, 11, 21 };
+		int bs[] = { 31, 41 };
+		assert(from(as).join(bs, k1, k2).select(pair).sequence_equal({ 131, 141, 1131, 1141, 2131, 2141 }));
+		assert(from(bs).join(as, k2, k1).select(pair).sequence_equal({ 3101, 3111, 3121, 4101, 4111, 4121 }));
+		auto all = [](int x){return true; };
+		assert(from(as).where(all).join(from(bs).where(all), k1, k2).select(pair).sequence_equal({ 131, 141, 1131, 1141, 2131, 2141 }));
+		assert(from(bs).where(all).join(from(as).where(all), k2, k1).select(pair).sequence_equal({ 3101, 3111, 3121, 4101, 4111, 4121 }));
+
+		// keys of outer values without inner values are ordered with other keys
+		auto r = from(ys).group_join(xs, k2, k1);
+		assert(r.select([](const join_pair<int, int, linq<int>>& p){return p.second.first; }).sequence_equal({ 21, 2, 12, 13, 33, 6 }));
+		assert(r.select([](const join_pair<int, int, linq<int>>& p){return p.second.second.count(); }).sequence_equal({ 2, 0, 0, 1, 1, 0 }));
+		assert(r.first().second.second.sequence_equal({ 1, 11 }));
+		assert(from(xs).where(all).group_join(from(ys).where(all), k1, k2).select([](const join_pair<int, int, linq<int>>& p){return p.second.first; }).sequence_equal({ 1, 11, 3, 4, 5 }));
+		assert(from(xs).group_join(ys, k1, k2).element_at(2).second.second.sequence_equal({ 13, 33 }));
+	}
+	//////////////////////////////////////////////////////////////////
+	// memory
+	//////////////////////////////////////////////////////////////////
+	{
+		int xs[] = { 5, 3, 5, 1, 3, 2, 4 };
+		counting_resource counting;
+		{
+			linq_memory_scope scope(&counting);
+			assert(linq_memory_scope::current() == &counting);
+			assert(from(xs).distinct().sequence_equal({ 5, 3, 1, 2, 4 }));
+			int afterDistinct = counting.allocations;
+			assert(afterDistinct > 0);
+			assert(from(xs).order_by([](int x){return x; }).sequence_equal({ 1, 2, 3, 3, 4, 5, 5 }));
+			assert(from(xs).group_by([](int x){return x % 2; }).select([](const group_pair<int, int>& p){return p.second.sum(); }).sequence_equal({ 6, 17 }));
+			assert(from(xs).count_by([](int x){return x; }).count() == 5);
+			assert(from(xs).join(xs, [](int x){return x; }, [](int x){return x; }).count() == 11);
+			assert(counting.allocations > afterDistinct);
+		}
+		assert(linq_memory_scope::current() == linq_default_resource());
+		assert(counting.allocations == counting.deallocations);
+
+		// results keep the resource they are created with, so they could be released after the scope
+		{
+			unique_ptr<linq_memory_scope> scope(new linq_memory_scope(&counting));
+			auto kept = from(xs).select([](int x){return x * 2; }).materialize();
+			scope.reset();
+			int beforeIterating = counting.allocations;
+			assert(kept.sequence_equal({ 10, 6, 10, 2, 6, 4, 8 }) && counting.allocations == beforeIterating);
+			assert(counting.allocations > counting.deallocations);
+		}
+		assert(counting.allocations == counting.deallocations);
+
+		linq_monotonic_resource arena(64, &counting);
+		{
+			linq_memory_scope scope(&arena);
+			{
+				linq_memory_scope inner(&counting);
+				assert(linq_memory_scope::current() == &counting);
+			}
+			assert(linq_memory_scope::current() == &arena);
+			int before = counting.allocations;
+			auto big = from(xs).select_many([](int x){return vector<int>(1000, x); }).order_by([](int x){return -x; }).materialize();
+			assert(big.count() == 7000 && big.first() == 5 && big.last() == 1);
+			assert(counting.allocations - before < 20);
+		}
+		arena.release();
+		assert(counting.allocations == counting.deallocations);
+
+		linq_allocator<int> a1;
+		linq_allocator<double> a2(a1);
+		assert(a1 == a2 && a1.get_resource() == linq_default_resource());
+
+#ifdef LINQ_PMR
+		pmr::monotonic_buffer_resource standardArena;
+		{
+			linq_memory_scope scope(&standardArena);
+			assert(from(xs).distinct().order_by([](int x){return x; }).sequence_equal({ 1, 2, 3, 4, 5 }));
+		}
+#endif
+	}
+	//////////////////////////////////////////////////////////////////
+	// caching
+	//////////////////////////////////////////////////////////////////
+	{
+		int xs[] = { 1, 2, 3, 4, 5 };
+		int computed = 0;
+		auto cached = from(xs).select([&](int x){computed++; return x * 10; }).cache();
+		assert(computed == 0);
+		assert(cached.first() == 10 && computed == 1);
+		assert(cached.take(3).sequence_equal({ 10, 20, 30 }) && computed == 3);
+		assert(cached.count() == 5 && computed == 5);
+		assert(cached.sequence_equal({ 10, 20, 30, 40, 50 }) && cached.sum() == 150 && cached.last() == 50);
+		assert(cached.default_if_empty(0).count() == 5 && cached.take(1).single().first() == 10 && cached.skip(5).single_or_default(0).first() == 0);
+		auto copied = cached;
+		assert(copied.skip(4).sequence_equal({ 50 }) && computed == 5);
+
+		auto it = cached.begin();
+		auto it2 = it++;
+		assert(*it2 == 10 && *it == 20 && it != it2 && ++it2 == it);
+		assert(from(xs).take(0).cache().empty());
+
+		computed = 0;
+		auto materialized = from(xs).where([&](int x){computed++; return x % 2 == 1; }).materialize();
+		static_assert(is_random_access<decltype(materialized.begin())>::value, "materialize should give random access.");
+		assert(computed == 5 && materialized.count() == 3 && materialized.element_at(2) == 5 && computed == 5);
+
+		vector<int> ys;
+		for (int i = 0; i < 10000; i++)
+		{
+			ys.push_back(i);
+		}
+		atomic<int> shared(0);
+		auto synchronized = from(ys).select([&](int x){shared++; return (long long)x; }).cache_synchronized();
+		vector<long long> sums(4);
+		vector<thread> threads;
+		for (int i = 0; i < 4; i++)
+		{
+			threads.push_back(thread([&, i](){sums[i] = synchronized.sum(); }));
+		}
+		for (auto& t : threads)
+		{
+			t.join();
+		}
+		assert(shared == 10000);
+		assert(from(sums).all([](long long x){return x == 49995000LL; }));
+	}
+	//////////////////////////////////////////////////////////////////
+	// profiling
+	//////////////////////////////////////////////////////////////////
+	{
+		int xs[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+		{
+			linq_profiler profiler;
+			auto query = from(xs)
+				.profile(profiler, "source")
+				.where([](int x){return x % 2 == 1; })
+				.profile(profiler, "where")
+				.select([](int x){return x * x; })
+				.profile(profiler, "select");
+			assert(query.sequence_equal({ 1, 9, 25, 49, 81 }));
+
+			auto source = profiler.find("source");
+			auto where = profiler.find("where");
+			auto select = profiler.find("select");
+			assert(source->elements == 10 && where->elements == 5 && select->elements == 5);
+			assert(source->parent == where && where->parent == select && select->parent == nullptr);
+			assert(select->nanoseconds >= select->inner_nanoseconds && select->inner_nanoseconds >= where->nanoseconds);
+			assert(profiler.find("join") == nullptr);
+
+			auto report = profiler.report();
+			assert(report.find("select") < report.find("  where") && report.find("  where") < report.find("    source"));
+		}
+		{
+			linq_profiler profiler;
+			auto query = from(xs)
+				.profile(profiler, "source")
+				.where([](int x){return x > 3; })
+				.profile(profiler, "where");
+			assert(query.sum() == 49);
+			assert(profiler.find("source")->elements == 10 && profiler.find("where")->elements == 7);
+			assert(profiler.find("source")->parent == profiler.find("where"));
+		}
+		{
+			linq_profiler profiler;
+			auto query = from(xs).order_by([](int x){return -x; }).profile(profiler, "order_by");
+			assert(query.first() == 10);
+			assert(profiler.find("order_by")->allocations > 0);
+		}
+		{
+			// buffers allocated by a stage come from the resource of the scope, so they could be released after the profiler
+			counting_resource counting;
+			{
+				linq_memory_scope scope(&counting);
+				unique_ptr<linq<int>> query;
+				{
+					linq_profiler profiler;
+					query.reset(new linq<int>(from(xs).order_by([](int x){return -x; }).profile(profiler, "order_by")));
+					int beforeIterating = counting.allocations;
+					assert(query->first() == 10);
+					assert(counting.allocations - beforeIterating >= profiler.find("order_by")->allocations);
+					assert(profiler.find("order_by")->allocations > 0);
+				}
+			}
+			assert(counting.allocations == counting.deallocations);
+		}
+
+		auto plan = from(xs).where([](int x){return x % 2 == 1; }).select([](int x){return x * x; }).explain();
+		assert(plan.find("select_iterator -> int\n  where_iterator -> int\n    ") == 0);
+		linq_profiler profiler;
+		plan = from(xs).select([](int x){return to_string(x); }).batch(2).profile(profiler, "batch").explain();
+		assert(plan.find("profile_iterator -> ") == 0 && plan.find("\n  batch_iterator -> ") != string::npos && plan.find("\n    select_iterator -> ") != string::npos);
+	}
+	//////////////////////////////////////////////////////////////////
+	// files
+	//////////////////////////////////////////////////////////////////
+	{
+		auto write = [](const char* path, const void* data, size_t size)
+		{
+			FILE* file = fopen(path, "wb");
+			fwrite(data, 1, size, file);
+			fclose(file);
+		};
+		const char* path = "linq_file_test.txt";
+
+		const char lines[] = "a\r\nbb\n\nccc\nbb";
+		write(path, lines, sizeof(lines) - 1);
+		assert(from_lines(path).select([](const string_slice& s){return s.str(); }).sequence_equal({ "a", "bb", "", "ccc", "bb" }));
+		assert(from_lines(path).distinct().count() == 4);
+		assert(from_lines(path).where([](const string_slice& s){return s == "bb"; }).count() == 2);
+		assert(from_lines(path).as_parallel(2).select([](const string_slice& s){return s.size(); }).sum() == 8);
+
+		static_assert(std::is_same<decltype(from_lines(path).as_parallel()), linq_parallel<iterators::line_iterator, parallel_identity>>::value, "lines should be split without copying.");
+		{
+			string text;
+			for (int i = 0; i < 10000; i++)
+			{
+				text += to_string(i) + (i % 3 == 0 ? "\r\n" : "\n");
+			}
+			write(path, text.data(), text.size());
+			auto numbers = from_lines(path).select([](const string_slice& s){return stoi(s.str()); });
+			for (int threads = 1; threads <= 4; threads++)
+			{
+				auto parallel = from_lines(path).as_parallel(threads).select([](const string_slice& s){return stoi(s.str()); });
+				assert(parallel.count() == 10000 && parallel.sum() == 49995000);
+				assert(from(parallel.to_vector()).sequence_equal(numbers));
+				assert(from(parallel.as_deterministic().to_vector()).sequence_equal(numbers));
+			}
+		}
+
+		write(path, "x\n", 2);
+		assert(from_lines(path).select([](const string_slice& s){return s.str(); }).sequence_equal({ "x" }));
+		write(path, "", 0);
+		assert(from_lines(path).empty());
+
+		vector<double> records;
+		for (int i = 0; i < 1000; i++)
+		{
+			records.push_back(i);
+		}
+		write(path, &records[0], records.size() * sizeof(double));
+		auto doubles = from_records<double>(path);
+		static_assert(is_contiguous<decltype(doubles.begin())>::value, "records should be contiguous.");
+		assert(doubles.count() == 1000 && doubles.element_at(10) == 10 && doubles.sum() == 499500);
+		assert(doubles.as_parallel(3).where([](double x){return x >= 500; }).count() == 500);
+		write(path, &records[0], records.size() * sizeof(double) - 1);
+		try{ from_records<double>(path); assert(false); }
+		catch (const linq_exception&){}
+
+		const char csv[] = "name,age\n\"Smith, J\",42\n\"say \"\"hi\"\"\",7\r\n,\n\"two\nlines\"";
+		write(path, csv, sizeof(csv) - 1);
+		auto rows = from_csv(path).select([](const vector<string_slice>& row){return from(row).select([](const string_slice& s){return s.str(); }).to_vector(); }).to_vector();
+		assert(rows.size() == 5);
+		assert(rows[0] == vector<string>({ "name", "age" }));
+		assert(rows[1] == vector<string>({ "Smith, J", "42" }));
+		assert(rows[2] == vector<string>({ "say \"\"hi\"\"", "7" }));
+		assert(rows[3] == vector<string>({ "", "" }));
+		assert(rows[4] == vector<string>({ "two\nlines" }));
+
+		static_assert(std::is_same<decltype(from_csv(path).as_parallel()), linq_parallel<iterators::csv_iterator, parallel_identity>>::value, "rows should be split without copying.");
+		{
+			// quoted line breaks and quotes are everywhere, so most positions in the file are not row boundaries
+			string text;
+			for (int i = 0; i < 5000; i++)
+			{
+				text += to_string(i) + ",\"a\n\"\"b\"\"\nc\"," + (i % 2 == 0 ? "\"\n\n\"\r\n" : "x\n");
+			}
+			write(path, text.data(), text.size());
+			auto first = [](const vector<string_slice>& row){return stoi(row[0].str()); };
+			auto sequential = from_csv(path).select(first).to_vector();
+			assert(sequential.size() == 5000 && sequential[4999] == 4999 && from(sequential).sum() == 12497500);
+			for (int threads = 1; threads <= 4; threads++)
+			{
+				auto parallel = from_csv(path).as_parallel(threads);
+				assert(from(parallel.select(first).to_vector()).sequence_equal(sequential));
+				assert(from(parallel.as_deterministic().select(first).to_vector()).sequence_equal(sequential));
+				assert(parallel.where([](const vector<string_slice>& row){return row.size() == 3 && row[1] == "a\n\"\"b\"\"\nc"; }).count() == 5000);
+			}
+		}
+
+		remove(path);
+		try{ from_lines(path); assert(false); }
+		catch (const linq_exception&){}
+	}
+	//////////////////////////////////////////////////////////////////
+	// parallel
+	//////////////////////////////////////////////////////////////////
+	{
+		vector<int> xs;
+		for (int i = 0; i < 100000; i++)
+		{
+			xs.push_back(i * 7919 % 100003);
+		}
+		auto odd = [](int x){return x % 2 == 1; };
+		auto square = [](int x){return (long long)x * x; };
+		auto plus = [](long long a, long long b){return a + b; };
+		auto parallel = from(xs).as_parallel(4);
+
+		assert(parallel.count() == 100000);
+		assert(parallel.where(odd).count() == from(xs).where(odd).count());
+		assert(parallel.where(odd).select(square).sum() == from(xs).where(odd).select(square).aggregate(0LL, plus));
+		assert(parallel.select(square).aggregate(0LL, plus, plus) == from(xs).select(square).aggregate(0LL, plus));
+		assert(parallel.min() == from(xs).min());
+		assert(parallel.max() == from(xs).max());
+		assert(parallel.select(square).where(odd).to_vector() == from(xs).select(square).where(odd).to_vector());
+
+		auto unordered = parallel.where(odd).as_unordered().to_vector();
+		auto expected = from(xs).where(odd).to_vector();
+		sort(unordered.begin(), unordered.end());
+		sort(expected.begin(), expected.end());
+		assert(unordered == expected);
+		assert(parallel.select(square).as_unordered().sum() == from(xs).select(square).aggregate(0LL, plus));
+
+		// chunks of a fixed size give the same rounding on any number of threads
+		auto inverse = [](int x){return 1.0 / (x + 1); };
+		double d1 = from(xs).as_parallel(1).as_deterministic().select(inverse).sum();
+		double d3 = from(xs).as_parallel(3).as_deterministic().select(inverse).sum();
+		double d8 = from(xs).as_parallel(8).as_deterministic().select(inverse).sum();
+		assert(d1 == d3 && d1 == d8);
+
+		// sources without random access are copied before splitting
+		list<int> ys(xs.begin(), xs.end());
+		assert(from(ys).where(odd).as_parallel(3).select(square).to_vector() == from(xs).where(odd).select(square).to_vector());
+
+		vector<int> empty;
+		assert(from(empty).as_parallel(4).count() == 0);
+		assert(from(empty).as_parallel(4).sum() == 0);
+		assert(from(empty).as_parallel(4).to_vector().empty());
+		try{ from(empty).as_parallel(4).max(); assert(false); }
+		catch (const linq_exception&){}
+
+		try
+		{
+			parallel.select([](int x){if (x == 500) throw linq_exception("500"); return x; }).max();
+			assert(false);
+		}
+		catch (const linq_exception& e){ assert(e.message == "500"); }
+
+		// keys are split into partitions by hashes, and results are the same as the sequential query
+		auto mod = [](int x){return x % 1000; };
+		auto identity = [](int x){return x; };
+		auto keys = [](const group_pair<int, int>& p){return p.first; };
+		auto values = [](const group_pair<int, int>& p){return p.second; };
+		assert(parallel.count_by(mod).sequence_equal(from(xs).count_by(mod)));
+		assert(parallel.count_by(identity).sequence_equal(from(xs).count_by(identity)));
+		assert(parallel.where(odd).sum_by(mod, square).sequence_equal(from(xs).where(odd).sum_by(mod, square)));
+		assert(parallel.min_by(mod, square).sequence_equal(from(xs).min_by(mod, square)));
+		assert(parallel.max_by(mod, identity).sequence_equal(from(xs).max_by(mod, identity)));
+		auto product = [](unsigned long long a, int x){return a * (unsigned long long)(x % 5 + 1); };
+		auto multiply = [](unsigned long long a, unsigned long long b){return a * b; };
+		assert(parallel.aggregate_by(mod, 1ULL, product, multiply).sequence_equal(from(xs).aggregate_by(mod, 1ULL, product)));
+		assert(parallel.as_deterministic().aggregate_by(mod, 1ULL, product, multiply).sequence_equal(from(xs).aggregate_by(mod, 1ULL, product)));
+		assert(
+			parallel.select([](int x){return to_string(x % 37); }).accumulate_by([](const string& x){return x; }, [](const string& x){return x; }, [](const string& a, const string& x){return a; }, [](const string& a, const string& b){return a; })
+			.sequence_equal(from(xs).select([](int x){return to_string(x % 37); }).distinct().select([](const string& x){return zip_pair<string, string>(x, x); }))
+			);
+
+		auto groups = parallel.group_by(mod);
+		auto expectedGroups = from(xs).group_by(mod);
+		assert(groups.select(keys).sequence_equal(expectedGroups.select(keys)));
+		assert(groups.select_many(values).sequence_equal(expectedGroups.select_many(values)));
+		assert(parallel.where(odd).group_by(identity).select_many(values).sequence_equal(from(xs).where(odd).order_by(identity)));
+
+		// keys that could not be hashed are kept in one partition
+		auto pair = [](int x){return zip_pair<int, int>(x % 7, x % 3); };
+		assert(parallel.count_by(pair).sequence_equal(from(xs).count_by(pair)));
+		assert(parallel.group_by(pair).select([](const group_pair<zip_pair<int, int>, int>& p){return p.second.count(); }).sequence_equal(from(xs).group_by(pair).select([](const group_pair<zip_pair<int, int>, int>& p){return p.second.count(); })));
+
+		assert(from(empty).as_parallel(4).count_by(identity).empty());
+		assert(from(empty).as_parallel(4).group_by(identity).empty());
+
+		// a parallel query inside a parallel query runs on the same thread
+		auto multiples = [&](int x){return parallel.where([=](int y){return y % x == 0; }).count(); };
+		assert(from_values({ 1, 2, 3, 4 }).as_parallel(4).select(multiples).sum() == from_values({ 1, 2, 3, 4 }).select(multiples).sum());
+	}
 #ifdef _MSC_VER
 	_CrtDumpMemoryLeaks();
 #endif
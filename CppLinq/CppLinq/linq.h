@@ -6,7 +6,15 @@
 #else
 #define __thiscall
 #endif
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <functional>
+#include <type_traits>
 #include <algorithm>
+#include <iterator>
 #include <memory>
 #include <string>
 #include <vector>
@@ -16,12 +24,95 @@
 #include <unordered_map>
 #include <set>
 #include <unordered_set>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <chrono>
+#include <typeinfo>
+#include <cstdlib>
+#include <cstdarg>
+#ifdef __GNUG__
+#include <cxxabi.h>
+#endif
+
+#if (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L) || __cplusplus >= 201703L
+#if defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define LINQ_PMR
+#endif
+#endif
+#endif
+
+#if !defined(LINQ_NO_SIMD) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#define LINQ_SIMD_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#define LINQ_TARGET_AVX2
+#else
+#include <immintrin.h>
+#define LINQ_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
 
 namespace vczh
 {
 	template<typename TIterator>
 	using iterator_type = decltype(**(TIterator*)0);
 
+	template<typename TIterator>
+	struct is_random_access
+	{
+		template<typename U>
+		static typename std::is_base_of<std::random_access_iterator_tag, typename U::iterator_category>::type test(int);
+
+		template<typename U>
+		static std::false_type test(...);
+
+		static const bool value = decltype(test<TIterator>(0))::value;
+	};
+
+	template<typename T>
+	struct is_random_access<T*> : std::true_type
+	{
+	};
+
+	// linq iterators support it - begin and it += count when all iterators they depend on support them
+	template<typename TIterator>
+	using linq_iterator_category = typename std::conditional<is_random_access<TIterator>::value, std::random_access_iterator_tag, std::forward_iterator_tag>::type;
+
+	// iterators of arithmetic values stored in one array, data(begin) is only called for non-empty ranges
+	template<
+		typename TIterator,
+		typename TElement = typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type,
+		bool = std::is_arithmetic<TElement>::value && !std::is_same<TElement, bool>::value
+		>
+	struct is_contiguous : std::false_type
+	{
+	};
+
+	template<typename TIterator, typename TElement>
+	struct is_contiguous<TIterator, TElement, true> : std::integral_constant<bool,
+		std::is_pointer<TIterator>::value ||
+		std::is_same<TIterator, typename std::vector<TElement>::iterator>::value ||
+		std::is_same<TIterator, typename std::vector<TElement>::const_iterator>::value
+		>
+	{
+		static const TElement* data(const TIterator& begin)
+		{
+			return &*begin;
+		}
+	};
+
+	// forward iterators over memory that as_parallel splits by positions instead of elements, like lines of a file split by bytes
+	// size(begin, end) is the number of positions, split(begin, end, offsets, pool) returns the first element at or after every offset
+	template<typename TIterator>
+	struct is_splittable : std::false_type
+	{
+	};
+
 	class linq_exception
 	{
 	public:
@@ -65,10 +156,10 @@ namespace vczh
 		static int compare(const zip_pair<T, U>& a, const zip_pair<T, U>& b)
 		{
 			return
-				a.first<a.second ? -1 :
-				a.first>a.second ? 1 :
-				b.first<b.second ? -1 :
-				b.first>b.second ? 1 :
+				a.first<b.first ? -1 :
+				a.first>b.first ? 1 :
+				a.second<b.second ? -1 :
+				a.second>b.second ? 1 :
 				0;
 		}
 
@@ -83,1509 +174,5984 @@ namespace vczh
 	template<typename TKey, typename TValue1, typename TValue2>
 	using join_pair = zip_pair<TKey, zip_pair<TValue1, TValue2>>;
 
-	namespace iterators
+	// elements stored one after another in a buffer owned by someone else
+	template<typename T>
+	class array_slice
 	{
-		//////////////////////////////////////////////////////////////////
-		// hide_type
-		//////////////////////////////////////////////////////////////////
+	private:
+		const T*				buffer;
+		int						length;
 
-		template<typename T>
-		class hide_type_iterator
+	public:
+		array_slice()
+			:buffer(nullptr), length(0)
 		{
-		private:
-			class iterator_interface
-			{
-				typedef iterator_interface								TSelf;
-			public:
-				virtual std::shared_ptr<TSelf>	next() = 0;
-				virtual T						deref() = 0;
-				virtual bool					equals(const std::shared_ptr<TSelf>& it) = 0;
-			};
+		}
 
-			template<typename TIterator>
-			class iterator_implement : public iterator_interface
-			{
-				typedef iterator_implement<TIterator>					TSelf;
-			private:
-				TIterator						iterator;
+		array_slice(const T* _buffer, int _length)
+			:buffer(_buffer), length(_length)
+		{
+		}
 
-			public:
-				iterator_implement(const TIterator& _iterator)
-					:iterator(_iterator)
-				{
-				}
+		const T* begin()const
+		{
+			return buffer;
+		}
 
-				std::shared_ptr<iterator_interface> next()override
-				{
-					TIterator t = iterator;
-					t++;
-					return std::make_shared<TSelf>(t);
-				}
+		const T* end()const
+		{
+			return buffer + length;
+		}
 
-				T deref()override
-				{
-					return *iterator;
-				}
+		const T* data()const
+		{
+			return buffer;
+		}
 
-				bool equals(const std::shared_ptr<iterator_interface>& it)override
-				{
-					auto impl = std::dynamic_pointer_cast<TSelf>(it);
-					return impl && (iterator == impl->iterator);
-				}
-			};
+		int size()const
+		{
+			return length;
+		}
 
-			typedef hide_type_iterator<T>								TSelf;
+		bool empty()const
+		{
+			return length == 0;
+		}
 
-			std::shared_ptr<iterator_interface>		iterator;
-		public:
-			template<typename TIterator>
-			hide_type_iterator(const TIterator& _iterator)
-				:iterator(std::make_shared<iterator_implement<TIterator>>(_iterator))
-			{
-			}
+		const T& operator[](int index)const
+		{
+			return buffer[index];
+		}
 
-			TSelf& operator++()
-			{
-				iterator = iterator->next();
-				return *this;
-			}
+		std::vector<T> to_vector()const
+		{
+			return std::vector<T>(buffer, buffer + length);
+		}
 
-			TSelf operator++(int)
-			{
-				TSelf t = *this;
-				iterator = iterator->next();
-				return t;
-			}
+		bool operator==(const array_slice<T>& slice)const{ return length == slice.length && std::equal(buffer, buffer + length, slice.buffer); }
+		bool operator!=(const array_slice<T>& slice)const{ return !(*this == slice); }
+	};
 
-			T operator*()const
-			{
-				return iterator->deref();
-			}
+	//////////////////////////////////////////////////////////////////
+	// memory
+	//////////////////////////////////////////////////////////////////
 
-			bool operator==(const TSelf& it)const
-			{
-				return iterator->equals(it.iterator);
-			}
+#ifdef LINQ_PMR
+	typedef std::pmr::memory_resource				linq_memory_resource;
 
-			bool operator!=(const TSelf& it)const
-			{
-				return !(iterator->equals(it.iterator));
-			}
-		};
+	inline linq_memory_resource* linq_default_resource()
+	{
+		return std::pmr::new_delete_resource();
+	}
+#else
+	// the same interface as std::pmr::memory_resource, which is used instead in C++17
+	class linq_memory_resource
+	{
+	public:
+		virtual ~linq_memory_resource(){}
 
-		//////////////////////////////////////////////////////////////////
-		// storage
-		//////////////////////////////////////////////////////////////////
+		void* allocate(size_t bytes, size_t alignment = alignof(std::max_align_t))
+		{
+			return do_allocate(bytes, alignment);
+		}
 
-		template<typename T>
-		class storage_iterator
+		void deallocate(void* p, size_t bytes, size_t alignment = alignof(std::max_align_t))
 		{
-			typedef storage_iterator<T>									TSelf;
-		private:
-			std::shared_ptr<std::vector<T>>		values;
-			typename std::vector<T>::iterator	iterator;
+			do_deallocate(p, bytes, alignment);
+		}
 
-		public:
-			storage_iterator(const std::shared_ptr<std::vector<T>>& _values, const typename std::vector<T>::iterator& _iterator)
-				:values(_values), iterator(_iterator)
-			{
-			}
+		bool is_equal(const linq_memory_resource& other)const noexcept
+		{
+			return do_is_equal(other);
+		}
 
-			TSelf& operator++()
-			{
-				iterator++;
-				return *this;
-			}
+	protected:
+		virtual void*					do_allocate(size_t bytes, size_t alignment) = 0;
+		virtual void					do_deallocate(void* p, size_t bytes, size_t alignment) = 0;
+		virtual bool					do_is_equal(const linq_memory_resource& other)const noexcept = 0;
+	};
 
-			TSelf operator++(int)
-			{
-				TSelf t = *this;
-				iterator++;
-				return t;
-			}
+	// alignments larger than std::max_align_t are not supported before C++17
+	class linq_new_delete_resource : public linq_memory_resource
+	{
+	protected:
+		void* do_allocate(size_t bytes, size_t alignment)override
+		{
+			return ::operator new(bytes);
+		}
 
-			T operator*()const
-			{
-				return *iterator;
-			}
+		void do_deallocate(void* p, size_t bytes, size_t alignment)override
+		{
+			::operator delete(p);
+		}
 
-			bool operator==(const TSelf& it)const
-			{
-				return iterator == it.iterator;
-			}
+		bool do_is_equal(const linq_memory_resource& other)const noexcept override
+		{
+			return this == &other;
+		}
+	};
 
-			bool operator!=(const TSelf& it)const
-			{
-				return iterator != it.iterator;
-			}
+	inline linq_memory_resource* linq_default_resource()
+	{
+		static linq_new_delete_resource resource;
+		return &resource;
+	}
+#endif
+
+	// memory is taken from blocks that grow geometrically, and is only released when the resource is released or destroyed
+	// it is not thread safe
+	class linq_monotonic_resource : public linq_memory_resource
+	{
+	private:
+		struct block
+		{
+			block*						next;
+			size_t						size;
 		};
 
-		//////////////////////////////////////////////////////////////////
-		// empty
-		//////////////////////////////////////////////////////////////////
+		linq_memory_resource*			upstream;
+		block*							blocks;
+		char*							current;
+		size_t							available;
+		size_t							nextSize;
 
-		template<typename T>
-		class empty_iterator
+		linq_monotonic_resource(const linq_monotonic_resource&) = delete;
+		linq_monotonic_resource& operator=(const linq_monotonic_resource&) = delete;
+	protected:
+		void* do_allocate(size_t bytes, size_t alignment)override
 		{
-			typedef empty_iterator<T>									TSelf;
-		private:
-
-		public:
-			empty_iterator()
+			size_t padding = (alignment - (size_t)current % alignment) % alignment;
+			if (!current || padding + bytes > available)
 			{
+				size_t size = sizeof(block) + bytes + alignment;
+				if (size < nextSize) size = nextSize;
+				nextSize = size * 2;
+
+				auto b = (block*)upstream->allocate(size, alignof(std::max_align_t));
+				b->next = blocks;
+				b->size = size;
+				blocks = b;
+				current = (char*)(b + 1);
+				available = size - sizeof(block);
+				padding = (alignment - (size_t)current % alignment) % alignment;
 			}
 
-			TSelf& operator++()
-			{
-				return *this;
-			}
+			auto result = current + padding;
+			current += padding + bytes;
+			available -= padding + bytes;
+			return result;
+		}
 
-			TSelf operator++(int)
-			{
-				return *this;
-			}
+		void do_deallocate(void* p, size_t bytes, size_t alignment)override
+		{
+		}
 
-			T operator*()const
-			{
-				throw linq_exception("Failed to get a value from an empty collection.");
-			}
+		bool do_is_equal(const linq_memory_resource& other)const noexcept override
+		{
+			return this == &other;
+		}
+	public:
+		linq_monotonic_resource(size_t initialSize = 4096, linq_memory_resource* _upstream = linq_default_resource())
+			:upstream(_upstream), blocks(nullptr), current(nullptr), available(0), nextSize(initialSize)
+		{
+		}
 
-			bool operator==(const TSelf& it)const
-			{
-				return true;
-			}
+		~linq_monotonic_resource()
+		{
+			release();
+		}
 
-			bool operator!=(const TSelf& it)const
+		void release()
+		{
+			while (blocks)
 			{
-				return false;
+				auto b = blocks;
+				blocks = b->next;
+				upstream->deallocate(b, b->size, alignof(std::max_align_t));
 			}
-		};
+			current = nullptr;
+			available = 0;
+		}
+	};
 
-		//////////////////////////////////////////////////////////////////
-		// select
-		//////////////////////////////////////////////////////////////////
+	// buffers that linq creates on this thread come from the resource while the scope is alive
+	// results that keep buffers, like distinct, group_by or materialize, should not be used after the resource is released
+	// threads of as_parallel do not use the resource
+	class linq_memory_scope
+	{
+	private:
+		linq_memory_resource*			previous;
 
-		template<typename TIterator, typename TFunction>
-		class select_iterator
+		static linq_memory_resource*& resource_of_thread()
 		{
-			typedef select_iterator<TIterator, TFunction>				TSelf;
-		private:
-			TIterator			iterator;
-			TFunction			f;
+			static thread_local linq_memory_resource* resource = nullptr;
+			return resource;
+		}
 
-		public:
-			select_iterator(const TIterator& _iterator, const TFunction& _f)
-				:iterator(_iterator), f(_f)
-			{
-			}
+		linq_memory_scope(const linq_memory_scope&) = delete;
+		linq_memory_scope& operator=(const linq_memory_scope&) = delete;
+	public:
+		linq_memory_scope(linq_memory_resource* resource)
+			:previous(resource_of_thread())
+		{
+			resource_of_thread() = resource;
+		}
 
-			TSelf& operator++()
-			{
-				iterator++;
-				return *this;
-			}
+		~linq_memory_scope()
+		{
+			resource_of_thread() = previous;
+		}
 
-			TSelf operator++(int)
-			{
-				TSelf t = *this;
-				iterator++;
-				return t;
-			}
+		static linq_memory_resource* current()
+		{
+			auto resource = resource_of_thread();
+			return resource ? resource : linq_default_resource();
+		}
+	};
 
-			auto operator*()const->decltype(f(*iterator))
-			{
-				return f(*iterator);
-			}
+	// takes the resource of the current scope when it is created, containers move and swap their allocators with their buffers
+	template<typename T>
+	class linq_allocator
+	{
+		template<typename U>
+		friend class linq_allocator;
+	private:
+		linq_memory_resource*			resource;
 
-			bool operator==(const TSelf& it)const
-			{
-				return iterator == it.iterator;
-			}
+	public:
+		typedef T												value_type;
+		typedef std::true_type									propagate_on_container_move_assignment;
+		typedef std::true_type									propagate_on_container_swap;
 
-			bool operator!=(const TSelf& it)const
-			{
-				return iterator != it.iterator;
-			}
-		};
+		linq_allocator()
+			:resource(linq_memory_scope::current())
+		{
+		}
 
-		//////////////////////////////////////////////////////////////////
-		// where
-		//////////////////////////////////////////////////////////////////
+		template<typename U>
+		linq_allocator(const linq_allocator<U>& allocator)
+			:resource(allocator.resource)
+		{
+		}
 
-		template<typename TIterator, typename TFunction>
-		class where_iterator
+		T* allocate(size_t count)
 		{
-			typedef where_iterator<TIterator, TFunction>				TSelf;
-		private:
-			TIterator			iterator;
-			TIterator			end;
-			TFunction			f;
+			return (T*)resource->allocate(count * sizeof(T), alignof(T));
+		}
 
-			void move_iterator(bool next)
-			{
-				if (iterator == end) return;
-				if (next) iterator++;
-				while (iterator != end && !f(*iterator))
-				{
-					iterator++;
-				}
-			}
-		public:
-			where_iterator(const TIterator& _iterator, const TIterator& _end, const TFunction& _f)
-				:iterator(_iterator), end(_end), f(_f)
-			{
-				move_iterator(false);
-			}
+		void deallocate(T* p, size_t count)
+		{
+			resource->deallocate(p, count * sizeof(T), alignof(T));
+		}
 
-			TSelf& operator++()
-			{
-				move_iterator(true);
-				return *this;
-			}
+		linq_memory_resource* get_resource()const
+		{
+			return resource;
+		}
 
-			TSelf operator++(int)
-			{
-				TSelf t = *this;
-				move_iterator(true);
-				return t;
-			}
+		template<typename U>
+		bool operator==(const linq_allocator<U>& allocator)const{ return resource == allocator.resource || resource->is_equal(*allocator.resource); }
+		template<typename U>
+		bool operator!=(const linq_allocator<U>& allocator)const{ return !(*this == allocator); }
+	};
 
-			iterator_type<TIterator> operator*()const
-			{
-				return *iterator;
-			}
+	template<typename T>
+	using linq_vector = std::vector<T, linq_allocator<T>>;
 
-			bool operator==(const TSelf& it)const
-			{
-				return iterator == it.iterator;
-			}
+	// the object and its reference count are allocated together from the resource of the current scope
+	template<typename T, typename ...TArgs>
+	std::shared_ptr<T> linq_make_shared(TArgs&& ...args)
+	{
+		return std::allocate_shared<T>(linq_allocator<T>(), std::forward<TArgs>(args)...);
+	}
 
-			bool operator!=(const TSelf& it)const
-			{
-				return iterator != it.iterator;
-			}
-		};
+	//////////////////////////////////////////////////////////////////
+	// serialization
+	//////////////////////////////////////////////////////////////////
 
-		//////////////////////////////////////////////////////////////////
-		// skip
-		//////////////////////////////////////////////////////////////////
+	// how elements are stored in temporary files, specialize it for element types that are not trivially copyable
+	template<typename T>
+	struct linq_serializer
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "Specialize linq_serializer for element types that are not trivially copyable.");
 
-		template<typename TIterator>
-		class skip_iterator
+		static bool write(FILE* file, const T* values, int count)
 		{
-			typedef skip_iterator<TIterator>							TSelf;
-		private:
-			TIterator			iterator;
-			TIterator			end;
+			return (int)fwrite(values, sizeof(T), count, file) == count;
+		}
 
-		public:
-			skip_iterator(const TIterator& _iterator, const TIterator& _end, int _count)
-				:iterator(_iterator), end(_end)
-			{
-				for (int i = 0; i < _count && iterator != end; i++, iterator++);
-			}
+		// appends <count> elements to values
+		static bool read(FILE* file, linq_vector<T>& values, int count)
+		{
+			size_t size = values.size();
+			values.resize(size + count);
+			return (int)fread(values.data() + size, sizeof(T), count, file) == count;
+		}
+	};
 
-			TSelf& operator++()
-			{
-				iterator++;
-				return *this;
-			}
+	//////////////////////////////////////////////////////////////////
+	// profiling
+	//////////////////////////////////////////////////////////////////
 
-			TSelf operator++(int)
-			{
-				TSelf t = *this;
-				iterator++;
-				return t;
-			}
+	// counters of the query until a profile call, the stage includes all operators after the previous profile call
+	class linq_profile_stage
+	{
+	public:
+		std::string								name;
+		std::atomic<long long>					elements;				// elements produced by the stage
+		std::atomic<long long>					nanoseconds;			// time spent in the stage and stages it pulls elements from
+		std::atomic<long long>					inner_nanoseconds;		// time spent in stages it pulls elements from
+		std::atomic<long long>					allocations;			// buffers allocated while the stage is running
+		std::atomic<linq_profile_stage*>		parent;					// the first stage that pulls elements from it
+
+		linq_profile_stage(const std::string& _name)
+			:name(_name), elements(0), nanoseconds(0), inner_nanoseconds(0), allocations(0), parent(nullptr)
+		{
+		}
 
-			iterator_type<TIterator> operator*()const
-			{
-				return *iterator;
-			}
+		// the stage that is running on this thread
+		static linq_profile_stage*& running()
+		{
+			static thread_local linq_profile_stage* stage = nullptr;
+			return stage;
+		}
+	};
 
-			bool operator==(const TSelf& it)const
+	// the resource of the scope while a stage is running, buffers are counted by the stage and come from the resource of the scope where the stage started
+	// the resource of every buffer is stored before it, so buffers could be released after the stage is finished
+	class linq_profile_resource : public linq_memory_resource
+	{
+	private:
+		static size_t offset(size_t alignment)
+		{
+			return (sizeof(linq_memory_resource*) + alignment - 1) / alignment * alignment;
+		}
+	protected:
+		void* do_allocate(size_t bytes, size_t alignment)override
+		{
+			if (auto stage = linq_profile_stage::running())
 			{
-				return iterator == it.iterator;
+				stage->allocations++;
 			}
+			auto resource = target();
+			if (!resource) resource = linq_default_resource();
+			auto block = (char*)resource->allocate(bytes + offset(alignment), alignment) + offset(alignment);
+			memcpy(block - sizeof(resource), &resource, sizeof(resource));
+			return block;
+		}
 
-			bool operator!=(const TSelf& it)const
-			{
-				return iterator != it.iterator;
-			}
-		};
+		void do_deallocate(void* p, size_t bytes, size_t alignment)override
+		{
+			linq_memory_resource* resource = nullptr;
+			memcpy(&resource, (char*)p - sizeof(resource), sizeof(resource));
+			resource->deallocate((char*)p - offset(alignment), bytes + offset(alignment), alignment);
+		}
 
-		//////////////////////////////////////////////////////////////////
-		// skip_while
-		//////////////////////////////////////////////////////////////////
+		bool do_is_equal(const linq_memory_resource& other)const noexcept override
+		{
+			return this == &other;
+		}
+	public:
+		// the resource that buffers come from on this thread
+		static linq_memory_resource*& target()
+		{
+			static thread_local linq_memory_resource* resource = nullptr;
+			return resource;
+		}
 
-		template<typename TIterator, typename TFunction>
-		class skip_while_iterator
+		static linq_profile_resource* instance()
 		{
-			typedef skip_while_iterator<TIterator, TFunction>			TSelf;
-		private:
-			TIterator			iterator;
-			TIterator			end;
-			TFunction			f;
+			static linq_profile_resource resource;
+			return &resource;
+		}
+	};
 
-		public:
-			skip_while_iterator(const TIterator& _iterator, const TIterator& _end, const TFunction& _f)
-				:iterator(_iterator), end(_end), f(_f)
+	// stages of queries marked by profile, buffers allocated while a stage is running are counted by the stage
+	// every call to an iterator of a stage reads the clock twice, so stages should be placed around operators that do real work
+	// the profiler should outlive the iteration of queries profiled by it, but buffers allocated by stages do not depend on it
+	// the profiler could also be the resource of a scope, to count buffers allocated while no stage is running
+	class linq_profiler : public linq_memory_resource
+	{
+	private:
+		linq_memory_resource*					upstream;
+		mutable std::mutex						lock;
+		std::deque<linq_profile_stage>			stages;
+		std::atomic<long long>					outside_allocations;
+
+		linq_profiler(const linq_profiler&) = delete;
+		linq_profiler& operator=(const linq_profiler&) = delete;
+
+		static void format(std::string& output, const char* pattern, ...)
+		{
+			char buffer[256];
+			va_list arguments;
+			va_start(arguments, pattern);
+			vsnprintf(buffer, sizeof(buffer), pattern, arguments);
+			va_end(arguments);
+			output += buffer;
+		}
+
+		void report(std::string& output, const linq_profile_stage* parent, int depth)const
+		{
+			for (auto& stage : stages)
 			{
-				while (iterator != end && f(*iterator))
+				if (stage.parent != parent) continue;
+				long long in = 0;
+				bool pulling = false;
+				for (auto& inner : stages)
 				{
-					iterator++;
+					if (inner.parent == &stage)
+					{
+						in += inner.elements;
+						pulling = true;
+					}
 				}
-			}
 
-			TSelf& operator++()
+				auto name = std::string(depth * 2, ' ') + stage.name;
+				format(output, "%-24s", name.c_str());
+				if (pulling)
+				{
+					format(output, " %12lld", in);
+				}
+				else
+				{
+					format(output, " %12s", "-");
+				}
+				format(output, " %12lld %12.3f %12.3f %12lld\n",
+					(long long)stage.elements,
+					stage.nanoseconds / 1000000.0,
+					(stage.nanoseconds - stage.inner_nanoseconds) / 1000000.0,
+					(long long)stage.allocations
+					);
+				report(output, &stage, depth + 1);
+			}
+		}
+	protected:
+		void* do_allocate(size_t bytes, size_t alignment)override
+		{
+			if (auto stage = linq_profile_stage::running())
 			{
-				iterator++;
-				return *this;
+				stage->allocations++;
 			}
-
-			TSelf operator++(int)
+			else
 			{
-				TSelf t = *this;
-				iterator++;
-				return t;
+				outside_allocations++;
 			}
+			return upstream->allocate(bytes, alignment);
+		}
 
-			iterator_type<TIterator> operator*()const
+		void do_deallocate(void* p, size_t bytes, size_t alignment)override
+		{
+			upstream->deallocate(p, bytes, alignment);
+		}
+
+		bool do_is_equal(const linq_memory_resource& other)const noexcept override
+		{
+			return this == &other;
+		}
+	public:
+		linq_profiler(linq_memory_resource* _upstream = linq_default_resource())
+			:upstream(_upstream), outside_allocations(0)
+		{
+		}
+
+		linq_profile_stage* stage(const std::string& name)
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stages.emplace_back(name);
+			return &stages.back();
+		}
+
+		// the first stage of the name, or nullptr
+		const linq_profile_stage* find(const std::string& name)const
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			for (auto& stage : stages)
 			{
-				return *iterator;
+				if (stage.name == name) return &stage;
 			}
+			return nullptr;
+		}
 
-			bool operator==(const TSelf& it)const
+		// allocations from the profiler while no stage is running, like buffers created when building a query
+		long long outside()const
+		{
+			return outside_allocations;
+		}
+
+		// a tree of stages, the last stage of a query is the root, and stages it pulls elements from are its children
+		// "in" is the number of elements produced by children, "self" excludes time spent in children
+		std::string report()const
+		{
+			std::string output;
+			format(output, "%-24s %12s %12s %12s %12s %12s\n", "stage", "in", "out", "total ms", "self ms", "allocations");
 			{
-				return iterator == it.iterator;
+				std::lock_guard<std::mutex> guard(lock);
+				report(output, nullptr, 0);
 			}
-
-			bool operator!=(const TSelf& it)const
+			if (outside_allocations > 0)
 			{
-				return iterator != it.iterator;
+				format(output, "%-24s %12s %12s %12s %12s %12lld\n", "(outside)", "", "", "", "", (long long)outside_allocations);
 			}
-		};
-
-		//////////////////////////////////////////////////////////////////
-		// take
-		//////////////////////////////////////////////////////////////////
+			return output;
+		}
+	};
 
-		template<typename TIterator>
-		class take_iterator
+	// time and allocations of a stage while it is running, downstream sinks called by push are paused
+	class linq_profile_timer
+	{
+		typedef std::chrono::steady_clock						TClock;
+	private:
+		linq_profile_stage*						stage;
+		linq_profile_stage*						caller;
+		linq_memory_resource*					outside;
+		linq_memory_resource*					target;
+		linq_memory_scope						scope;
+		TClock::time_point						start;
+		long long								paused;
+
+		static long long elapsed(TClock::time_point since)
 		{
-			typedef take_iterator<TIterator>							TSelf;
-		private:
-			TIterator			iterator;
-			TIterator			end;
-			int					count;
-			int					current;
-
-		public:
-			take_iterator(const TIterator& _iterator, const TIterator& _end, int _count)
-				:iterator(_iterator), end(_end), count(_count), current(0)
+			return (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(TClock::now() - since).count();
+		}
+	public:
+		linq_profile_timer(linq_profile_stage* _stage)
+			:stage(_stage)
+			, caller(linq_profile_stage::running())
+			, outside(linq_memory_scope::current())
+			, target(linq_profile_resource::target())
+			, scope(linq_profile_resource::instance())
+			, start(TClock::now())
+			, paused(0)
+		{
+			// a stage running in another stage keeps the resource of the outer stage
+			if (outside != linq_profile_resource::instance())
 			{
-				if (current == count)
-				{
-					iterator = end;
-				}
+				linq_profile_resource::target() = outside;
 			}
+			linq_profile_stage::running() = stage;
+		}
 
-			TSelf& operator++()
+		~linq_profile_timer()
+		{
+			long long time = elapsed(start) - paused;
+			stage->nanoseconds += time;
+			if (caller)
 			{
-				if (++current == count)
-				{
-					iterator = end;
-				}
-				else
+				caller->inner_nanoseconds += time;
+				if (!stage->parent)
 				{
-					iterator++;
+					linq_profile_stage* expected = nullptr;
+					stage->parent.compare_exchange_strong(expected, caller);
 				}
-				return *this;
 			}
+			linq_profile_stage::running() = caller;
+			linq_profile_resource::target() = target;
+		}
 
-			TSelf operator++(int)
+		// calls f as the caller
+		template<typename TFunction>
+		auto pause(const TFunction& f)->decltype(f())
+		{
+			struct resume
 			{
-				TSelf t = *this;
-				if (++current == count)
-				{
-					iterator = end;
-				}
-				else
+				linq_profile_timer*				timer;
+				TClock::time_point				start;
+
+				~resume()
 				{
-					iterator++;
+					timer->paused += elapsed(start);
+					linq_profile_stage::running() = timer->stage;
 				}
-				return t;
-			}
+			};
 
-			iterator_type<TIterator> operator*()const
-			{
-				return *iterator;
-			}
+			resume r = { this, TClock::now() };
+			linq_profile_stage::running() = caller;
+			linq_memory_scope restore(outside);
+			return f();
+		}
+	};
 
-			bool operator==(const TSelf& it)const
-			{
-				return iterator == it.iterator;
-			}
+	template<typename T>
+	struct is_iterator
+	{
+		template<typename U>
+		static decltype(++std::declval<U&>(), *std::declval<U&>(), std::declval<U&>() != std::declval<U&>(), std::true_type()) test(int);
 
-			bool operator!=(const TSelf& it)const
-			{
-				return iterator != it.iterator;
-			}
-		};
+		template<typename U>
+		static std::false_type test(...);
 
-		//////////////////////////////////////////////////////////////////
-		// take_while
-		//////////////////////////////////////////////////////////////////
+		static const bool value = decltype(test<T>(0))::value;
+	};
 
-		template<typename TIterator, typename TFunction>
-		class take_while_iterator
+	// the tree of iterators of a query, linq<T> hides iterators of its source
+	class linq_explain
+	{
+	private:
+		template<template<typename...> class TTemplate, typename ...TArgs>
+		static void inner(std::string& output, int depth, TTemplate<TArgs...>*)
 		{
-			typedef take_while_iterator<TIterator, TFunction>			TSelf;
-		private:
-			TIterator			iterator;
-			TIterator			end;
-			TFunction			f;
+			int dummy[] = { 0, (child<TArgs>(output, depth, std::integral_constant<bool, is_iterator<TArgs>::value>()), 0)... };
+			(void)dummy;
+		}
 
-		public:
-			take_while_iterator(const TIterator& _iterator, const TIterator& _end, const TFunction& _f)
-				:iterator(_iterator), end(_end), f(_f)
+		static void inner(std::string& output, int depth, const void*)
+		{
+		}
+
+		template<typename T>
+		static void child(std::string& output, int depth, std::true_type)
+		{
+			write<T>(output, depth);
+		}
+
+		template<typename T>
+		static void child(std::string& output, int depth, std::false_type)
+		{
+		}
+	public:
+		static std::string type_name(const std::type_info& info)
+		{
+#ifdef __GNUG__
+			int status = 0;
+			char* demangled = abi::__cxa_demangle(info.name(), nullptr, nullptr, &status);
+			std::string name = status == 0 ? demangled : info.name();
+			free(demangled);
+#else
+			std::string name = info.name();
+			if (name.compare(0, 6, "class ") == 0) name = name.substr(6);
+			if (name.compare(0, 7, "struct ") == 0) name = name.substr(7);
+#endif
+			return name;
+		}
+
+		// one line for each iterator, with the type of elements it produces
+		template<typename TIterator>
+		static void write(std::string& output, int depth)
+		{
+			typedef typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type	TElement;
+			static const std::string prefix = "vczh::iterators::";
+
+			auto name = type_name(typeid(TIterator));
+			bool linq = name.compare(0, prefix.size(), prefix) == 0;
+			if (linq)
 			{
-				if (iterator != end && !f(*iterator))
-				{
-					iterator = end;
-				}
+				name = name.substr(prefix.size(), name.find('<') - prefix.size());
+			}
+			output += std::string(depth * 2, ' ') + name + " -> " + type_name(typeid(TElement)) + "\n";
+			if (linq)
+			{
+				inner(output, depth + 1, (TIterator*)nullptr);
 			}
+		}
+	};
 
-			TSelf& operator++()
+	//////////////////////////////////////////////////////////////////
+	// hashing
+	//////////////////////////////////////////////////////////////////
+
+	template<typename T>
+	struct is_hashable
+	{
+		template<typename U>
+		static auto test(int)->decltype(std::hash<U>()(*(const U*)0), std::true_type());
+
+		template<typename U>
+		static std::false_type test(...);
+
+		static const bool value = decltype(test<T>(0))::value;
+	};
+
+	// an open addressing hash table, keys are indexed in the order they are added
+	template<typename TKey, typename THash = std::hash<TKey>, typename TEqual = std::equal_to<TKey>>
+	class hash_index
+	{
+	private:
+		linq_vector<TKey>			keys;
+		linq_vector<size_t>			hashes;
+		linq_vector<int>			slots;		// indices to keys, -1 for empty slots
+		int							shift;
+		THash						hash;
+		TEqual						equal;
+
+		size_t home(size_t h)const
+		{
+			return (size_t)(((std::uint64_t)h * 0x9E3779B97F4A7C15ull) >> shift);
+		}
+
+		size_t probe(const TKey& key, size_t h)const
+		{
+			size_t mask = slots.size() - 1;
+			for (size_t i = home(h);; i = (i + 1) & mask)
 			{
-				if (!f(*++iterator))
+				int index = slots[i];
+				if (index == -1 || (hashes[index] == h && equal(keys[index], key)))
 				{
-					iterator = end;
+					return i;
 				}
-				return *this;
 			}
+		}
 
-			TSelf operator++(int)
+		void grow()
+		{
+			linq_vector<int> newSlots(slots.empty() ? 16 : slots.size() * 2, -1, slots.get_allocator());
+			slots.swap(newSlots);
+			shift = 64;
+			for (size_t size = slots.size(); size > 1; size >>= 1, shift--);
+
+			size_t mask = slots.size() - 1;
+			for (int index = 0; index < (int)keys.size(); index++)
 			{
-				TSelf t = *this;
-				if (!f(*++iterator))
+				size_t i = home(hashes[index]);
+				while (slots[i] != -1)
 				{
-					iterator = end;
+					i = (i + 1) & mask;
 				}
-				return t;
+				slots[i] = index;
 			}
+		}
+	public:
+		hash_index(const THash& _hash = THash(), const TEqual& _equal = TEqual())
+			:shift(64), hash(_hash), equal(_equal)
+		{
+		}
 
-			iterator_type<TIterator> operator*()const
+		int size()const
+		{
+			return (int)keys.size();
+		}
+
+		const TKey& key(int index)const
+		{
+			return keys[index];
+		}
+
+		// returns the index of the key, or -1 if it does not exist
+		int find(const TKey& key)const
+		{
+			if (slots.empty()) return -1;
+			return slots[probe(key, hash(key))];
+		}
+
+		// returns the index of the key, and whether it is newly added
+		std::pair<int, bool> insert(const TKey& key)
+		{
+			if ((keys.size() + 1) * 10 > slots.size() * 7)
 			{
-				return *iterator;
+				grow();
 			}
-
-			bool operator==(const TSelf& it)const
+			size_t h = hash(key);
+			size_t slot = probe(key, h);
+			if (slots[slot] != -1)
 			{
-				return iterator == it.iterator;
+				return std::make_pair(slots[slot], false);
 			}
 
-			bool operator!=(const TSelf& it)const
+			int index = (int)keys.size();
+			slots[slot] = index;
+			keys.push_back(key);
+			hashes.push_back(h);
+			return std::make_pair(index, true);
+		}
+	};
+
+	// the same interface as hash_index for keys that could only be compared
+	template<typename TKey>
+	class tree_index
+	{
+	private:
+		linq_vector<TKey>			keys;
+		std::map<TKey, int, std::less<TKey>, linq_allocator<std::pair<const TKey, int>>>	indices;
+
+	public:
+		int size()const
+		{
+			return (int)keys.size();
+		}
+
+		const TKey& key(int index)const
+		{
+			return keys[index];
+		}
+
+		int find(const TKey& key)const
+		{
+			auto it = indices.find(key);
+			return it == indices.end() ? -1 : it->second;
+		}
+
+		std::pair<int, bool> insert(const TKey& key)
+		{
+			auto result = indices.insert(std::make_pair(key, (int)keys.size()));
+			if (result.second)
 			{
-				return iterator != it.iterator;
+				keys.push_back(key);
 			}
-		};
+			return std::make_pair(result.first->second, result.second);
+		}
+	};
 
-		//////////////////////////////////////////////////////////////////
-		// concat
-		//////////////////////////////////////////////////////////////////
+	// hashing is preferred when std::hash supports the key
+	template<typename TKey>
+	using linq_index = typename std::conditional<is_hashable<TKey>::value, hash_index<TKey>, tree_index<TKey>>::type;
 
-		template<typename TIterator1, typename TIterator2>
-		class concat_iterator
+	// splits keys into partitions by hashes for parallel grouping, so every key belongs to only one partition
+	// keys that could only be compared are kept in one partition
+	template<typename TKey, bool = is_hashable<TKey>::value>
+	struct linq_partitioner
+	{
+		// a power of two
+		static int partitions(int participants)
 		{
-			typedef concat_iterator<TIterator1, TIterator2>				TSelf;
-		private:
-			TIterator1			current1;
-			TIterator1			end1;
-			TIterator2			current2;
-			TIterator2			end2;
-			bool				first;
+			int count = 1;
+			while (count < participants * 4) count *= 2;
+			return count;
+		}
 
-		public:
-			concat_iterator(const TIterator1& _current1, const TIterator1& _end1, const TIterator2& _current2, const TIterator2& _end2)
-				:current1(_current1), end1(_end1), current2(_current2), end2(_end2), first(_current1 != _end1)
+		// hash_index takes high bits of the hash, so low bits are mixed by the finalizer of MurmurHash3 for partitions
+		static int partition(const TKey& key, int partitions)
+		{
+			std::uint64_t h = (std::uint64_t)std::hash<TKey>()(key);
+			h ^= h >> 33;
+			h *= 0xff51afd7ed558ccdull;
+			h ^= h >> 33;
+			h *= 0xc4ceb9fe1a85ec53ull;
+			h ^= h >> 33;
+			return (int)(h & (std::uint64_t)(partitions - 1));
+		}
+	};
+
+	template<typename TKey>
+	struct linq_partitioner<TKey, false>
+	{
+		static int partitions(int participants)
+		{
+			return 1;
+		}
+
+		static int partition(const TKey& key, int partitions)
+		{
+			return 0;
+		}
+	};
+
+	//////////////////////////////////////////////////////////////////
+	// vectorization
+	//////////////////////////////////////////////////////////////////
+
+	namespace simd
+	{
+		struct add
+		{
+			template<typename T>
+			static T apply(const T& a, const T& b)
 			{
+				return a + b;
 			}
 
-			TSelf& operator++()
+			template<typename T>
+			T operator()(const T& a, const T& b)const
 			{
-				if (first)
-				{
-					if (++current1 == end1)
-					{
-						first = false;
-					}
-				}
-				else
-				{
-					current2++;
-				}
-				return *this;
+				return apply(a, b);
 			}
+		};
 
-			TSelf operator++(int)
+		struct multiply
+		{
+			template<typename T>
+			static T apply(const T& a, const T& b)
 			{
-				TSelf t = *this;
-				if (first)
-				{
-					if (++current1 == end1)
-					{
-						first = false;
-					}
-				}
-				else
-				{
-					current2++;
-				}
-				return t;
+				return a * b;
 			}
 
-			iterator_type<TIterator1> operator*()const
+			template<typename T>
+			T operator()(const T& a, const T& b)const
 			{
-				return first ? *current1 : *current2;
+				return apply(a, b);
 			}
+		};
 
-			bool operator==(const TSelf& it)const
+		struct minimum
+		{
+			template<typename T>
+			static T apply(const T& a, const T& b)
 			{
-				if (first != it.first) return false;
-				return first ? current1 == it.current1 : current2 == it.current2;
+				return a < b ? a : b;
 			}
 
-			bool operator!=(const TSelf& it)const
+			template<typename T>
+			T operator()(const T& a, const T& b)const
 			{
-				if (first != it.first) return true;
-				return first ? current1 != it.current1 : current2 != it.current2;
+				return apply(a, b);
 			}
 		};
 
-		//////////////////////////////////////////////////////////////////
-		// zip
-		//////////////////////////////////////////////////////////////////
-
-		template<typename TIterator1, typename TIterator2>
-		class zip_iterator
+		struct maximum
 		{
-			typedef zip_iterator<TIterator1, TIterator2>							TSelf;
-			typedef zip_pair<iterator_type<TIterator1>, iterator_type<TIterator2>>	TElement;
-		private:
-			TIterator1			current1;
-			TIterator1			end1;
-			TIterator2			current2;
-			TIterator2			end2;
-
-		public:
-			zip_iterator(const TIterator1& _current1, const TIterator1& _end1, const TIterator2& _current2, const TIterator2& _end2)
-				:current1(_current1), end1(_end1), current2(_current2), end2(_end2)
+			template<typename T>
+			static T apply(const T& a, const T& b)
 			{
+				return a > b ? a : b;
 			}
 
-			TSelf& operator++()
+			template<typename T>
+			T operator()(const T& a, const T& b)const
 			{
-				if (current1 != end1 && current2 != end2)
-				{
-					current1++;
-					current2++;
-				}
-				return *this;
+				return apply(a, b);
 			}
+		};
 
-			TSelf operator++(int)
+		template<typename TReduce, typename T>
+		T reduce_scalar(const T* xs, int count, T init)
+		{
+			for (int i = 0; i < count; i++)
 			{
-				TSelf t = *this;
-				if (current1 != end1 && current2 != end2)
-				{
-					current1++;
-					current2++;
-				}
-				return t;
+				init = TReduce::apply(init, xs[i]);
 			}
+			return init;
+		}
 
-			TElement operator*()const
+#ifdef LINQ_SIMD_X86
+		// 0 for scalar code, 1 for SSE2, 2 for AVX2
+		inline int detect_level()
+		{
+#ifdef _MSC_VER
+			int info[4];
+			__cpuid(info, 0);
+			int ids = info[0];
+			__cpuid(info, 1);
+			bool sse2 = (info[3] & (1 << 26)) != 0;
+			bool osxsave = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0;
+			bool avx2 = false;
+			if (ids >= 7 && osxsave && (_xgetbv(0) & 6) == 6)
 			{
-				return TElement(*current1, *current2);
+				__cpuidex(info, 7, 0);
+				avx2 = (info[1] & (1 << 5)) != 0;
 			}
+			return avx2 ? 2 : sse2 ? 1 : 0;
+#else
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("avx2") ? 2 : __builtin_cpu_supports("sse2") ? 1 : 0;
+#endif
+		}
 
-			bool operator==(const TSelf& it)const
-			{
-				return current1 == it.current1 && current2 == it.current2;
-			}
+		inline int level()
+		{
+			static const int value = detect_level();
+			return value;
+		}
 
-			bool operator!=(const TSelf& it)const
+		struct sse_int
+		{
+			typedef int					T;
+			typedef __m128i				V;
+			static const int			lanes = 4;
+
+			static V load(const T* xs) { return _mm_loadu_si128((const V*)xs); }
+			static void store(T* xs, V a) { _mm_storeu_si128((V*)xs, a); }
+			static V combine(V a, V b, add) { return _mm_add_epi32(a, b); }
+			static V combine(V a, V b, minimum) { V m = _mm_cmpgt_epi32(a, b); return _mm_or_si128(_mm_and_si128(m, b), _mm_andnot_si128(m, a)); }
+			static V combine(V a, V b, maximum) { V m = _mm_cmpgt_epi32(a, b); return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b)); }
+			static V combine(V a, V b, multiply)
 			{
-				return current1 != it.current1 || current2 != it.current2;
+				// SSE2 only multiplies lanes 0 and 2 into 64 bits
+				V even = _mm_mul_epu32(a, b);
+				V odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+				return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
 			}
 		};
-	}
 
-	namespace types
-	{
-		template<typename T>
-		using storage_it = iterators::storage_iterator<T>;
-		
-		template<typename T>
-		using empty_it = iterators::empty_iterator<T>;
+		struct sse_float
+		{
+			typedef float				T;
+			typedef __m128				V;
+			static const int			lanes = 4;
+
+			static V load(const T* xs) { return _mm_loadu_ps(xs); }
+			static void store(T* xs, V a) { _mm_storeu_ps(xs, a); }
+			static V combine(V a, V b, add) { return _mm_add_ps(a, b); }
+			static V combine(V a, V b, multiply) { return _mm_mul_ps(a, b); }
+			static V combine(V a, V b, minimum) { return _mm_min_ps(a, b); }
+			static V combine(V a, V b, maximum) { return _mm_max_ps(a, b); }
+		};
 
-		template<typename TIterator, typename TFunction>
-		using select_it = iterators::select_iterator<TIterator, TFunction>;
+		struct sse_double
+		{
+			typedef double				T;
+			typedef __m128d				V;
+			static const int			lanes = 2;
+
+			static V load(const T* xs) { return _mm_loadu_pd(xs); }
+			static void store(T* xs, V a) { _mm_storeu_pd(xs, a); }
+			static V combine(V a, V b, add) { return _mm_add_pd(a, b); }
+			static V combine(V a, V b, multiply) { return _mm_mul_pd(a, b); }
+			static V combine(V a, V b, minimum) { return _mm_min_pd(a, b); }
+			static V combine(V a, V b, maximum) { return _mm_max_pd(a, b); }
+		};
 
-		template<typename TIterator, typename TFunction>
-		using where_it = iterators::where_iterator<TIterator, TFunction>;
+		struct avx2_int
+		{
+			typedef int					T;
+			typedef __m256i				V;
+			static const int			lanes = 8;
+
+			LINQ_TARGET_AVX2 static V load(const T* xs) { return _mm256_loadu_si256((const V*)xs); }
+			LINQ_TARGET_AVX2 static void store(T* xs, V a) { _mm256_storeu_si256((V*)xs, a); }
+			LINQ_TARGET_AVX2 static V combine(V a, V b, add) { return _mm256_add_epi32(a, b); }
+			LINQ_TARGET_AVX2 static V combine(V a, V b, multiply) { return _mm256_mullo_epi32(a, b); }
+			LINQ_TARGET_AVX2 static V combine(V a, V b, minimum) { return _mm256_min_epi32(a, b); }
+			LINQ_TARGET_AVX2 static V combine(V a, V b, maximum) { return _mm256_max_epi32(a, b); }
+		};
 
-		template<typename TIterator>
-		using skip_it = iterators::skip_iterator<TIterator>;
+		struct avx2_float
+		{
+			typedef float				T;
+			typedef __m256				V;
+			static const int			lanes = 8;
+
+			LINQ_TARGET_AVX2 static V load(const T* xs) { return _mm256_loadu_ps(xs); }
+			LINQ_TARGET_AVX2 static void store(T* xs, V a) { _mm256_storeu_ps(xs, a); }
+			LINQ_TARGET_AVX2 static V combine(V a, V b, add) { return _mm256_add_ps(a, b); }
+			LINQ_TARGET_AVX2 static V combine(V a, V b, multiply) { return _mm256_mul_ps(a, b); }
+			LINQ_TARGET_AVX2 static V combine(V a, V b, minimum) { return _mm256_min_ps(a, b); }
+			LINQ_TARGET_AVX2 static V combine(V a, V b, maximum) { return _mm256_max_ps(a, b); }
+		};
 
-		template<typename TIterator, typename TFunction>
-		using skip_while_it = iterators::skip_while_iterator<TIterator, TFunction>;
+		struct avx2_double
+		{
+			typedef double				T;
+			typedef __m256d				V;
+			static const int			lanes = 4;
+
+			LINQ_TARGET_AVX2 static V load(const T* xs) { return _mm256_loadu_pd(xs); }
+			LINQ_TARGET_AVX2 static void store(T* xs, V a) { _mm256_storeu_pd(xs, a); }
+			LINQ_TARGET_AVX2 static V combine(V a, V b, add) { return _mm256_add_pd(a, b); }
+			LINQ_TARGET_AVX2 static V combine(V a, V b, multiply) { return _mm256_mul_pd(a, b); }
+			LINQ_TARGET_AVX2 static V combine(V a, V b, minimum) { return _mm256_min_pd(a, b); }
+			LINQ_TARGET_AVX2 static V combine(V a, V b, maximum) { return _mm256_max_pd(a, b); }
+		};
 
-		template<typename TIterator>
-		using take_it = iterators::take_iterator<TIterator>;
+		// four independent accumulators hide the latency of each instruction
+		// the two kernels are the same except the target, because code for AVX2 could not be inlined into code for SSE2
+#define LINQ_SIMD_KERNEL(NAME, TARGET)\
+		template<typename TOps, typename TReduce>\
+		TARGET typename TOps::T NAME(const typename TOps::T* xs, int count, typename TOps::T init)\
+		{\
+			typedef typename TOps::T T;\
+			const int lanes = TOps::lanes;\
+			int i = 0;\
+			if (count >= lanes * 4)\
+			{\
+				auto a0 = TOps::load(xs);\
+				auto a1 = TOps::load(xs + lanes);\
+				auto a2 = TOps::load(xs + lanes * 2);\
+				auto a3 = TOps::load(xs + lanes * 3);\
+				for (i = lanes * 4; i + lanes * 4 <= count; i += lanes * 4)\
+				{\
+					a0 = TOps::combine(a0, TOps::load(xs + i), TReduce());\
+					a1 = TOps::combine(a1, TOps::load(xs + i + lanes), TReduce());\
+					a2 = TOps::combine(a2, TOps::load(xs + i + lanes * 2), TReduce());\
+					a3 = TOps::combine(a3, TOps::load(xs + i + lanes * 3), TReduce());\
+				}\
+				a0 = TOps::combine(TOps::combine(a0, a1, TReduce()), TOps::combine(a2, a3, TReduce()), TReduce());\
+				T buffer[lanes];\
+				TOps::store(buffer, a0);\
+				for (int j = 0; j < lanes; j++)\
+				{\
+					init = TReduce::apply(init, buffer[j]);\
+				}\
+			}\
+			for (; i < count; i++)\
+			{\
+				init = TReduce::apply(init, xs[i]);\
+			}\
+			return init;\
+		}\
 
-		template<typename TIterator, typename TFunction>
-		using take_while_it = iterators::take_while_iterator<TIterator, TFunction>;
+		LINQ_SIMD_KERNEL(reduce_sse, )
+		LINQ_SIMD_KERNEL(reduce_avx2, LINQ_TARGET_AVX2)
+#undef LINQ_SIMD_KERNEL
 
-		template<typename TIterator1, typename TIterator2>
-		using concat_it = iterators::concat_iterator<TIterator1, TIterator2>;
+		template<typename T>
+		struct kernels
+		{
+			static const bool			supported = false;
+		};
 
-		template<typename TIterator1, typename TIterator2>
-		using zip_it = iterators::zip_iterator<TIterator1, TIterator2>;
-	}
+		template<>
+		struct kernels<int>
+		{
+			static const bool			supported = true;
+			typedef sse_int				sse;
+			typedef avx2_int			avx2;
+		};
 
-	//////////////////////////////////////////////////////////////////
-	// linq
-	//////////////////////////////////////////////////////////////////
+		template<>
+		struct kernels<float>
+		{
+			static const bool			supported = true;
+			typedef sse_float			sse;
+			typedef avx2_float			avx2;
+		};
 
-	template<typename TIterator>
-	class linq_enumerable;
+		template<>
+		struct kernels<double>
+		{
+			static const bool			supported = true;
+			typedef sse_double			sse;
+			typedef avx2_double			avx2;
+		};
 
-	template<typename T>
-	class linq;
+		template<typename TReduce, typename T>
+		T reduce(const T* xs, int count, T init, std::true_type)
+		{
+			switch (level())
+			{
+			case 2:
+				return reduce_avx2<typename kernels<T>::avx2, TReduce>(xs, count, init);
+			case 1:
+				return reduce_sse<typename kernels<T>::sse, TReduce>(xs, count, init);
+			default:
+				return reduce_scalar<TReduce>(xs, count, init);
+			}
+		}
 
-	template<typename TElement>
-	linq<TElement> from_values(std::shared_ptr<std::vector<TElement>> xs)
-	{
-		return linq_enumerable<types::storage_it<TElement>>(
-			types::storage_it<TElement>(xs, xs->begin()),
-			types::storage_it<TElement>(xs, xs->end())
-			);
-	}
+		template<typename TReduce, typename T>
+		T reduce(const T* xs, int count, T init, std::false_type)
+		{
+			return reduce_scalar<TReduce>(xs, count, init);
+		}
 
-	template<typename TElement>
-	linq<TElement> from_values(const std::initializer_list<TElement>& ys)
-	{
-		auto xs = std::make_shared<std::vector<TElement>>(ys.begin(), ys.end());
-		return linq_enumerable<types::storage_it<TElement>>(
-			types::storage_it<TElement>(xs, xs->begin()),
-			types::storage_it<TElement>(xs, xs->end())
-			);
+		// combines init and all elements with TReduce, using the widest instructions supported by the CPU for int, float and double
+		// floating point elements are combined in a different order from a sequential loop
+		template<typename TReduce, typename T>
+		T reduce(const T* xs, int count, T init)
+		{
+			return reduce<TReduce>(xs, count, init, std::integral_constant<bool, kernels<T>::supported>());
+		}
+#else
+		template<typename TReduce, typename T>
+		T reduce(const T* xs, int count, T init)
+		{
+			return reduce_scalar<TReduce>(xs, count, init);
+		}
+#endif
 	}
 
-	template<typename TElement>
-	linq<TElement> from_value(const TElement& value)
+	namespace iterators
 	{
-		auto xs = std::make_shared<std::vector<TElement>>();
-		xs->push_back(value);
-		return from_values(xs);
-	}
+		//////////////////////////////////////////////////////////////////
+		// optional
+		//////////////////////////////////////////////////////////////////
 
-	template<typename TElement>
-	linq<TElement> from_empty()
-	{
-		return linq_enumerable<types::empty_it<TElement>>(
-			types::empty_it<TElement>(),
-			types::empty_it<TElement>()
-			);
-	}
+		// storage for iterators that could not be default constructed
+		template<typename T>
+		class optional_value
+		{
+			typedef optional_value<T>									TSelf;
+		private:
+			typename std::aligned_storage<sizeof(T), alignof(T)>::type	buffer;
+			bool								available;
 
-	template<typename TIterator>
-	linq_enumerable<TIterator> from(const TIterator& begin, const TIterator& end);
+		public:
+			optional_value()
+				:available(false)
+			{
+			}
 
-	template<typename TContainer>
-	auto from(const TContainer& container)->linq_enumerable<decltype(std::begin(container))>;
+			optional_value(const TSelf& value)
+				:available(false)
+			{
+				if (value.available) emplace(*value);
+			}
 
-	template<typename TIterator>
-	class linq_enumerable
-	{
-		typedef typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type	TElement;
-	private:
-		TIterator				_begin;
-		TIterator				_end;
+			~optional_value()
+			{
+				reset();
+			}
 
-	public:
-		linq_enumerable()
+			TSelf& operator=(const TSelf& value)
+			{
+				if (this != &value)
+				{
+					reset();
+					if (value.available) emplace(*value);
+				}
+				return *this;
+			}
+
+			void emplace(const T& value)
+			{
+				reset();
+				new(&buffer)T(value);
+				available = true;
+			}
+
+			void reset()
+			{
+				if (available)
+				{
+					(**this).~T();
+					available = false;
+				}
+			}
+
+			explicit operator bool()const
+			{
+				return available;
+			}
+
+			T& operator*()
+			{
+				return *reinterpret_cast<T*>(&buffer);
+			}
+
+			const T& operator*()const
+			{
+				return *reinterpret_cast<const T*>(&buffer);
+			}
+		};
+
+		//////////////////////////////////////////////////////////////////
+		// random access
+		//////////////////////////////////////////////////////////////////
+
+		template<typename TIterator>
+		int range_size(const TIterator& begin, const TIterator& end, std::true_type)
 		{
+			return (int)(end - begin);
 		}
 
-		linq_enumerable(const TIterator& _begin_, const TIterator& _end_)
-			:_begin(_begin_), _end(_end_)
+		template<typename TIterator>
+		int range_size(const TIterator& begin, const TIterator& end, std::false_type)
 		{
+			int counter = 0;
+			for (auto it = begin; it != end; ++it)
+			{
+				counter++;
+			}
+			return counter;
 		}
 
-		TIterator begin()const
+		// the number of elements in [begin, end), O(1) for random access iterators
+		template<typename TIterator>
+		int range_size(const TIterator& begin, const TIterator& end)
 		{
-			return _begin;
+			return range_size(begin, end, std::integral_constant<bool, is_random_access<TIterator>::value>());
 		}
 
-		TIterator end()const
+		template<typename TIterator>
+		TIterator range_advance(TIterator it, const TIterator& end, int count, std::true_type)
 		{
-			return _end;
+			int size = (int)(end - it);
+			it += count < 0 ? 0 : count < size ? count : size;
+			return it;
 		}
 
-#ifdef _MSC_VER
+		template<typename TIterator>
+		TIterator range_advance(TIterator it, const TIterator& end, int count, std::false_type)
+		{
+			for (int i = 0; i < count && it != end; i++, ++it);
+			return it;
+		}
 
-#define SUPPORT_STL_CONTAINERS(NAME)\
-		template<typename TIterator2>\
-		auto NAME(const linq_enumerable<TIterator2>& e)const->decltype(NAME ## _(e))\
-		{\
-			return NAME ## _(e); \
-		}\
-		template<typename TContainer>\
-		auto NAME(const TContainer& e)const->decltype(NAME ## _(from(e)))\
-		{\
-			return NAME ## _(from(e)); \
-		}\
-		template<typename TElement>\
-		auto NAME(const std::initializer_list<TElement>& e)const->decltype(NAME ## _(from(e)))\
-		{\
-			return NAME ## _(from(e)); \
-		}\
+		// move forward at most <count> elements without passing end, O(1) for random access iterators
+		template<typename TIterator>
+		TIterator range_advance(const TIterator& it, const TIterator& end, int count)
+		{
+			return range_advance(it, end, count, std::integral_constant<bool, is_random_access<TIterator>::value>());
+		}
 
-#define PROTECT_PARAMETERS(...) __VA_ARGS__
+		template<typename TIterator>
+		TIterator range_bound(const TIterator& begin, const TIterator& end, int count, std::true_type)
+		{
+			return range_advance(begin, end, count);
+		}
 
-#define SUPPORT_STL_CONTAINERS_EX(NAME, TYPES, PARAMETERS, ARGUMENTS)\
-		template<typename TIterator2, TYPES>\
-		auto NAME(const linq_enumerable<TIterator2>& e, PARAMETERS)const->decltype(NAME ## _(e, ARGUMENTS))\
-		{\
-			return NAME ## _(e, ARGUMENTS); \
-		}\
-		template<typename TContainer, TYPES>\
-		auto NAME(const TContainer& e, PARAMETERS)const->decltype(NAME ## _(from(e), ARGUMENTS))\
-		{\
-			return NAME ## _(from(e), ARGUMENTS); \
-		}\
-		template<typename TElement, TYPES>\
-		auto NAME(const std::initializer_list<TElement>& e, PARAMETERS)const->decltype(NAME ## _(from(e), ARGUMENTS))\
-		{\
-			return NAME ## _(from(e), ARGUMENTS); \
-		}\
+		template<typename TIterator>
+		TIterator range_bound(const TIterator& begin, const TIterator& end, int count, std::false_type)
+		{
+			return end;
+		}
 
-#else
+		// where take(count) stops, only known in O(1) for random access iterators
+		template<typename TIterator>
+		TIterator range_bound(const TIterator& begin, const TIterator& end, int count)
+		{
+			return range_bound(begin, end, count, std::integral_constant<bool, is_random_access<TIterator>::value>());
+		}
 
-#define SUPPORT_STL_CONTAINERS(NAME)\
-		template<typename TIterator2>\
-		auto NAME(const linq_enumerable<TIterator2>& e)const->decltype(this->NAME ## _(e))\
-		{\
-			return NAME ## _(e); \
-		}\
-		template<typename TContainer>\
-		auto NAME(const TContainer& e)const->decltype(this->NAME ## _(from(e)))\
-		{\
-			return NAME ## _(from(e)); \
-		}\
-		template<typename TElement>\
-		auto NAME(const std::initializer_list<TElement>& e)const->decltype(this->NAME ## _(from(e)))\
-		{\
-			return NAME ## _(from(e)); \
-		}\
+		//////////////////////////////////////////////////////////////////
+		// push
+		//////////////////////////////////////////////////////////////////
 
-#define PROTECT_PARAMETERS(...) __VA_ARGS__
+		template<typename TIterator, typename TSink>
+		auto push(const TIterator& begin, const TIterator& end, TSink& sink, int)->decltype(begin.push(end, sink))
+		{
+			return begin.push(end, sink);
+		}
 
-#define SUPPORT_STL_CONTAINERS_EX(NAME, TYPES, PARAMETERS, ARGUMENTS)\
-		template<typename TIterator2, TYPES>\
-		auto NAME(const linq_enumerable<TIterator2>& e, PARAMETERS)const->decltype(this->NAME ## _(e, ARGUMENTS))\
-		{\
-			return NAME ## _(e, ARGUMENTS); \
-		}\
-		template<typename TContainer, TYPES>\
-		auto NAME(const TContainer& e, PARAMETERS)const->decltype(this->NAME ## _(from(e), ARGUMENTS))\
-		{\
-			return NAME ## _(from(e), ARGUMENTS); \
-		}\
-		template<typename TElement, TYPES>\
-		auto NAME(const std::initializer_list<TElement>& e, PARAMETERS)const->decltype(this->NAME ## _(from(e), ARGUMENTS))\
-		{\
-			return NAME ## _(from(e), ARGUMENTS); \
-		}\
+		template<typename TIterator, typename TSink>
+		bool push(const TIterator& begin, const TIterator& end, TSink& sink, long)
+		{
+			for (auto it = begin; it != end; ++it)
+			{
+				if (!sink(*it)) return false;
+			}
+			return true;
+		}
 
-#endif
+		// calls sink(element) for every element in a tight loop until it returns false, returns false if it is stopped by the sink
+		// iterators that implement push(end, sink) run the whole pipeline inside the loop of the source
+		template<typename TIterator, typename TSink>
+		bool push(const TIterator& begin, const TIterator& end, TSink& sink)
+		{
+			return push(begin, end, sink, 0);
+		}
+
+		//////////////////////////////////////////////////////////////////
+		// hide_type
+		//////////////////////////////////////////////////////////////////
+
+		template<typename T>
+		class hide_type_iterator
+		{
+		private:
+			// iterators not larger than this are stored inside hide_type_iterator without allocating
+			static const size_t buffer_size = sizeof(void*) * 16;
+
+			class iterator_interface
+			{
+			public:
+				const void*						type;
+
+				iterator_interface(const void* _type)
+					:type(_type)
+				{
+				}
+
+				virtual ~iterator_interface(){}
+				virtual void					increment() = 0;
+				virtual T						deref()const = 0;
+				virtual bool					equals(const iterator_interface* it)const = 0;
+				virtual iterator_interface*		clone(void* buffer)const = 0;
+				virtual bool					push(const iterator_interface* end, bool(*sink)(void*, const T&), void* context)const = 0;
+			};
+
+			template<typename TIterator>
+			class iterator_implement : public iterator_interface
+			{
+				typedef iterator_implement<TIterator>					TSelf;
+			private:
+				TIterator						iterator;
+
+			public:
+				static const bool				fit_in_buffer = sizeof(TSelf) <= buffer_size && alignof(TSelf) <= alignof(std::max_align_t);
+
+				static const void* type_id()
+				{
+					static const char id = 0;
+					return &id;
+				}
+
+				iterator_implement(const TIterator& _iterator)
+					:iterator_interface(type_id()), iterator(_iterator)
+				{
+				}
+
+				void increment()override
+				{
+					++iterator;
+				}
+
+				T deref()const override
+				{
+					return *iterator;
+				}
+
+				bool equals(const iterator_interface* it)const override
+				{
+					return it->type == this->type && iterator == static_cast<const TSelf*>(it)->iterator;
+				}
+
+				bool push(const iterator_interface* end, bool(*sink)(void*, const T&), void* context)const override
+				{
+					auto next = [=](iterator_type<TIterator> x){return sink(context, x); };
+					if (end->type == this->type)
+					{
+						return iterators::push(iterator, static_cast<const TSelf*>(end)->iterator, next);
+					}
+					for (TSelf it(iterator); !it.equals(end); ++it.iterator)
+					{
+						if (!next(*it.iterator)) return false;
+					}
+					return true;
+				}
+
+				iterator_interface* clone(void* buffer)const override
+				{
+					if (fit_in_buffer)
+					{
+						return new(buffer)TSelf(iterator);
+					}
+					else
+					{
+						return new TSelf(iterator);
+					}
+				}
+			};
+
+			typedef hide_type_iterator<T>								TSelf;
+
+			typename std::aligned_storage<buffer_size, alignof(std::max_align_t)>::type		buffer;
+			iterator_interface*					iterator;
+
+			bool is_inline()const
+			{
+				return iterator == (const void*)&buffer;
+			}
+
+			void release()
+			{
+				if (!iterator) return;
+				if (is_inline())
+				{
+					iterator->~iterator_interface();
+				}
+				else
+				{
+					delete iterator;
+				}
+			}
+		public:
+			template<typename TIterator>
+			hide_type_iterator(const TIterator& _iterator)
+				:iterator(iterator_implement<TIterator>(_iterator).clone(&buffer))
+			{
+			}
+
+			hide_type_iterator(const TSelf& it)
+				:iterator(it.iterator->clone(&buffer))
+			{
+			}
+
+			hide_type_iterator(TSelf&& it)
+				:iterator(it.is_inline() ? it.iterator->clone(&buffer) : it.iterator)
+			{
+				if (!is_inline())
+				{
+					it.iterator = nullptr;
+				}
+			}
+
+			~hide_type_iterator()
+			{
+				release();
+			}
+
+			TSelf& operator=(const TSelf& it)
+			{
+				if (this != &it)
+				{
+					release();
+					iterator = it.iterator->clone(&buffer);
+				}
+				return *this;
+			}
+
+			TSelf& operator++()
+			{
+				iterator->increment();
+				return *this;
+			}
+
+			TSelf operator++(int)
+			{
+				TSelf t = *this;
+				iterator->increment();
+				return t;
+			}
+
+			T operator*()const
+			{
+				return iterator->deref();
+			}
+
+			template<typename TSink>
+			bool push(const TSelf& to, TSink& sink)const
+			{
+				return iterator->push(to.iterator, [](void* context, const T& x){return (*(TSink*)context)(x); }, &sink);
+			}
+
+			bool operator==(const TSelf& it)const
+			{
+				return iterator->equals(it.iterator);
+			}
+
+			bool operator!=(const TSelf& it)const
+			{
+				return !(iterator->equals(it.iterator));
+			}
+		};
+
+		//////////////////////////////////////////////////////////////////
+		// storage
+		//////////////////////////////////////////////////////////////////
+
+		template<typename T>
+		class storage_iterator
+		{
+			typedef storage_iterator<T>									TSelf;
+		private:
+			std::shared_ptr<const void>			values;		// the container that owns the elements
+			const T*							iterator;
+
+		public:
+			typedef std::random_access_iterator_tag						iterator_category;
+
+			// values could be any container that stores elements in one array, like std::vector<T> and linq_vector<T>
+			template<typename TContainer>
+			storage_iterator(const std::shared_ptr<TContainer>& _values, const typename TContainer::iterator& _iterator)
+				:values(_values), iterator(_values->data() + (_iterator - _values->begin()))
+			{
+			}
+
+			TSelf& operator++()
+			{
+				++iterator;
+				return *this;
+			}
+
+			TSelf operator++(int)
+			{
+				TSelf t = *this;
+				++iterator;
+				return t;
+			}
+
+			T operator*()const
+			{
+				return *iterator;
+			}
+
+			int operator-(const TSelf& it)const
+			{
+				return (int)(iterator - it.iterator);
+			}
+
+			TSelf& operator+=(int count)
+			{
+				iterator += count;
+				return *this;
+			}
+
+			template<typename TSink>
+			bool push(const TSelf& to, TSink& sink)const
+			{
+				for (auto it = iterator; it != to.iterator; ++it)
+				{
+					if (!sink(*it)) return false;
+				}
+				return true;
+			}
+
+			const T* data()const
+			{
+				return iterator;
+			}
+
+			bool operator==(const TSelf& it)const
+			{
+				return iterator == it.iterator;
+			}
+
+			bool operator!=(const TSelf& it)const
+			{
+				return iterator != it.iterator;
+			}
+		};
+
+	}
+
+	template<typename T>
+	struct is_contiguous<iterators::storage_iterator<T>, T, true> : std::true_type
+	{
+		static const T* data(const iterators::storage_iterator<T>& begin)
+		{
+			return begin.data();
+		}
+	};
+
+	namespace iterators
+	{
+		//////////////////////////////////////////////////////////////////
+		// empty
+		//////////////////////////////////////////////////////////////////
+
+		template<typename T>
+		class empty_iterator
+		{
+			typedef empty_iterator<T>									TSelf;
+		private:
+
+		public:
+			empty_iterator()
+			{
+			}
+
+			TSelf& operator++()
+			{
+				return *this;
+			}
+
+			TSelf operator++(int)
+			{
+				return *this;
+			}
+
+			T operator*()const
+			{
+				throw linq_exception("Failed to get a value from an empty collection.");
+			}
+
+			bool operator==(const TSelf& it)const
+			{
+				return true;
+			}
+
+			bool operator!=(const TSelf& it)const
+			{
+				return false;
+			}
+		};
+
+		//////////////////////////////////////////////////////////////////
+		// select
+		//////////////////////////////////////////////////////////////////
+
+		template<typename TIterator, typename TFunction>
+		class select_iterator
+		{
+			typedef select_iterator<TIterator, TFunction>				TSelf;
+		private:
+			TIterator			iterator;
+			TFunction			f;
+
+		public:
+			typedef linq_iterator_category<TIterator>					iterator_category;
+
+			select_iterator(const TIterator& _iterator, const TFunction& _f)
+				:iterator(_iterator), f(_f)
+			{
+			}
+
+			TSelf& operator++()
+			{
+				++iterator;
+				return *this;
+			}
+
+			TSelf operator++(int)
+			{
+				TSelf t = *this;
+				++iterator;
+				return t;
+			}
+
+			auto operator*()const->decltype(f(*iterator))
+			{
+				return f(*iterator);
+			}
+
+			int operator-(const TSelf& it)const
+			{
+				return (int)(iterator - it.iterator);
+			}
+
+			TSelf& operator+=(int count)
+			{
+				iterator += count;
+				return *this;
+			}
+
+			template<typename TSink>
+			bool push(const TSelf& to, TSink& sink)const
+			{
+				auto next = [&](iterator_type<TIterator> x){return sink(f(x)); };
+				return iterators::push(iterator, to.iterator, next);
+			}
+
+			const TIterator& source()const
+			{
+				return iterator;
+			}
+
+			const TFunction& function()const
+			{
+				return f;
+			}
+
+			bool operator==(const TSelf& it)const
+			{
+				return iterator == it.iterator;
+			}
+
+			bool operator!=(const TSelf& it)const
+			{
+				return iterator != it.iterator;
+			}
+		};
+
+		//////////////////////////////////////////////////////////////////
+		// where
+		//////////////////////////////////////////////////////////////////
+
+		template<typename TIterator, typename TFunction>
+		class where_iterator
+		{
+			typedef where_iterator<TIterator, TFunction>				TSelf;
+		private:
+			TIterator			iterator;
+			TIterator			end;
+			TFunction			f;
+
+			void move_iterator(bool next)
+			{
+				if (iterator == end) return;
+				if (next) ++iterator;
+				while (iterator != end && !f(*iterator))
+				{
+					++iterator;
+				}
+			}
+		public:
+			where_iterator(const TIterator& _iterator, const TIterator& _end, const TFunction& _f)
+				:iterator(_iterator), end(_end), f(_f)
+			{
+				move_iterator(false);
+			}
+
+			TSelf& operator++()
+			{
+				move_iterator(true);
+				return *this;
+			}
+
+			TSelf operator++(int)
+			{
+				TSelf t = *this;
+				move_iterator(true);
+				return t;
+			}
+
+			iterator_type<TIterator> operator*()const
+			{
+				return *iterator;
+			}
+
+			template<typename TSink>
+			bool push(const TSelf& to, TSink& sink)const
+			{
+				// the current element is already known to satisfy f
+				if (iterator == to.iterator) return true;
+				if (!sink(*iterator)) return false;
+				auto next = [&](iterator_type<TIterator> x){return !f(x) || sink(x); };
+				auto it = iterator;
+				return iterators::push(++it, to.iterator, next);
+			}
+
+			const TIterator& source()const
+			{
+				return iterator;
+			}
+
+			const TFunction& function()const
+			{
+				return f;
+			}
+
+			bool operator==(const TSelf& it)const
+			{
+				return iterator == it.iterator;
+			}
+
+			bool operator!=(const TSelf& it)const
+			{
+				return iterator != it.iterator;
+			}
+		};
+
+		//////////////////////////////////////////////////////////////////
+		// skip
+		//////////////////////////////////////////////////////////////////
+
+		template<typename TIterator>
+		class skip_iterator
+		{
+			typedef skip_iterator<TIterator>							TSelf;
+		private:
+			TIterator			iterator;
+			TIterator			end;
+
+		public:
+			typedef linq_iterator_category<TIterator>					iterator_category;
+
+			skip_iterator(const TIterator& _iterator, const TIterator& _end, int _count)
+				:iterator(range_advance(_iterator, _end, _count)), end(_end)
+			{
+			}
+
+			TSelf& operator++()
+			{
+				++iterator;
+				return *this;
+			}
+
+			TSelf operator++(int)
+			{
+				TSelf t = *this;
+				++iterator;
+				return t;
+			}
+
+			iterator_type<TIterator> operator*()const
+			{
+				return *iterator;
+			}
+
+			int operator-(const TSelf& it)const
+			{
+				return (int)(iterator - it.iterator);
+			}
+
+			TSelf& operator+=(int count)
+			{
+				iterator += count;
+				return *this;
+			}
+
+			template<typename TSink>
+			bool push(const TSelf& to, TSink& sink)const
+			{
+				return iterators::push(iterator, to.iterator, sink);
+			}
+
+			bool operator==(const TSelf& it)const
+			{
+				return iterator == it.iterator;
+			}
+
+			bool operator!=(const TSelf& it)const
+			{
+				return iterator != it.iterator;
+			}
+		};
+
+		//////////////////////////////////////////////////////////////////
+		// skip_while
+		//////////////////////////////////////////////////////////////////
+
+		template<typename TIterator, typename TFunction>
+		class skip_while_iterator
+		{
+			typedef skip_while_iterator<TIterator, TFunction>			TSelf;
+		private:
+			TIterator			iterator;
+			TIterator			end;
+			TFunction			f;
+
+		public:
+			skip_while_iterator(const TIterator& _iterator, const TIterator& _end, const TFunction& _f)
+				:iterator(_iterator), end(_end), f(_f)
+			{
+				while (iterator != end && f(*iterator))
+				{
+					++iterator;
+				}
+			}
+
+			TSelf& operator++()
+			{
+				++iterator;
+				return *this;
+			}
+
+			TSelf operator++(int)
+			{
+				TSelf t = *this;
+				++iterator;
+				return t;
+			}
+
+			iterator_type<TIterator> operator*()const
+			{
+				return *iterator;
+			}
+
+			template<typename TSink>
+			bool push(const TSelf& to, TSink& sink)const
+			{
+				return iterators::push(iterator, to.iterator, sink);
+			}
+
+			bool operator==(const TSelf& it)const
+			{
+				return iterator == it.iterator;
+			}
+
+			bool operator!=(const TSelf& it)const
+			{
+				return iterator != it.iterator;
+			}
+		};
+
+		//////////////////////////////////////////////////////////////////
+		// take
+		//////////////////////////////////////////////////////////////////
+
+		template<typename TIterator>
+		class take_iterator
+		{
+			typedef take_iterator<TIterator>							TSelf;
+		private:
+			TIterator			iterator;
+			TIterator			end;		// for random access iterators, this is where the <count>-th element is
+			int					remaining;
+
+			bool at_end()const
+			{
+				return remaining <= 0 || iterator == end;
+			}
+		public:
+			typedef linq_iterator_category<TIterator>					iterator_category;
+
+			take_iterator(const TIterator& _iterator, const TIterator& _end, int _count)
+				:iterator(_iterator), end(_end), remaining(_count)
+			{
+			}
+
+			TSelf& operator++()
+			{
+				// the source is not moved after the last element unless it is cheap
+				if (--remaining > 0 || is_random_access<TIterator>::value)
+				{
+					++iterator;
+				}
+				return *this;
+			}
+
+			TSelf operator++(int)
+			{
+				TSelf t = *this;
+				++*this;
+				return t;
+			}
+
+			iterator_type<TIterator> operator*()const
+			{
+				return *iterator;
+			}
+
+			int operator-(const TSelf& it)const
+			{
+				return (int)(iterator - it.iterator);
+			}
+
+			TSelf& operator+=(int count)
+			{
+				remaining -= count;
+				iterator += count;
+				return *this;
+			}
+
+			template<typename TSink>
+			bool push(const TSelf& to, TSink& sink)const
+			{
+				if (!to.at_end())
+				{
+					for (auto it = *this; it != to; ++it)
+					{
+						if (!sink(*it)) return false;
+					}
+					return true;
+				}
+
+				// stop after the last element without reading the next one
+				if (at_end()) return true;
+				int count = remaining;
+				bool stopped = false;
+				auto next = [&](iterator_type<TIterator> x)
+				{
+					if (!sink(x))
+					{
+						stopped = true;
+						return false;
+					}
+					return --count > 0;
+				};
+				iterators::push(iterator, end, next);
+				return !stopped;
+			}
+
+			bool operator==(const TSelf& it)const
+			{
+				bool e1 = at_end();
+				bool e2 = it.at_end();
+				return e1 || e2 ? e1 == e2 : iterator == it.iterator;
+			}
+
+			bool operator!=(const TSelf& it)const
+			{
+				return !(*this == it);
+			}
+		};
+
+		//////////////////////////////////////////////////////////////////
+		// take_while
+		//////////////////////////////////////////////////////////////////
+
+		template<typename TIterator, typename TFunction>
+		class take_while_iterator
+		{
+			typedef take_while_iterator<TIterator, TFunction>			TSelf;
+		private:
+			TIterator			iterator;
+			TIterator			end;
+			TFunction			f;
+			bool				finished;
+
+			bool at_end()const
+			{
+				return finished || iterator == end;
+			}
+		public:
+			take_while_iterator(const TIterator& _iterator, const TIterator& _end, const TFunction& _f)
+				:iterator(_iterator), end(_end), f(_f), finished(false)
+			{
+				finished = iterator != end && !f(*iterator);
+			}
+
+			TSelf& operator++()
+			{
+				finished = ++iterator != end && !f(*iterator);
+				return *this;
+			}
+
+			TSelf operator++(int)
+			{
+				TSelf t = *this;
+				++*this;
+				return t;
+			}
+
+			iterator_type<TIterator> operator*()const
+			{
+				return *iterator;
+			}
+
+			template<typename TSink>
+			bool push(const TSelf& to, TSink& sink)const
+			{
+				if (!to.at_end())
+				{
+					for (auto it = *this; it != to; ++it)
+					{
+						if (!sink(*it)) return false;
+					}
+					return true;
+				}
+
+				if (at_end()) return true;
+				if (!sink(*iterator)) return false;
+				bool stopped = false;
+				auto next = [&](iterator_type<TIterator> x)
+				{
+					if (!f(x)) return false;
+					if (!sink(x))
+					{
+						stopped = true;
+						return false;
+					}
+					return true;
+				};
+				auto it = iterator;
+				iterators::push(++it, end, next);
+				return !stopped;
+			}
+
+			bool operator==(const TSelf& it)const
+			{
+				bool e1 = at_end();
+				bool e2 = it.at_end();
+				return e1 || e2 ? e1 == e2 : iterator == it.iterator;
+			}
+
+			bool operator!=(const TSelf& it)const
+			{
+				return !(*this == it);
+			}
+		};
+
+		//////////////////////////////////////////////////////////////////
+		// concat
+		//////////////////////////////////////////////////////////////////
+
+		template<typename TIterator1, typename TIterator2>
+		class concat_iterator
+		{
+			typedef concat_iterator<TIterator1, TIterator2>				TSelf;
+		private:
+			TIterator1			current1;
+			TIterator1			end1;
+			TIterator2			current2;
+			TIterator2			end2;
+			bool				first;
+
+		public:
+			concat_iterator(const TIterator1& _current1, const TIterator1& _end1, const TIterator2& _current2, const TIterator2& _end2)
+				:current1(_current1), end1(_end1), current2(_current2), end2(_end2), first(_current1 != _end1)
+			{
+			}
+
+			TSelf& operator++()
+			{
+				if (first)
+				{
+					if (++current1 == end1)
+					{
+						first = false;
+					}
+				}
+				else
+				{
+					++current2;
+				}
+				return *this;
+			}
+
+			TSelf operator++(int)
+			{
+				TSelf t = *this;
+				if (first)
+				{
+					if (++current1 == end1)
+					{
+						first = false;
+					}
+				}
+				else
+				{
+					++current2;
+				}
+				return t;
+			}
+
+			iterator_type<TIterator1> operator*()const
+			{
+				return first ? *current1 : *current2;
+			}
+
+			template<typename TSink>
+			bool push(const TSelf& to, TSink& sink)const
+			{
+				if (to.first)
+				{
+					for (auto it = *this; it != to; ++it)
+					{
+						if (!sink(*it)) return false;
+					}
+					return true;
+				}
+
+				if (first && !iterators::push(current1, end1, sink)) return false;
+				return iterators::push(current2, to.current2, sink);
+			}
+
+			bool operator==(const TSelf& it)const
+			{
+				if (first != it.first) return false;
+				return first ? current1 == it.current1 : current2 == it.current2;
+			}
+
+			bool operator!=(const TSelf& it)const
+			{
+				if (first != it.first) return true;
+				return first ? current1 != it.current1 : current2 != it.current2;
+			}
+		};
+
+		//////////////////////////////////////////////////////////////////
+		// zip
+		//////////////////////////////////////////////////////////////////
+
+		template<typename TIterator1, typename TIterator2>
+		class zip_iterator
+		{
+			typedef zip_iterator<TIterator1, TIterator2>							TSelf;
+			typedef zip_pair<iterator_type<TIterator1>, iterator_type<TIterator2>>	TElement;
+		private:
+			TIterator1			current1;
+			TIterator1			end1;
+			TIterator2			current2;
+			TIterator2			end2;
+
+			bool				finished;	// zipping stops when any sequence is finished
+
+			void check_end()
+			{
+				finished = current1 == end1 || current2 == end2;
+			}
+		public:
+			typedef typename std::conditional<
+				is_random_access<TIterator1>::value && is_random_access<TIterator2>::value,
+				std::random_access_iterator_tag,
+				std::forward_iterator_tag
+				>::type																iterator_category;
+
+			zip_iterator(const TIterator1& _current1, const TIterator1& _end1, const TIterator2& _current2, const TIterator2& _end2)
+				:current1(_current1), end1(_end1), current2(_current2), end2(_end2), finished(false)
+			{
+				check_end();
+			}
+
+			TSelf& operator++()
+			{
+				++current1;
+				++current2;
+				check_end();
+				return *this;
+			}
+
+			TSelf operator++(int)
+			{
+				TSelf t = *this;
+				++*this;
+				return t;
+			}
+
+			TElement operator*()const
+			{
+				return TElement(*current1, *current2);
+			}
+
+			int operator-(const TSelf& it)const
+			{
+				int size1 = (int)(current1 - it.current1);
+				int size2 = (int)(current2 - it.current2);
+				return size1 < size2 ? size1 : size2;
+			}
+
+			TSelf& operator+=(int count)
+			{
+				current1 += count;
+				current2 += count;
+				check_end();
+				return *this;
+			}
+
+			bool operator==(const TSelf& it)const
+			{
+				if (finished || it.finished) return finished == it.finished;
+				return current1 == it.current1 && current2 == it.current2;
+			}
+
+			bool operator!=(const TSelf& it)const
+			{
+				return !(*this == it);
+			}
+		};
+
+		//////////////////////////////////////////////////////////////////
+		// batch
+		//////////////////////////////////////////////////////////////////
+
+		// a slice points into the source if it is contiguous, otherwise into a buffer that is reused by every batch
+		// so a slice is only valid until the iterator that produces it moves
+		template<typename TIterator>
+		class batch_iterator
+		{
+			typedef batch_iterator<TIterator>							TSelf;
+			typedef typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type	T;
+		private:
+			TIterator							current;	// the first element after this batch
+			TIterator							end;
+			int									size;
+			linq_vector<T>						buffer;
+			const T*							source;
+			int									length;		// 0 at the end
+
+			void read(std::true_type)
+			{
+				auto next = range_advance(current, end, size);
+				length = range_size(current, next);
+				source = length > 0 ? is_contiguous<TIterator>::data(current) : nullptr;
+				current = next;
+			}
+
+			void read(std::false_type)
+			{
+				buffer.clear();
+				for (; current != end && (int)buffer.size() < size; ++current)
+				{
+					buffer.push_back(*current);
+				}
+				length = (int)buffer.size();
+			}
+
+			void read()
+			{
+				read(std::integral_constant<bool, is_contiguous<TIterator>::value>());
+			}
+		public:
+			batch_iterator(const TIterator& _current, const TIterator& _end, int _size)
+				:current(_current), end(_end), size(_size), source(nullptr), length(0)
+			{
+				read();
+			}
+
+			TSelf& operator++()
+			{
+				read();
+				return *this;
+			}
+
+			TSelf operator++(int)
+			{
+				TSelf t = *this;
+				read();
+				return t;
+			}
+
+			array_slice<T> operator*()const
+			{
+				return array_slice<T>(is_contiguous<TIterator>::value ? source : buffer.data(), length);
+			}
+
+			bool operator==(const TSelf& it)const
+			{
+				return current == it.current && length == it.length;
+			}
+
+			bool operator!=(const TSelf& it)const
+			{
+				return !(*this == it);
+			}
+		};
+
+		//////////////////////////////////////////////////////////////////
+		// window
+		//////////////////////////////////////////////////////////////////
+
+		// only windows of exactly <size> elements are produced, slices have the same lifetime as in batch_iterator
+		template<typename TIterator>
+		class window_iterator
+		{
+			typedef window_iterator<TIterator>							TSelf;
+			typedef typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type	T;
+		private:
+			TIterator							current;	// the first element of this window if the source is contiguous, otherwise the first element after it
+			TIterator							end;
+			int									size;
+			int									step;
+			linq_vector<T>						buffer;		// the window is [start, start + size)
+			int									start;
+			const T*							source;
+			bool								available;
+
+			void read(bool first, std::true_type)
+			{
+				if (!first) current = range_advance(current, end, step);
+				available = range_size(current, end) >= size;
+				source = available ? is_contiguous<TIterator>::data(current) : nullptr;
+				if (!available) current = end;
+			}
+
+			void read(bool first, std::false_type)
+			{
+				if (!first) start += step;
+				if (start >= (int)buffer.size())
+				{
+					// elements between two windows are skipped without being stored
+					for (int i = (int)buffer.size(); i < start && current != end; i++, ++current);
+					buffer.clear();
+					start = 0;
+				}
+				else if (start >= size)
+				{
+					// elements are moved to the front after every <size> elements, so each of them is moved at most once
+					buffer.erase(buffer.begin(), buffer.begin() + start);
+					start = 0;
+				}
+
+				for (; current != end && (int)buffer.size() - start < size; ++current)
+				{
+					buffer.push_back(*current);
+				}
+				available = (int)buffer.size() - start == size;
+			}
+
+			void read(bool first)
+			{
+				read(first, std::integral_constant<bool, is_contiguous<TIterator>::value>());
+			}
+		public:
+			window_iterator(const TIterator& _current, const TIterator& _end, int _size, int _step)
+				:current(_current), end(_end), size(_size), step(_step), start(0), source(nullptr), available(false)
+			{
+				read(true);
+			}
+
+			TSelf& operator++()
+			{
+				read(false);
+				return *this;
+			}
+
+			TSelf operator++(int)
+			{
+				TSelf t = *this;
+				read(false);
+				return t;
+			}
+
+			array_slice<T> operator*()const
+			{
+				return array_slice<T>(is_contiguous<TIterator>::value ? source : buffer.data() + start, size);
+			}
+
+			bool operator==(const TSelf& it)const
+			{
+				return current == it.current && available == it.available;
+			}
+
+			bool operator!=(const TSelf& it)const
+			{
+				return !(*this == it);
+			}
+		};
+
+		//////////////////////////////////////////////////////////////////
+		// chunk_by
+		//////////////////////////////////////////////////////////////////
+
+		// consecutive elements with the same key, slices have the same lifetime as in batch_iterator
+		template<typename TIterator, typename TFunction>
+		class chunk_by_iterator
+		{
+			typedef chunk_by_iterator<TIterator, TFunction>				TSelf;
+			typedef typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type	T;
+			typedef typename std::remove_cv<typename std::remove_reference<decltype((*(TFunction*)0)(*(T*)0))>::type>::type		TKey;
+		private:
+			TIterator							current;
+			TIterator							end;
+			TFunction							f;
+			linq_vector<T>						buffer;		// elements of this chunk, followed by the first element of the next chunk if it has been read
+			int									length;		// 0 at the end
+			optional_value<TKey>				key;
+			optional_value<TKey>				nextKey;
+
+			void read()
+			{
+				buffer.erase(buffer.begin(), buffer.begin() + length);
+				if (buffer.empty())
+				{
+					if (current == end)
+					{
+						length = 0;
+						return;
+					}
+					buffer.push_back(*current);
+					++current;
+					key.emplace(f(buffer[0]));
+				}
+				else
+				{
+					key.emplace(*nextKey);
+				}
+
+				for (length = 1; current != end; length++)
+				{
+					buffer.push_back(*current);
+					++current;
+					auto&& next = f(buffer.back());
+					if (!(next == *key))
+					{
+						nextKey.emplace(next);
+						return;
+					}
+				}
+			}
+		public:
+			chunk_by_iterator(const TIterator& _current, const TIterator& _end, const TFunction& _f)
+				:current(_current), end(_end), f(_f), length(0)
+			{
+				read();
+			}
+
+			TSelf& operator++()
+			{
+				read();
+				return *this;
+			}
+
+			TSelf operator++(int)
+			{
+				TSelf t = *this;
+				read();
+				return t;
+			}
+
+			zip_pair<TKey, array_slice<T>> operator*()const
+			{
+				return zip_pair<TKey, array_slice<T>>(*key, array_slice<T>(buffer.data(), length));
+			}
+
+			bool operator==(const TSelf& it)const
+			{
+				// the source position of the last chunk is the same as the one before it if it has been read ahead
+				return current == it.current && length == it.length && buffer.size() == it.buffer.size();
+			}
+
+			bool operator!=(const TSelf& it)const
+			{
+				return !(*this == it);
+			}
+		};
+
+		//////////////////////////////////////////////////////////////////
+		// cache
+		//////////////////////////////////////////////////////////////////
+
+		// elements pulled from the source are kept, so every element is computed only once
+		template<typename TIterator>
+		class cache_storage
+		{
+			typedef typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type	T;
+		private:
+			TIterator							current;
+			TIterator							end;
+			std::deque<T, linq_allocator<T>>	values;		// elements are not moved when the deque grows
+			std::mutex							lock;
+			std::atomic<bool>					complete;	// values will not change any more
+			bool								synchronized;
+
+			bool pull(int index)
+			{
+				while ((int)values.size() <= index)
+				{
+					if (current == end)
+					{
+						complete = true;
+						return false;
+					}
+					values.push_back(*current);
+					++current;
+				}
+				return true;
+			}
+		public:
+			cache_storage(const TIterator& _current, const TIterator& _end, bool _synchronized)
+				:current(_current), end(_end), complete(false), synchronized(_synchronized)
+			{
+			}
+
+			// pulls elements until the index-th one, returns false if there is no such element
+			bool available(int index)
+			{
+				if (complete) return index < (int)values.size();
+				if (!synchronized) return pull(index);
+				std::lock_guard<std::mutex> guard(lock);
+				return pull(index);
+			}
+
+			// the index-th element must be available
+			const T& get(int index)
+			{
+				if (complete || !synchronized) return values[index];
+				std::lock_guard<std::mutex> guard(lock);
+				return values[index];
+			}
+
+			template<typename TSink>
+			bool push(int index, TSink& sink)
+			{
+				for (int i = index; available(i); i++)
+				{
+					if (complete)
+					{
+						for (auto it = values.begin() + i; it != values.end(); ++it)
+						{
+							if (!sink(*it)) return false;
+						}
+						return true;
+					}
+					if (!sink(get(i))) return false;
+				}
+				return true;
+			}
+		};
+
+		template<typename TIterator>
+		class cache_iterator
+		{
+			typedef cache_iterator<TIterator>							TSelf;
+			typedef typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type	T;
+		private:
+			std::shared_ptr<cache_storage<TIterator>>	storage;
+			int											index;		// -1 for the end of the source
+
+			bool at_end()const
+			{
+				return index == -1 || !storage->available(index);
+			}
+		public:
+			cache_iterator(const std::shared_ptr<cache_storage<TIterator>>& _storage, int _index)
+				:storage(_storage), index(_index)
+			{
+			}
+
+			TSelf& operator++()
+			{
+				++index;
+				return *this;
+			}
+
+			TSelf operator++(int)
+			{
+				TSelf t = *this;
+				++index;
+				return t;
+			}
+
+			const T& operator*()const
+			{
+				return storage->get(index);
+			}
+
+			template<typename TSink>
+			bool push(const TSelf& to, TSink& sink)const
+			{
+				if (!to.at_end())
+				{
+					for (auto it = *this; it != to; ++it)
+					{
+						if (!sink(*it)) return false;
+					}
+					return true;
+				}
+
+				return index == -1 || storage->push(index, sink);
+			}
+
+			bool operator==(const TSelf& it)const
+			{
+				bool e1 = at_end();
+				bool e2 = it.at_end();
+				return e1 || e2 ? e1 == e2 : index == it.index;
+			}
+
+			bool operator!=(const TSelf& it)const
+			{
+				return !(*this == it);
+			}
+		};
+
+		//////////////////////////////////////////////////////////////////
+		// profile
+		//////////////////////////////////////////////////////////////////
+
+		template<typename TIterator>
+		class profile_iterator
+		{
+			typedef profile_iterator<TIterator>							TSelf;
+
+			template<typename TSink>
+			struct profile_sink
+			{
+				linq_profile_timer&				timer;
+				linq_profile_stage*				stage;
+				TSink&							sink;
+				bool							counted;
+
+				template<typename U>
+				bool operator()(U&& value)
+				{
+					if (!counted) stage->elements++;
+					counted = false;
+					return timer.pause([&](){return sink(std::forward<U>(value)); });
+				}
+			};
+		private:
+			TIterator							iterator;
+			linq_profile_stage*					stage;
+			mutable bool						counted;	// an element is counted when it is read for the first time
+
+		public:
+			typedef linq_iterator_category<TIterator>					iterator_category;
+
+			profile_iterator(const TIterator& _iterator, linq_profile_stage* _stage)
+				:iterator(_iterator), stage(_stage), counted(false)
+			{
+			}
+
+			TSelf& operator++()
+			{
+				linq_profile_timer timer(stage);
+				++iterator;
+				counted = false;
+				return *this;
+			}
+
+			TSelf operator++(int)
+			{
+				TSelf t = *this;
+				++*this;
+				return t;
+			}
+
+			iterator_type<TIterator> operator*()const
+			{
+				linq_profile_timer timer(stage);
+				if (!counted)
+				{
+					counted = true;
+					stage->elements++;
+				}
+				return *iterator;
+			}
+
+			int operator-(const TSelf& it)const
+			{
+				return (int)(iterator - it.iterator);
+			}
+
+			TSelf& operator+=(int count)
+			{
+				iterator += count;
+				counted = false;
+				return *this;
+			}
+
+			template<typename TSink>
+			bool push(const TSelf& to, TSink& sink)const
+			{
+				linq_profile_timer timer(stage);
+				profile_sink<TSink> next = { timer, stage, sink, counted };
+				return iterators::push(iterator, to.iterator, next);
+			}
+
+			bool operator==(const TSelf& it)const
+			{
+				linq_profile_timer timer(stage);
+				return iterator == it.iterator;
+			}
+
+			bool operator!=(const TSelf& it)const
+			{
+				linq_profile_timer timer(stage);
+				return iterator != it.iterator;
+			}
+		};
+
+		//////////////////////////////////////////////////////////////////
+		// select_many
+		//////////////////////////////////////////////////////////////////
+
+		template<typename TIterator, typename TFunction>
+		class select_many_iterator
+		{
+			typedef select_many_iterator<TIterator, TFunction>									TSelf;
+			typedef typename std::remove_cv<typename std::remove_reference<decltype((*(TFunction*)0)(**(TIterator*)0))>::type>::type		TCollection;
+			typedef decltype(std::begin(*(TCollection*)0))										TInnerIterator;
+		private:
+			mutable TIterator						outer;
+			TIterator								outerEnd;
+			TFunction								f;
+			mutable bool							started;	// f is not called until the iterator is used
+			mutable std::shared_ptr<TCollection>	inner;		// shared by copies of this iterator, null at the end
+			mutable optional_value<TInnerIterator>	current;
+			mutable optional_value<TInnerIterator>	end;
+			mutable int								offset;		// position of current in inner
+
+			void move_to_inner()const
+			{
+				offset = 0;
+				while (outer != outerEnd)
+				{
+					inner = linq_make_shared<TCollection>(f(*outer));
+					current.emplace(std::begin(*inner));
+					end.emplace(std::end(*inner));
+					if (*current != *end) return;
+					++outer;
+				}
+				inner = nullptr;
+				current.reset();
+				end.reset();
+			}
+
+			void start()const
+			{
+				if (!started)
+				{
+					started = true;
+					move_to_inner();
+				}
+			}
+		public:
+			select_many_iterator(const TIterator& _outer, const TIterator& _outerEnd, const TFunction& _f)
+				:outer(_outer), outerEnd(_outerEnd), f(_f), started(false), offset(0)
+			{
+			}
+
+			TSelf& operator++()
+			{
+				start();
+				offset++;
+				if (++*current == *end)
+				{
+					++outer;
+					move_to_inner();
+				}
+				return *this;
+			}
+
+			TSelf operator++(int)
+			{
+				TSelf t = *this;
+				++*this;
+				return t;
+			}
+
+			iterator_type<TInnerIterator> operator*()const
+			{
+				start();
+				return **current;
+			}
+
+			template<typename TSink>
+			bool push(const TSelf& to, TSink& sink)const
+			{
+				start();
+				to.start();
+				if (to.inner)
+				{
+					for (auto it = *this; it != to; ++it)
+					{
+						if (!sink(*it)) return false;
+					}
+					return true;
+				}
+
+				// the rest of the current collection, and then following collections without sharing them
+				if (!inner) return true;
+				if (!iterators::push(*current, *end, sink)) return false;
+				auto it = outer;
+				while (++it != to.outer)
+				{
+					auto&& collection = f(*it);
+					if (!iterators::push(std::begin(collection), std::end(collection), sink)) return false;
+				}
+				return true;
+			}
+
+			// iterators that called f separately are still equal at the same position
+			bool operator==(const TSelf& it)const
+			{
+				start();
+				it.start();
+				return outer == it.outer && offset == it.offset;
+			}
+
+			bool operator!=(const TSelf& it)const
+			{
+				return !(*this == it);
+			}
+		};
+
+		//////////////////////////////////////////////////////////////////
+		// order
+		//////////////////////////////////////////////////////////////////
+
+		template<typename T>
+		class order_key
+		{
+		public:
+			virtual ~order_key(){}
+
+			// stable sort every range of elements with equal previous keys, and split them by this key
+			virtual void					sort(linq_vector<T>& values, linq_vector<int>& runs)const = 0;
+			virtual int						compare(const T& a, const T& b)const = 0;
+		};
+
+		template<typename T, typename TFunction>
+		class order_key_implement : public order_key<T>
+		{
+			typedef typename std::remove_cv<typename std::remove_reference<decltype((*(TFunction*)0)(*(T*)0))>::type>::type		TKey;
+		private:
+			TFunction						keySelector;
+			bool							descending;
+
+		public:
+			order_key_implement(const TFunction& _keySelector, bool _descending)
+				:keySelector(_keySelector), descending(_descending)
+			{
+			}
+
+			void sort(linq_vector<T>& values, linq_vector<int>& runs)const override
+			{
+				linq_vector<T> sorted;
+				linq_vector<int> splitted;
+				sorted.reserve(values.size());
+				splitted.push_back(0);
+
+				linq_vector<TKey> keys;
+				linq_vector<int> indices;
+				for (size_t r = 0; r + 1 < runs.size(); r++)
+				{
+					int begin = runs[r];
+					int end = runs[r + 1];
+					if (end - begin == 1)
+					{
+						sorted.push_back(std::move(values[begin]));
+						splitted.push_back(end);
+						continue;
+					}
+
+					keys.clear();
+					indices.clear();
+					for (int i = begin; i < end; i++)
+					{
+						keys.push_back(keySelector(values[i]));
+						indices.push_back(i - begin);
+					}
+					if (descending)
+					{
+						std::stable_sort(indices.begin(), indices.end(), [&](int a, int b){return keys[b] < keys[a]; });
+					}
+					else
+					{
+						std::stable_sort(indices.begin(), indices.end(), [&](int a, int b){return keys[a] < keys[b]; });
+					}
+
+					for (int i = 0; i < end - begin; i++)
+					{
+						if (i > 0)
+						{
+							auto& a = keys[indices[i - 1]];
+							auto& b = keys[indices[i]];
+							if (a < b || b < a)
+							{
+								splitted.push_back(begin + i);
+							}
+						}
+						sorted.push_back(std::move(values[begin + indices[i]]));
+					}
+					splitted.push_back(end);
+				}
+				values.swap(sorted);
+				runs.swap(splitted);
+			}
+
+			int compare(const T& a, const T& b)const override
+			{
+				auto ka = keySelector(a);
+				auto kb = keySelector(b);
+				int result = ka < kb ? -1 : kb < ka ? 1 : 0;
+				return descending ? -result : result;
+			}
+		};
+
+		template<typename T>
+		class order_storage
+		{
+			typedef linq_vector<std::shared_ptr<order_key<T>>>		TKeys;
+			typedef std::pair<T, int>								TEntry;
+		private:
+			optional_value<hide_type_iterator<T>>	begin;		// the source is released after it is read
+			optional_value<hide_type_iterator<T>>	end;
+			TKeys							keys;
+			int								limit;		// only keep the first <limit> elements when it is not -1
+			std::once_flag					evaluated;
+			linq_vector<T>					values;
+
+			void sort()
+			{
+				auto sink = [this](const T& value){values.push_back(value); return true; };
+				iterators::push(*begin, *end, sink);
+				linq_vector<int> runs;
+				runs.push_back(0);
+				runs.push_back((int)values.size());
+				for (auto& key : keys)
+				{
+					key->sort(values, runs);
+				}
+			}
+
+			// keep the best <limit> elements in a heap in one pass, ties are broken by the original order
+			void top()
+			{
+				if (limit == 0) return;
+				auto less = [this](const TEntry& a, const TEntry& b)
+				{
+					for (auto& key : keys)
+					{
+						int result = key->compare(a.first, b.first);
+						if (result != 0) return result < 0;
+					}
+					return a.second < b.second;
+				};
+
+				linq_vector<TEntry> heap;
+				int index = 0;
+				auto sink = [&](const T& value)
+				{
+					if ((int)heap.size() < limit)
+					{
+						heap.push_back(TEntry(value, index));
+						std::push_heap(heap.begin(), heap.end(), less);
+					}
+					else
+					{
+						TEntry entry(value, index);
+						if (less(entry, heap.front()))
+						{
+							std::pop_heap(heap.begin(), heap.end(), less);
+							heap.back() = std::move(entry);
+							std::push_heap(heap.begin(), heap.end(), less);
+						}
+					}
+					index++;
+					return true;
+				};
+				iterators::push(*begin, *end, sink);
+
+				std::sort_heap(heap.begin(), heap.end(), less);
+				values.reserve(heap.size());
+				for (auto& entry : heap)
+				{
+					values.push_back(std::move(entry.first));
+				}
+			}
+		public:
+			order_storage(const hide_type_iterator<T>& _begin, const hide_type_iterator<T>& _end, const TKeys& _keys, int _limit)
+				:keys(_keys), limit(_limit)
+			{
+				begin.emplace(_begin);
+				end.emplace(_end);
+			}
+
+			const linq_vector<T>& get()
+			{
+				std::call_once(evaluated, [this]()
+				{
+					if (limit == -1)
+					{
+						sort();
+					}
+					else
+					{
+						top();
+					}
+					begin.reset();
+					end.reset();
+				});
+				return values;
+			}
+		};
+
+		// sorted runs of at most <budget> elements are written to a temporary file
+		// when all elements fit in the budget, nothing is written and they are sorted in memory
+		template<typename T>
+		class external_order_storage
+		{
+			typedef linq_vector<std::shared_ptr<order_key<T>>>		TKeys;
+		public:
+			struct run
+			{
+				fpos_t						position;
+				int							count;
+			};
+		private:
+			TKeys							keys;
+			int								budget;
+			int								total;
+			linq_vector<T>					values;
+			linq_vector<run>				runs;
+			FILE*							file;
+			std::mutex						lock;		// iterators in different threads share the position of file
+
+			external_order_storage(const external_order_storage&) = delete;
+			external_order_storage& operator=(const external_order_storage&) = delete;
+
+			void sort()
+			{
+				linq_vector<int> ranges;
+				ranges.push_back(0);
+				ranges.push_back((int)values.size());
+				for (auto& key : keys)
+				{
+					key->sort(values, ranges);
+				}
+			}
+
+			void spill()
+			{
+				sort();
+				if (!file)
+				{
+					file = tmpfile();
+					if (!file) throw linq_exception("Failed to create a temporary file.");
+				}
+				run r;
+				r.count = (int)values.size();
+				if (fgetpos(file, &r.position) != 0 || !linq_serializer<T>::write(file, values.data(), r.count))
+				{
+					throw linq_exception("Failed to write a temporary file.");
+				}
+				runs.push_back(r);
+				values.clear();
+			}
+
+			void evaluate(const hide_type_iterator<T>& begin, const hide_type_iterator<T>& end)
+			{
+				auto sink = [this](const T& value)
+				{
+					total++;
+					values.push_back(value);
+					if ((int)values.size() == budget) spill();
+					return true;
+				};
+				iterators::push(begin, end, sink);
+
+				if (runs.empty())
+				{
+					sort();
+				}
+				else
+				{
+					if (!values.empty()) spill();
+					linq_vector<T>().swap(values);
+				}
+			}
+		public:
+			// runs are written here instead of when iterating, so the source is not kept alive
+			external_order_storage(const hide_type_iterator<T>& begin, const hide_type_iterator<T>& end, const TKeys& _keys, int _budget)
+				:keys(_keys), budget(_budget), total(0), file(nullptr)
+			{
+				try
+				{
+					evaluate(begin, end);
+				}
+				catch (...)
+				{
+					if (file) fclose(file);
+					throw;
+				}
+			}
+
+			~external_order_storage()
+			{
+				if (file) fclose(file);
+			}
+
+			// all elements when there is no run
+			const linq_vector<T>& get()const
+			{
+				return values;
+			}
+
+			const linq_vector<run>& get_runs()const
+			{
+				return runs;
+			}
+
+			int size()const
+			{
+				return total;
+			}
+
+			// elements of every run read into memory at a time, so all runs share the budget
+			int buffer_size()const
+			{
+				int size = budget / (int)runs.size();
+				return size < 1 ? 1 : size;
+			}
+
+			// appends <count> elements from position to buffer, and moves position after them
+			void read(fpos_t& position, linq_vector<T>& buffer, int count)
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				if (fsetpos(file, &position) != 0 || !linq_serializer<T>::read(file, buffer, count) || fgetpos(file, &position) != 0)
+				{
+					throw linq_exception("Failed to read a temporary file.");
+				}
+			}
+
+			int compare(const T& a, const T& b)const
+			{
+				for (auto& key : keys)
+				{
+					int result = key->compare(a, b);
+					if (result != 0) return result;
+				}
+				return 0;
+			}
+		};
+
+		// runs are merged with a heap while iterating, copies of the iterator share the merge state until one of them moves
+		// runs are merged lazily, so the iterator does not start reading until it is used
+		template<typename T>
+		class external_ordered_iterator
+		{
+			typedef external_ordered_iterator<T>						TSelf;
+
+			struct cursor
+			{
+				fpos_t							position;	// the first element that is not in the buffer
+				int								remaining;	// elements that are not in the buffer
+				linq_vector<T>					buffer;
+				int								index;
+			};
+
+			struct merge_state
+			{
+				linq_vector<cursor>				cursors;
+				linq_vector<int>				heap;		// cursors that are not finished, the top one has the next element
+			};
+		private:
+			std::shared_ptr<external_order_storage<T>>	storage;
+			int											index;		// -1 for the end of the sorted result
+			mutable std::shared_ptr<merge_state>		state;		// null before the first element is read
+
+			const T& current(int c)const
+			{
+				return state->cursors[c].buffer[state->cursors[c].index];
+			}
+
+			// the top of the heap is the smallest element, ties are broken by the order of runs to keep the sort stable
+			bool after(int a, int b)const
+			{
+				int result = storage->compare(current(a), current(b));
+				return result != 0 ? result > 0 : a > b;
+			}
+
+			void fill(cursor& c)const
+			{
+				int count = storage->buffer_size();
+				if (count > c.remaining) count = c.remaining;
+				c.buffer.clear();
+				c.index = 0;
+				storage->read(c.position, c.buffer, count);
+				c.remaining -= count;
+			}
+
+			bool merging()const
+			{
+				auto& runs = storage->get_runs();
+				if (runs.empty()) return false;
+				if (!state)
+				{
+					state = linq_make_shared<merge_state>();
+					state->cursors.resize(runs.size());
+					for (int i = 0; i < (int)runs.size(); i++)
+					{
+						state->cursors[i].position = runs[i].position;
+						state->cursors[i].remaining = runs[i].count;
+						fill(state->cursors[i]);
+						state->heap.push_back(i);
+					}
+					std::make_heap(state->heap.begin(), state->heap.end(), [this](int a, int b){return after(a, b); });
+				}
+				return true;
+			}
+
+			bool at_end()const
+			{
+				return index == -1 || index >= storage->size();
+			}
+		public:
+			external_ordered_iterator(const std::shared_ptr<external_order_storage<T>>& _storage, int _index)
+				:storage(_storage), index(_index)
+			{
+			}
+
+			TSelf& operator++()
+			{
+				if (merging())
+				{
+					// only an iterator that moves while its state is shared copies the buffers
+					if (state.use_count() > 1)
+					{
+						state = linq_make_shared<merge_state>(*state);
+					}
+					auto less = [this](int a, int b){return after(a, b); };
+					auto& heap = state->heap;
+					int top = heap.front();
+					std::pop_heap(heap.begin(), heap.end(), less);
+					heap.pop_back();
+
+					auto& c = state->cursors[top];
+					if (++c.index == (int)c.buffer.size() && c.remaining > 0)
+					{
+						fill(c);
+					}
+					if (c.index < (int)c.buffer.size())
+					{
+						heap.push_back(top);
+						std::push_heap(heap.begin(), heap.end(), less);
+					}
+				}
+				++index;
+				return *this;
+			}
+
+			// the returned iterator keeps the merge state, so this iterator copies the buffers, prefer the prefix increment
+			TSelf operator++(int)
+			{
+				TSelf t = *this;
+				++*this;
+				return t;
+			}
+
+			const T& operator*()const
+			{
+				return merging() ? current(state->heap.front()) : storage->get()[index];
+			}
+
+			bool operator==(const TSelf& it)const
+			{
+				bool e1 = at_end();
+				bool e2 = it.at_end();
+				return e1 || e2 ? e1 == e2 : index == it.index;
+			}
+
+			bool operator!=(const TSelf& it)const
+			{
+				return !(*this == it);
+			}
+		};
+
+		template<typename T>
+		class ordered_iterator
+		{
+			typedef ordered_iterator<T>									TSelf;
+		private:
+			std::shared_ptr<order_storage<T>>	storage;
+			int									index;		// -1 for the end of the sorted result
+
+			int position()const
+			{
+				return index == -1 ? (int)storage->get().size() : index;
+			}
+		public:
+			typedef std::random_access_iterator_tag						iterator_category;
+
+			ordered_iterator(const std::shared_ptr<order_storage<T>>& _storage, int _index)
+				:storage(_storage), index(_index)
+			{
+			}
+
+			TSelf& operator++()
+			{
+				++index;
+				return *this;
+			}
+
+			TSelf operator++(int)
+			{
+				TSelf t = *this;
+				++index;
+				return t;
+			}
+
+			const T& operator*()const
+			{
+				return storage->get()[index];
+			}
+
+			int operator-(const TSelf& it)const
+			{
+				return position() - it.position();
+			}
+
+			TSelf& operator+=(int count)
+			{
+				index += count;
+				return *this;
+			}
+
+			template<typename TSink>
+			bool push(const TSelf& to, TSink& sink)const
+			{
+				auto& values = storage->get();
+				for (int i = index, n = to.position(); i < n; i++)
+				{
+					if (!sink(values[i])) return false;
+				}
+				return true;
+			}
+
+			bool operator==(const TSelf& it)const
+			{
+				return position() == it.position();
+			}
+
+			bool operator!=(const TSelf& it)const
+			{
+				return position() != it.position();
+			}
+		};
+	}
+
+	namespace types
+	{
+		template<typename T>
+		using storage_it = iterators::storage_iterator<T>;
+		
+		template<typename T>
+		using empty_it = iterators::empty_iterator<T>;
+
+		template<typename TIterator, typename TFunction>
+		using select_it = iterators::select_iterator<TIterator, TFunction>;
+
+		template<typename TIterator, typename TFunction>
+		using where_it = iterators::where_iterator<TIterator, TFunction>;
+
+		template<typename TIterator>
+		using skip_it = iterators::skip_iterator<TIterator>;
+
+		template<typename TIterator, typename TFunction>
+		using skip_while_it = iterators::skip_while_iterator<TIterator, TFunction>;
+
+		template<typename TIterator>
+		using take_it = iterators::take_iterator<TIterator>;
+
+		template<typename TIterator, typename TFunction>
+		using take_while_it = iterators::take_while_iterator<TIterator, TFunction>;
+
+		template<typename TIterator1, typename TIterator2>
+		using concat_it = iterators::concat_iterator<TIterator1, TIterator2>;
+
+		template<typename TIterator1, typename TIterator2>
+		using zip_it = iterators::zip_iterator<TIterator1, TIterator2>;
+
+		template<typename TIterator>
+		using batch_it = iterators::batch_iterator<TIterator>;
+
+		template<typename TIterator>
+		using window_it = iterators::window_iterator<TIterator>;
+
+		template<typename TIterator, typename TFunction>
+		using chunk_by_it = iterators::chunk_by_iterator<TIterator, TFunction>;
+
+		template<typename TIterator>
+		using cache_it = iterators::cache_iterator<TIterator>;
+
+		template<typename TIterator>
+		using profile_it = iterators::profile_iterator<TIterator>;
+
+		template<typename TIterator, typename TFunction>
+		using select_many_it = iterators::select_many_iterator<TIterator, TFunction>;
+
+		template<typename T>
+		using ordered_it = iterators::ordered_iterator<T>;
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// grouping
+	//////////////////////////////////////////////////////////////////
+
+	// values grouped by keys in one buffer, both keys and values keep the order they first appear
+	template<typename TKey, typename TValue>
+	class grouped_storage
+	{
+	public:
+		linq_index<TKey>						index;
+		linq_vector<int>						offsets;	// values of the i-th key are in [offsets[i], offsets[i + 1])
+		std::shared_ptr<linq_vector<TValue>>	values;
+
+	private:
+		linq_vector<TValue>						unordered;	// values in the order they are added, until build is called
+		linq_vector<int>						groups;
+
+		// values are moved to their positions directly if they could be default constructed, otherwise in the order of positions
+		void scatter(linq_vector<int>& positions, std::true_type)
+		{
+			values->resize(unordered.size());
+			for (int i = 0; i < (int)groups.size(); i++)
+			{
+				(*values)[positions[groups[i]]++] = std::move(unordered[i]);
+			}
+		}
+
+		void scatter(linq_vector<int>& positions, std::false_type)
+		{
+			linq_vector<int> order(groups.size());
+			for (int i = 0; i < (int)groups.size(); i++)
+			{
+				order[positions[groups[i]]++] = i;
+			}
+			values->reserve(order.size());
+			for (auto i : order)
+			{
+				values->push_back(std::move(unordered[i]));
+			}
+		}
+	public:
+		grouped_storage()
+			:values(linq_make_shared<linq_vector<TValue>>())
+		{
+		}
+
+		template<typename TIterator, typename TFunction>
+		grouped_storage(const TIterator& begin, const TIterator& end, const TFunction& keySelector)
+			:values(linq_make_shared<linq_vector<TValue>>())
+		{
+			if (is_random_access<TIterator>::value)
+			{
+				reserve(iterators::range_size(begin, end));
+			}
+			auto sink = [&](iterator_type<TIterator> x)
+			{
+				unordered.push_back(x);
+				groups.push_back(index.insert(keySelector(unordered.back())).first);
+				return true;
+			};
+			iterators::push(begin, end, sink);
+			build();
+		}
+
+		void reserve(int size)
+		{
+			unordered.reserve(size);
+			groups.reserve(size);
+		}
+
+		// values are not in their groups until build is called
+		void add(const TKey& key, const TValue& value)
+		{
+			unordered.push_back(value);
+			groups.push_back(index.insert(key).first);
+		}
+
+		// the group is an index of a key in another index, and build(count) is called with the size of that index
+		void add_to(int group, const TValue& value)
+		{
+			unordered.push_back(value);
+			groups.push_back(group);
+		}
+
+		void build()
+		{
+			build(index.size());
+		}
+
+		void build(int count)
+		{
+			offsets.assign(count + 1, 0);
+			for (auto group : groups)
+			{
+				offsets[group + 1]++;
+			}
+			for (int i = 0; i < count; i++)
+			{
+				offsets[i + 1] += offsets[i];
+			}
+
+			if (std::is_sorted(groups.begin(), groups.end()))
+			{
+				// values of every key are already together
+				values->swap(unordered);
+			}
+			else
+			{
+				linq_vector<int> positions(offsets.begin(), offsets.end() - 1);
+				scatter(positions, std::integral_constant<bool, std::is_default_constructible<TValue>::value>());
+			}
+			linq_vector<TValue>().swap(unordered);
+			linq_vector<int>().swap(groups);
+		}
+
+		int size()const
+		{
+			return index.size();
+		}
+
+		iterators::storage_iterator<TValue> begin(int group)const
+		{
+			return iterators::storage_iterator<TValue>(values, values->begin() + offsets[group]);
+		}
+
+		iterators::storage_iterator<TValue> end(int group)const
+		{
+			return iterators::storage_iterator<TValue>(values, values->begin() + offsets[group + 1]);
+		}
+	};
+
+	//////////////////////////////////////////////////////////////////
+	// parallel
+	//////////////////////////////////////////////////////////////////
+
+	// runs chunks of a job on a fixed set of threads, the calling thread takes part in the job
+	// every participant owns a range of chunks, and steals half of the remaining chunks from others when its own range is done
+	class parallel_pool
+	{
+	private:
+		struct partition
+		{
+			std::mutex							lock;
+			int									begin;
+			int									end;
+
+			partition()
+				:begin(0), end(0)
+			{
+			}
+		};
+
+		std::vector<std::thread>				threads;
+		std::vector<std::unique_ptr<partition>>	partitions;		// the last one belongs to the calling thread
+		std::mutex								exclusive;		// one job at a time
+		std::mutex								lock;
+		std::condition_variable					started;
+		std::condition_variable					finished;
+		const std::function<void(int)>*			job;
+		std::exception_ptr						error;
+		std::atomic<bool>						failed;
+		int										generation;
+		int										running;
+		bool									stopping;
+
+		static bool& inside_job()
+		{
+			static thread_local bool value = false;
+			return value;
+		}
+
+		bool take(int index, int& chunk)
+		{
+			auto& owned = *partitions[index];
+			std::lock_guard<std::mutex> guard(owned.lock);
+			if (owned.begin == owned.end) return false;
+			chunk = owned.begin++;
+			return true;
+		}
+
+		bool steal(int index)
+		{
+			int count = (int)partitions.size();
+			for (int i = 1; i < count; i++)
+			{
+				auto& victim = *partitions[(index + i) % count];
+				int begin = 0, end = 0;
+				{
+					std::lock_guard<std::mutex> guard(victim.lock);
+					int remaining = victim.end - victim.begin;
+					if (remaining == 0) continue;
+					begin = victim.end - (remaining + 1) / 2;
+					end = victim.end;
+					victim.end = begin;
+				}
+				auto& owned = *partitions[index];
+				std::lock_guard<std::mutex> guard(owned.lock);
+				owned.begin = begin;
+				owned.end = end;
+				return true;
+			}
+			return false;
+		}
+
+		void work(int index)
+		{
+			int chunk = 0;
+			while (true)
+			{
+				if (!take(index, chunk))
+				{
+					if (!steal(index)) return;
+					continue;
+				}
+				if (failed) continue;
+				try
+				{
+					(*job)(chunk);
+				}
+				catch (...)
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					if (!error) error = std::current_exception();
+					failed = true;
+				}
+			}
+		}
+
+		void worker(int index)
+		{
+			inside_job() = true;
+			int seen = 0;
+			while (true)
+			{
+				{
+					std::unique_lock<std::mutex> guard(lock);
+					started.wait(guard, [&](){return stopping || generation != seen; });
+					if (stopping) return;
+					seen = generation;
+				}
+				work(index);
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					if (--running == 0) finished.notify_all();
+				}
+			}
+		}
+	public:
+		parallel_pool(int participants)
+			:job(nullptr), failed(false), generation(0), running(0), stopping(false)
+		{
+			if (participants < 1) participants = 1;
+			for (int i = 0; i < participants; i++)
+			{
+				partitions.push_back(std::unique_ptr<partition>(new partition));
+			}
+			for (int i = 0; i < participants - 1; i++)
+			{
+				threads.push_back(std::thread(&parallel_pool::worker, this, i));
+			}
+		}
+
+		~parallel_pool()
+		{
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				stopping = true;
+			}
+			started.notify_all();
+			for (auto& thread : threads)
+			{
+				thread.join();
+			}
+		}
+
+		// pools are shared by all queries with the same number of participants
+		static std::shared_ptr<parallel_pool> get(int participants)
+		{
+			static std::mutex poolsLock;
+			static std::map<int, std::shared_ptr<parallel_pool>> pools;
+			std::lock_guard<std::mutex> guard(poolsLock);
+			auto& pool = pools[participants];
+			if (!pool) pool = std::make_shared<parallel_pool>(participants);
+			return pool;
+		}
+
+		int size()const
+		{
+			return (int)partitions.size();
+		}
+
+		// calls f(0) to f(count - 1) and returns when all of them are done, the first exception is rethrown
+		// jobs started inside a job run on the current thread
+		void run(int count, const std::function<void(int)>& f)
+		{
+			if (threads.empty() || count <= 1 || inside_job())
+			{
+				for (int i = 0; i < count; i++)
+				{
+					f(i);
+				}
+				return;
+			}
+
+			std::lock_guard<std::mutex> serial(exclusive);
+			int participants = size();
+			for (int i = 0; i < participants; i++)
+			{
+				partitions[i]->begin = (int)((long long)count * i / participants);
+				partitions[i]->end = (int)((long long)count * (i + 1) / participants);
+			}
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				job = &f;
+				error = nullptr;
+				failed = false;
+				running = (int)threads.size();
+				generation++;
+			}
+			started.notify_all();
+
+			inside_job() = true;
+			work(participants - 1);
+			inside_job() = false;
+
+			std::unique_lock<std::mutex> guard(lock);
+			finished.wait(guard, [&](){return running == 0; });
+			job = nullptr;
+			if (error) std::rethrow_exception(error);
+		}
+	};
+
+	// stages of a parallel query, they build the sequential query that runs on each chunk
+	class parallel_identity
+	{
+	public:
+		template<typename TEnumerable>
+		TEnumerable operator()(const TEnumerable& e)const
+		{
+			return e;
+		}
+	};
+
+	template<typename TPipeline, typename TFunction>
+	class parallel_select
+	{
+	private:
+		TPipeline								pipeline;
+		TFunction								f;
+
+	public:
+		parallel_select(const TPipeline& _pipeline, const TFunction& _f)
+			:pipeline(_pipeline), f(_f)
+		{
+		}
+
+		template<typename TEnumerable>
+		auto operator()(const TEnumerable& e)const->decltype(std::declval<const TPipeline&>()(e).select(std::declval<const TFunction&>()))
+		{
+			return pipeline(e).select(f);
+		}
+	};
+
+	template<typename TPipeline, typename TFunction>
+	class parallel_where
+	{
+	private:
+		TPipeline								pipeline;
+		TFunction								f;
+
+	public:
+		parallel_where(const TPipeline& _pipeline, const TFunction& _f)
+			:pipeline(_pipeline), f(_f)
+		{
+		}
+
+		template<typename TEnumerable>
+		auto operator()(const TEnumerable& e)const->decltype(std::declval<const TPipeline&>()(e).where(std::declval<const TFunction&>()))
+		{
+			return pipeline(e).where(f);
+		}
+	};
+
+	//////////////////////////////////////////////////////////////////
+	// linq
+	//////////////////////////////////////////////////////////////////
+
+	template<typename TIterator>
+	class linq_enumerable;
+
+	template<typename T>
+	class linq;
+
+	template<typename T>
+	class linq_ordered;
+
+	template<typename TIterator, typename TPipeline>
+	class linq_parallel;
+
+	// a key and its values, values of all groups are stored in one buffer
+	template<typename TKey, typename TValue>
+	using group_pair = zip_pair<TKey, linq_enumerable<types::storage_it<TValue>>>;
+
+	//////////////////////////////////////////////////////////////////
+	// fusion
+	//////////////////////////////////////////////////////////////////
+
+	// linq_enumerable calls these functions to build or run operators
+	// overloads for specific iterator types rewrite adjacent operators into cheaper ones
+	namespace fusion
+	{
+		template<typename TFunction1, typename TFunction2>
+		class conjunction
+		{
+		private:
+			TFunction1			f;
+			TFunction2			g;
+
+		public:
+			conjunction(const TFunction1& _f, const TFunction2& _g)
+				:f(_f), g(_g)
+			{
+			}
+
+			template<typename T>
+			bool operator()(const T& x)const
+			{
+				return f(x) && g(x);
+			}
+		};
+
+		template<typename TFunction1, typename TFunction2>
+		class composition
+		{
+		private:
+			TFunction1			f;
+			TFunction2			g;
+
+		public:
+			composition(const TFunction1& _f, const TFunction2& _g)
+				:f(_f), g(_g)
+			{
+			}
+
+			template<typename T>
+			auto operator()(const T& x)const->decltype(g(f(x)))
+			{
+				return g(f(x));
+			}
+		};
+
+		template<typename TIterator, typename TFunction>
+		linq_enumerable<types::where_it<TIterator, TFunction>> where(const TIterator& begin, const TIterator& end, const TFunction& f)
+		{
+			return linq_enumerable<types::where_it<TIterator, TFunction>>(
+				types::where_it<TIterator, TFunction>(begin, end, f),
+				types::where_it<TIterator, TFunction>(end, end, f)
+				);
+		}
+
+		// where(f).where(g) tests f(x) && g(x) in one iterator
+		template<typename TIterator, typename TFunction1, typename TFunction2>
+		linq_enumerable<types::where_it<TIterator, conjunction<TFunction1, TFunction2>>> where(const types::where_it<TIterator, TFunction1>& begin, const types::where_it<TIterator, TFunction1>& end, const TFunction2& g)
+		{
+			return where(begin.source(), end.source(), conjunction<TFunction1, TFunction2>(begin.function(), g));
+		}
+
+		template<typename TIterator, typename TFunction>
+		linq_enumerable<types::select_it<TIterator, TFunction>> select(const TIterator& begin, const TIterator& end, const TFunction& f)
+		{
+			return linq_enumerable<types::select_it<TIterator, TFunction>>(
+				types::select_it<TIterator, TFunction>(begin, f),
+				types::select_it<TIterator, TFunction>(end, f)
+				);
+		}
+
+		// select(f).select(g) calls g(f(x)) in one iterator
+		template<typename TIterator, typename TFunction1, typename TFunction2>
+		linq_enumerable<types::select_it<TIterator, composition<TFunction1, TFunction2>>> select(const types::select_it<TIterator, TFunction1>& begin, const types::select_it<TIterator, TFunction1>& end, const TFunction2& g)
+		{
+			return select(begin.source(), end.source(), composition<TFunction1, TFunction2>(begin.function(), g));
+		}
+
+		template<typename TIterator>
+		linq_enumerable<types::take_it<TIterator>> take(const TIterator& begin, const TIterator& end, int count)
+		{
+			auto last = iterators::range_bound(begin, end, count);
+			return linq_enumerable<types::take_it<TIterator>>(
+				types::take_it<TIterator>(begin, last, count),
+				types::take_it<TIterator>(last, last, count)
+				);
+		}
+
+		// select(f).take(n) becomes take(n).select(f), so that operators after it are still fused with select
+		template<typename TIterator, typename TFunction>
+		linq_enumerable<types::select_it<types::take_it<TIterator>, TFunction>> take(const types::select_it<TIterator, TFunction>& begin, const types::select_it<TIterator, TFunction>& end, int count)
+		{
+			auto taken = take(begin.source(), end.source(), count);
+			return select(taken.begin(), taken.end(), begin.function());
+		}
+
+		template<typename TIterator>
+		int count(const TIterator& begin, const TIterator& end)
+		{
+			if (is_random_access<TIterator>::value)
+			{
+				return iterators::range_size(begin, end);
+			}
+			int counter = 0;
+			auto sink = [&](iterator_type<TIterator>){counter++; return true; };
+			iterators::push(begin, end, sink);
+			return counter;
+		}
+
+		// where(f).count() adds f(x) instead of branching on it
+		template<typename TIterator, typename TFunction>
+		int count(const types::where_it<TIterator, TFunction>& begin, const types::where_it<TIterator, TFunction>& end)
+		{
+			auto& f = begin.function();
+			int counter = 0;
+			auto sink = [&](iterator_type<TIterator> x){counter += f(x) ? 1 : 0; return true; };
+			iterators::push(begin.source(), end.source(), sink);
+			return counter;
+		}
+
+		// select(f).count() does not call f, as it is for random access sources
+		template<typename TIterator, typename TFunction>
+		int count(const types::select_it<TIterator, TFunction>& begin, const types::select_it<TIterator, TFunction>& end)
+		{
+			return count(begin.source(), end.source());
+		}
+
+		template<typename TIterator>
+		typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type sum(const TIterator& begin, const TIterator& end, std::false_type)
+		{
+			typedef typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type	TElement;
+			linq_enumerable<TIterator> e(begin, end);
+			return e.empty() ? TElement() : e.template reduce<simd::add>(std::integral_constant<bool, is_contiguous<TIterator>::value>());
+		}
+
+		// select(f).sum() over a contiguous source calls f in a plain loop with independent accumulators, which the compiler could vectorize
+		template<typename TIterator, typename TFunction>
+		typename std::remove_cv<typename std::remove_reference<iterator_type<types::select_it<TIterator, TFunction>>>::type>::type sum(const types::select_it<TIterator, TFunction>& begin, const types::select_it<TIterator, TFunction>& end, std::true_type)
+		{
+			typedef typename std::remove_cv<typename std::remove_reference<iterator_type<types::select_it<TIterator, TFunction>>>::type>::type	TResult;
+			int count = iterators::range_size(begin.source(), end.source());
+			if (count == 0) return TResult();
+
+			auto xs = is_contiguous<TIterator>::data(begin.source());
+			auto& f = begin.function();
+			TResult a = TResult(), b = TResult(), c = TResult(), d = TResult();
+			int i = 0;
+			for (; i + 4 <= count; i += 4)
+			{
+				a += f(xs[i]);
+				b += f(xs[i + 1]);
+				c += f(xs[i + 2]);
+				d += f(xs[i + 3]);
+			}
+			for (; i < count; i++)
+			{
+				a += f(xs[i]);
+			}
+			return (a + b) + (c + d);
+		}
+
+		template<typename TIterator>
+		struct is_contiguous_select : std::false_type
+		{
+		};
+
+		template<typename TIterator, typename TFunction>
+		struct is_contiguous_select<types::select_it<TIterator, TFunction>> : std::integral_constant<bool,
+			is_contiguous<TIterator>::value &&
+			std::is_arithmetic<typename std::remove_cv<typename std::remove_reference<iterator_type<types::select_it<TIterator, TFunction>>>::type>::type>::value
+			>
+		{
+		};
+
+		template<typename TIterator>
+		typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type sum(const TIterator& begin, const TIterator& end)
+		{
+			return sum(begin, end, std::integral_constant<bool, is_contiguous_select<TIterator>::value>());
+		}
+	}
+
+	template<typename TElement>
+	linq<TElement> from_values(std::shared_ptr<std::vector<TElement>> xs)
+	{
+		return linq_enumerable<types::storage_it<TElement>>(
+			types::storage_it<TElement>(xs, xs->begin()),
+			types::storage_it<TElement>(xs, xs->end())
+			);
+	}
+
+	template<typename TElement>
+	linq<TElement> from_values(std::shared_ptr<linq_vector<TElement>> xs)
+	{
+		return linq_enumerable<types::storage_it<TElement>>(
+			types::storage_it<TElement>(xs, xs->begin()),
+			types::storage_it<TElement>(xs, xs->end())
+			);
+	}
+
+	template<typename TElement>
+	linq<TElement> from_values(const std::initializer_list<TElement>& ys)
+	{
+		auto xs = linq_make_shared<linq_vector<TElement>>(ys.begin(), ys.end());
+		return linq_enumerable<types::storage_it<TElement>>(
+			types::storage_it<TElement>(xs, xs->begin()),
+			types::storage_it<TElement>(xs, xs->end())
+			);
+	}
+
+	template<typename TElement>
+	linq<TElement> from_value(const TElement& value)
+	{
+		auto xs = linq_make_shared<linq_vector<TElement>>();
+		xs->push_back(value);
+		return from_values(xs);
+	}
+
+	template<typename TElement>
+	linq<TElement> from_empty()
+	{
+		return linq_enumerable<types::empty_it<TElement>>(
+			types::empty_it<TElement>(),
+			types::empty_it<TElement>()
+			);
+	}
+
+	template<typename TIterator>
+	linq_enumerable<TIterator> from(const TIterator& begin, const TIterator& end);
+
+	template<typename TContainer>
+	auto from(const TContainer& container)->linq_enumerable<decltype(std::begin(container))>;
+
+	template<typename TIterator>
+	class linq_enumerable
+	{
+		typedef typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type	TElement;
+	private:
+		TIterator				_begin;
+		TIterator				_end;
+
+		TElement last(std::true_type)const
+		{
+			if (empty()) throw linq_exception("Failed to get a value from an empty collection.");
+			auto it = _begin;
+			it += count() - 1;
+			return *it;
+		}
+
+		TElement last(std::false_type)const
+		{
+			if (empty()) throw linq_exception("Failed to get a value from an empty collection.");
+			auto it = _begin;
+			TElement result = *it;
+			auto sink = [&](iterator_type<TIterator> x){result = x; return true; };
+			iterators::push(++it, _end, sink);
+			return result;
+		}
+
+		template<typename TResult>
+		TResult average(std::true_type)const
+		{
+			return sum() / count();
+		}
+
+		template<typename TResult>
+		TResult average(std::false_type)const
+		{
+			TResult sum = 0;
+			int counter = 0;
+			auto sink = [&](iterator_type<TIterator> x){sum += (TResult)x; counter++; return true; };
+			iterators::push(_begin, _end, sink);
+			return sum / counter;
+		}
+
+		// contiguous int, float and double sources are reduced by SIMD instructions
+		template<typename TReduce>
+		TElement reduce(std::true_type)const
+		{
+			if (_begin == _end) throw linq_exception("Failed to get a value from an empty collection.");
+			auto xs = is_contiguous<TIterator>::data(_begin);
+			return simd::reduce<TReduce>(xs + 1, iterators::range_size(_begin, _end) - 1, xs[0]);
+		}
+
+		template<typename TReduce>
+		TElement reduce(std::false_type)const
+		{
+			return aggregate([](const TElement& a, const TElement& b){return TReduce::apply(a, b); });
+		}
+
+		template<typename TIterator2>
+		friend typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator2>>::type>::type fusion::sum(const TIterator2& begin, const TIterator2& end, std::false_type);
+
+		// joins build hash tables on the smaller source, sources are read together until one of them ends unless both sizes are known
+		template<typename TIterator2>
+		bool smaller_than(const linq_enumerable<TIterator2>& e)const
+		{
+			if (is_random_access<TIterator>::value && is_random_access<TIterator2>::value)
+			{
+				return iterators::range_size(_begin, _end) < iterators::range_size(e.begin(), e.end());
+			}
+			auto it1 = _begin;
+			auto it2 = e.begin();
+			auto end2 = e.end();
+			while (it1 != _end && it2 != end2)
+			{
+				++it1;
+				++it2;
+			}
+			return it1 == _end && it2 != end2;
+		}
+
+		// indices of keys in the order of keys, results of joins are ordered by keys
+		template<typename TIndex>
+		static linq_vector<int> sorted_keys(const TIndex& index)
+		{
+			linq_vector<int> order(index.size());
+			for (int i = 0; i < index.size(); i++)
+			{
+				order[i] = i;
+			}
+			std::sort(order.begin(), order.end(), [&](int a, int b){return index.key(a) < index.key(b); });
+			return order;
+		}
+
+		// rows of a join are produced in the order of probing, and are stably moved to the order of their buckets
+		template<typename TRow>
+		static std::shared_ptr<linq_vector<TRow>> sort_rows(linq_vector<TRow>& rows, const linq_vector<int>& buckets, int bucketCount)
+		{
+			auto result = linq_make_shared<linq_vector<TRow>>();
+			if (std::is_sorted(buckets.begin(), buckets.end()))
+			{
+				result->swap(rows);
+				return result;
+			}
+
+			linq_vector<int> positions(bucketCount + 1, 0);
+			for (auto bucket : buckets)
+			{
+				positions[bucket + 1]++;
+			}
+			for (int i = 0; i < bucketCount; i++)
+			{
+				positions[i + 1] += positions[i];
+			}
+			linq_vector<int> order(rows.size());
+			for (int i = 0; i < (int)rows.size(); i++)
+			{
+				order[positions[buckets[i]]++] = i;
+			}
+			result->reserve(rows.size());
+			for (auto i : order)
+			{
+				result->push_back(std::move(rows[i]));
+			}
+			return result;
+		}
+
+	public:
+		linq_enumerable()
+		{
+		}
+
+		linq_enumerable(const TIterator& _begin_, const TIterator& _end_)
+			:_begin(_begin_), _end(_end_)
+		{
+		}
+
+		TIterator begin()const
+		{
+			return _begin;
+		}
+
+		TIterator end()const
+		{
+			return _end;
+		}
+
+#ifdef _MSC_VER
+
+#define SUPPORT_STL_CONTAINERS(NAME)\
+		template<typename TIterator2>\
+		auto NAME(const linq_enumerable<TIterator2>& e)const->decltype(NAME ## _(e))\
+		{\
+			return NAME ## _(e); \
+		}\
+		template<typename TContainer>\
+		auto NAME(const TContainer& e)const->decltype(NAME ## _(from(e)))\
+		{\
+			return NAME ## _(from(e)); \
+		}\
+		template<typename TElement>\
+		auto NAME(const std::initializer_list<TElement>& e)const->decltype(NAME ## _(from(e)))\
+		{\
+			return NAME ## _(from(e)); \
+		}\
+
+#define PROTECT_PARAMETERS(...) __VA_ARGS__
+
+#define SUPPORT_STL_CONTAINERS_EX(NAME, TYPES, PARAMETERS, ARGUMENTS)\
+		template<typename TIterator2, TYPES>\
+		auto NAME(const linq_enumerable<TIterator2>& e, PARAMETERS)const->decltype(NAME ## _(e, ARGUMENTS))\
+		{\
+			return NAME ## _(e, ARGUMENTS); \
+		}\
+		template<typename TContainer, TYPES>\
+		auto NAME(const TContainer& e, PARAMETERS)const->decltype(NAME ## _(from(e), ARGUMENTS))\
+		{\
+			return NAME ## _(from(e), ARGUMENTS); \
+		}\
+		template<typename TElement, TYPES>\
+		auto NAME(const std::initializer_list<TElement>& e, PARAMETERS)const->decltype(NAME ## _(from(e), ARGUMENTS))\
+		{\
+			return NAME ## _(from(e), ARGUMENTS); \
+		}\
+
+#else
+
+#define SUPPORT_STL_CONTAINERS(NAME)\
+		template<typename TIterator2>\
+		auto NAME(const linq_enumerable<TIterator2>& e)const->decltype(this->NAME ## _(e))\
+		{\
+			return NAME ## _(e); \
+		}\
+		template<typename TContainer>\
+		auto NAME(const TContainer& e)const->decltype(this->NAME ## _(from(e)))\
+		{\
+			return NAME ## _(from(e)); \
+		}\
+		template<typename TElement>\
+		auto NAME(const std::initializer_list<TElement>& e)const->decltype(this->NAME ## _(from(e)))\
+		{\
+			return NAME ## _(from(e)); \
+		}\
+
+#define PROTECT_PARAMETERS(...) __VA_ARGS__
+
+#define SUPPORT_STL_CONTAINERS_EX(NAME, TYPES, PARAMETERS, ARGUMENTS)\
+		template<typename TIterator2, TYPES>\
+		auto NAME(const linq_enumerable<TIterator2>& e, PARAMETERS)const->decltype(this->NAME ## _(e, ARGUMENTS))\
+		{\
+			return NAME ## _(e, ARGUMENTS); \
+		}\
+		template<typename TContainer, TYPES>\
+		auto NAME(const TContainer& e, PARAMETERS)const->decltype(this->NAME ## _(from(e), ARGUMENTS))\
+		{\
+			return NAME ## _(from(e), ARGUMENTS); \
+		}\
+		template<typename TElement, TYPES>\
+		auto NAME(const std::initializer_list<TElement>& e, PARAMETERS)const->decltype(this->NAME ## _(from(e), ARGUMENTS))\
+		{\
+			return NAME ## _(from(e), ARGUMENTS); \
+		}\
+
+#endif
+
+		//////////////////////////////////////////////////////////////////
+		// iterating (lazy evaluation)
+		//////////////////////////////////////////////////////////////////
+
+		// select, where and take could be fused with the operator before them, see namespace fusion
+
+		template<typename TFunction>
+		auto select(const TFunction& f)const->decltype(fusion::select(*(TIterator*)0, *(TIterator*)0, f))
+		{
+			return fusion::select(_begin, _end, f);
+		}
+
+		template<typename TFunction>
+		auto where(const TFunction& f)const->decltype(fusion::where(*(TIterator*)0, *(TIterator*)0, f))
+		{
+			return fusion::where(_begin, _end, f);
+		}
+
+		linq_enumerable<types::skip_it<TIterator>> skip(int count)const
+		{
+			return linq_enumerable<types::skip_it<TIterator>>(
+				types::skip_it<TIterator>(_begin, _end, count),
+				types::skip_it<TIterator>(_end, _end, count)
+				);
+		}
+
+		template<typename TFunction>
+		linq_enumerable<types::skip_while_it<TIterator, TFunction>> skip_while(const TFunction& f)const
+		{
+			return linq_enumerable<types::skip_while_it<TIterator, TFunction>>(
+				types::skip_while_it<TIterator, TFunction>(_begin, _end, f),
+				types::skip_while_it<TIterator, TFunction>(_end, _end, f)
+				);
+		}
+
+		auto take(int count)const->decltype(fusion::take(*(TIterator*)0, *(TIterator*)0, count))
+		{
+			return fusion::take(_begin, _end, count);
+		}
+
+		template<typename TFunction>
+		linq_enumerable<types::take_while_it<TIterator, TFunction>> take_while(const TFunction& f)const
+		{
+			return linq_enumerable<types::take_while_it<TIterator, TFunction>>(
+				types::take_while_it<TIterator, TFunction>(_begin, _end, f),
+				types::take_while_it<TIterator, TFunction>(_end, _end, f)
+				);
+		}
+
+		template<typename TIterator2>
+		linq_enumerable<types::concat_it<TIterator, TIterator2>> concat_(const linq_enumerable<TIterator2>& e)const
+		{
+			return linq_enumerable<types::concat_it<TIterator, TIterator2>>(
+				types::concat_it<TIterator, TIterator2>(_begin, _end, e.begin(), e.end()),
+				types::concat_it<TIterator, TIterator2>(_end, _end, e.end(), e.end())
+				);
+		}
+		SUPPORT_STL_CONTAINERS(concat)
+
+		//////////////////////////////////////////////////////////////////
+		// counting
+		//////////////////////////////////////////////////////////////////
+
+		template<typename T>
+		bool contains(const T& t)const
+		{
+			auto sink = [&](iterator_type<TIterator> x){return !(x == t); };
+			return !iterators::push(_begin, _end, sink);
+		}
+
+		int count()const
+		{
+			return fusion::count(_begin, _end);
+		}
+
+		// the number of elements if it could be known without iterating, otherwise -1
+		int size_hint()const
+		{
+			return is_random_access<TIterator>::value ? count() : -1;
+		}
+
+		linq<TElement> default_if_empty(const TElement& value)const
+		{
+			if (empty())
+			{
+				return from_value(value);
+			}
+			else
+			{
+				return *this;
+			}
+		}
+
+		TElement element_at(int index)const
+		{
+			if (index >= 0)
+			{
+				auto it = iterators::range_advance(_begin, _end, index);
+				if (it != _end) return *it;
+			}
+			throw linq_exception("Argument out of range: index.");
+		}
+
+		bool empty()const
+		{
+			return _begin == _end;
+		}
+
+		TElement first()const
+		{
+			if (empty()) throw linq_exception("Failed to get a value from an empty collection.");
+			return *_begin;
+		}
+
+		TElement first_or_default(const TElement& value)const
+		{
+			return empty() ? value : *_begin;
+		}
+
+		TElement last()const
+		{
+			return last(std::integral_constant<bool, is_random_access<TIterator>::value>());
+		}
+
+		TElement last_or_default(const TElement& value)const
+		{
+			return empty() ? value : last();
+		}
+
+		linq_enumerable<TIterator> single()const
+		{
+			auto it = _begin;
+			if (it == _end) throw linq_exception("Failed to get a value from an empty collection.");
+
+			++it;
+			if (it != _end) throw linq_exception("The collection should have exactly one value.");
+
+			return *this;
+		}
+
+		linq<TElement> single_or_default(const TElement& value)const
+		{
+			auto it = _begin;
+			if (it == _end) return from_value(value);
+
+			++it;
+			if (it != _end) throw linq_exception("The collection should have exactly one value.");
+
+			return *this;
+		}
+
+		template<typename TIterator2>
+		bool sequence_equal_(const linq_enumerable<TIterator2>& e)const
+		{
+			auto x = _begin;
+			auto xe = _end;
+			auto y = e.begin();
+			auto ye = e.end();
+
+			while (x != xe && y != ye)
+			{
+				if (*x != *y) return false;
+				++x;
+				++y;
+			}
+			return x == xe && y == ye;
+		}
+		SUPPORT_STL_CONTAINERS(sequence_equal)
+
+		//////////////////////////////////////////////////////////////////
+		// set
+		//////////////////////////////////////////////////////////////////
+
+		linq<TElement> distinct()const
+		{
+			linq_index<TElement> set;
+			auto xs = linq_make_shared<linq_vector<TElement>>();
+			for (auto it = _begin; it != _end; ++it)
+			{
+				if (set.insert(*it).second)
+				{
+					xs->push_back(*it);
+				}
+			}
+			return from_values(xs);
+		}
+
+		template<typename THash, typename TEqual>
+		linq<TElement> distinct(const THash& hash, const TEqual& equal)const
+		{
+			hash_index<TElement, THash, TEqual> set(hash, equal);
+			auto xs = linq_make_shared<linq_vector<TElement>>();
+			for (auto it = _begin; it != _end; ++it)
+			{
+				if (set.insert(*it).second)
+				{
+					xs->push_back(*it);
+				}
+			}
+			return from_values(xs);
+		}
+
+		template<typename TFunction>
+		linq<TElement> distinct_by(const TFunction& keySelector)const
+		{
+			typedef typename std::remove_cv<typename std::remove_reference<decltype(keySelector(*(TElement*)0))>::type>::type		TKey;
+
+			linq_index<TKey> set;
+			auto xs = linq_make_shared<linq_vector<TElement>>();
+			for (auto it = _begin; it != _end; ++it)
+			{
+				auto value = *it;
+				if (set.insert(keySelector(value)).second)
+				{
+					xs->push_back(value);
+				}
+			}
+			return from_values(xs);
+		}
+
+		template<typename TFunction, typename THash, typename TEqual>
+		linq<TElement> distinct_by(const TFunction& keySelector, const THash& hash, const TEqual& equal)const
+		{
+			typedef typename std::remove_cv<typename std::remove_reference<decltype(keySelector(*(TElement*)0))>::type>::type		TKey;
+
+			hash_index<TKey, THash, TEqual> set(hash, equal);
+			auto xs = linq_make_shared<linq_vector<TElement>>();
+			for (auto it = _begin; it != _end; ++it)
+			{
+				auto value = *it;
+				if (set.insert(keySelector(value)).second)
+				{
+					xs->push_back(value);
+				}
+			}
+			return from_values(xs);
+		}
+
+		template<typename TIterator2>
+		linq<TElement> except_with_(const linq_enumerable<TIterator2>& e)const
+		{
+			linq_index<TElement> set;
+			for (auto it = e.begin(); it != e.end(); ++it)
+			{
+				set.insert(*it);
+			}
+			auto xs = linq_make_shared<linq_vector<TElement>>();
+			for (auto it = _begin; it != _end; ++it)
+			{
+				if (set.insert(*it).second)
+				{
+					xs->push_back(*it);
+				}
+			}
+			return from_values(xs);
+		}
+		SUPPORT_STL_CONTAINERS(except_with)
+
+		template<typename TIterator2>
+		linq<TElement> intersect_with_(const linq_enumerable<TIterator2>& e)const
+		{
+			linq_index<TElement> seti, set;
+			for (auto it = e.begin(); it != e.end(); ++it)
+			{
+				set.insert(*it);
+			}
+			auto xs = linq_make_shared<linq_vector<TElement>>();
+			for (auto it = _begin; it != _end; ++it)
+			{
+				if (seti.insert(*it).second && !set.insert(*it).second)
+				{
+					xs->push_back(*it);
+				}
+			}
+			return from_values(xs);
+		}
+		SUPPORT_STL_CONTAINERS(intersect_with)
+
+		template<typename TIterator2>
+		linq<TElement> union_with_(const linq_enumerable<TIterator2>& e)const
+		{
+			return concat(e).distinct();
+		}
+		SUPPORT_STL_CONTAINERS(union_with)
+
+		//////////////////////////////////////////////////////////////////
+		// aggregating (elements are pushed through the whole pipeline in one loop)
+		//////////////////////////////////////////////////////////////////
+
+		template<typename TFunction>
+		void for_each(const TFunction& f)const
+		{
+			auto sink = [&](iterator_type<TIterator> x){f(x); return true; };
+			iterators::push(_begin, _end, sink);
+		}
+
+		template<typename TFunction>
+		TElement aggregate(const TFunction& f)const
+		{
+			auto it = _begin;
+			if (it == _end) throw linq_exception("Failed to get a value from an empty collection.");
+
+			TElement result = *it;
+			auto sink = [&](iterator_type<TIterator> x){result = f(result, x); return true; };
+			iterators::push(++it, _end, sink);
+			return result;
+		}
+
+		template<typename TResult, typename TFunction>
+		TResult aggregate(const TResult& init, const TFunction& f)const
+		{
+			TResult result = init;
+			auto sink = [&](iterator_type<TIterator> x){result = f(result, x); return true; };
+			iterators::push(_begin, _end, sink);
+			return result;
+		}
+
+		// stops at the first element that fails
+		template<typename TFunction>
+		bool all(const TFunction& f)const
+		{
+			auto sink = [&](iterator_type<TIterator> x){return (bool)f(x); };
+			return iterators::push(_begin, _end, sink);
+		}
+
+		// stops at the first element that passes
+		template<typename TFunction>
+		bool any(const TFunction& f)const
+		{
+			auto sink = [&](iterator_type<TIterator> x){return !f(x); };
+			return !iterators::push(_begin, _end, sink);
+		}
+
+		template<typename TResult>
+		TResult average()const
+		{
+			if (_begin == _end) throw linq_exception("Failed to get a value from an empty collection.");
+			return average<TResult>(std::integral_constant<bool, is_contiguous<TIterator>::value && std::is_same<TResult, TElement>::value>());
+		}
+
+		TElement max()const
+		{
+			return reduce<simd::maximum>(std::integral_constant<bool, is_contiguous<TIterator>::value>());
+		}
+
+		TElement min()const
+		{
+			return reduce<simd::minimum>(std::integral_constant<bool, is_contiguous<TIterator>::value>());
+		}
+
+		// the sum of no element is TElement()
+		TElement sum()const
+		{
+			return fusion::sum(_begin, _end);
+		}
+
+		TElement product()const
+		{
+			return reduce<simd::multiply>(std::integral_constant<bool, is_contiguous<TIterator>::value>());
+		}
+
+		//////////////////////////////////////////////////////////////////
+		// aggregating by keys (only one accumulator is kept for each key)
+		//////////////////////////////////////////////////////////////////
+
+		// keys keep the order they first appear, first(element) creates the accumulator of a new key, and next(accumulator, element) updates it
+		template<typename TFunction, typename TFirst, typename TNext>
+		auto accumulate_by(const TFunction& keySelector, const TFirst& first, const TNext& next)const
+			->linq<zip_pair<
+				typename std::remove_cv<typename std::remove_reference<decltype(keySelector(*(TElement*)0))>::type>::type,
+				typename std::remove_cv<typename std::remove_reference<decltype(first(*(TElement*)0))>::type>::type
+				>>
+		{
+			typedef typename std::remove_cv<typename std::remove_reference<decltype(keySelector(*(TElement*)0))>::type>::type		TKey;
+			typedef typename std::remove_cv<typename std::remove_reference<decltype(first(*(TElement*)0))>::type>::type			TResult;
+
+			linq_index<TKey> index;
+			auto result = linq_make_shared<linq_vector<zip_pair<TKey, TResult>>>();
+			auto sink = [&](iterator_type<TIterator> x)
+			{
+				auto key = index.insert(keySelector(x));
+				if (key.second)
+				{
+					result->push_back(zip_pair<TKey, TResult>(index.key(key.first), first(x)));
+				}
+				else
+				{
+					auto& accumulator = (*result)[key.first].second;
+					accumulator = next(accumulator, x);
+				}
+				return true;
+			};
+			iterators::push(_begin, _end, sink);
+			return from_values(result);
+		}
+
+		template<typename TFunction, typename TResult, typename TFunction2>
+		auto aggregate_by(const TFunction& keySelector, const TResult& init, const TFunction2& f)const
+			->linq<zip_pair<typename std::remove_cv<typename std::remove_reference<decltype(keySelector(*(TElement*)0))>::type>::type, TResult>>
+		{
+			return accumulate_by(keySelector, [&](const TElement& x){return (TResult)f(init, x); }, [&](const TResult& a, const TElement& x){return (TResult)f(a, x); });
+		}
+
+		template<typename TFunction>
+		auto count_by(const TFunction& keySelector)const
+			->linq<zip_pair<typename std::remove_cv<typename std::remove_reference<decltype(keySelector(*(TElement*)0))>::type>::type, int>>
+		{
+			return accumulate_by(keySelector, [](const TElement&){return 1; }, [](int a, const TElement&){return a + 1; });
+		}
+
+		template<typename TFunction, typename TFunction2>
+		auto sum_by(const TFunction& keySelector, const TFunction2& valueSelector)const
+			->linq<zip_pair<
+				typename std::remove_cv<typename std::remove_reference<decltype(keySelector(*(TElement*)0))>::type>::type,
+				typename std::remove_cv<typename std::remove_reference<decltype(valueSelector(*(TElement*)0))>::type>::type
+				>>
+		{
+			typedef typename std::remove_cv<typename std::remove_reference<decltype(valueSelector(*(TElement*)0))>::type>::type		TValue;
+			return accumulate_by(keySelector, [&](const TElement& x){return (TValue)valueSelector(x); }, [&](const TValue& a, const TElement& x){return (TValue)(a + valueSelector(x)); });
+		}
+
+		template<typename TFunction, typename TFunction2>
+		auto min_by(const TFunction& keySelector, const TFunction2& valueSelector)const
+			->linq<zip_pair<
+				typename std::remove_cv<typename std::remove_reference<decltype(keySelector(*(TElement*)0))>::type>::type,
+				typename std::remove_cv<typename std::remove_reference<decltype(valueSelector(*(TElement*)0))>::type>::type
+				>>
+		{
+			typedef typename std::remove_cv<typename std::remove_reference<decltype(valueSelector(*(TElement*)0))>::type>::type		TValue;
+			return accumulate_by(keySelector, [&](const TElement& x){return (TValue)valueSelector(x); }, [&](const TValue& a, const TElement& x){return simd::minimum::apply(a, (TValue)valueSelector(x)); });
+		}
+
+		template<typename TFunction, typename TFunction2>
+		auto max_by(const TFunction& keySelector, const TFunction2& valueSelector)const
+			->linq<zip_pair<
+				typename std::remove_cv<typename std::remove_reference<decltype(keySelector(*(TElement*)0))>::type>::type,
+				typename std::remove_cv<typename std::remove_reference<decltype(valueSelector(*(TElement*)0))>::type>::type
+				>>
+		{
+			typedef typename std::remove_cv<typename std::remove_reference<decltype(valueSelector(*(TElement*)0))>::type>::type		TValue;
+			return accumulate_by(keySelector, [&](const TElement& x){return (TValue)valueSelector(x); }, [&](const TValue& a, const TElement& x){return simd::maximum::apply(a, (TValue)valueSelector(x)); });
+		}
+
+		//////////////////////////////////////////////////////////////////
+		// restructuring
+		//////////////////////////////////////////////////////////////////
+
+		template<typename TFunction>
+		linq_enumerable<types::select_many_it<TIterator, TFunction>> select_many(const TFunction& f)const
+		{
+			return linq_enumerable<types::select_many_it<TIterator, TFunction>>(
+				types::select_many_it<TIterator, TFunction>(_begin, _end, f),
+				types::select_many_it<TIterator, TFunction>(_end, _end, f)
+				);
+		}
+
+		// slices of <size> elements, the last one could be shorter
+		// slices are only valid until the iterator moves, call to_vector to keep them
+		linq_enumerable<types::batch_it<TIterator>> batch(int size)const
+		{
+			if (size <= 0) throw linq_exception("Argument out of range: size.");
+			return linq_enumerable<types::batch_it<TIterator>>(
+				types::batch_it<TIterator>(_begin, _end, size),
+				types::batch_it<TIterator>(_end, _end, size)
+				);
+		}
+
+		// slices of <size> elements starting from every <step>-th element, a source shorter than <size> returns an empty sequence
+		linq_enumerable<types::window_it<TIterator>> window(int size, int step = 1)const
+		{
+			if (size <= 0) throw linq_exception("Argument out of range: size.");
+			if (step <= 0) throw linq_exception("Argument out of range: step.");
+			return linq_enumerable<types::window_it<TIterator>>(
+				types::window_it<TIterator>(_begin, _end, size, step),
+				types::window_it<TIterator>(_end, _end, size, step)
+				);
+		}
+
+		// pairs of a key and a slice of consecutive elements that have this key
+		template<typename TFunction>
+		linq_enumerable<types::chunk_by_it<TIterator, TFunction>> chunk_by(const TFunction& keySelector)const
+		{
+			return linq_enumerable<types::chunk_by_it<TIterator, TFunction>>(
+				types::chunk_by_it<TIterator, TFunction>(_begin, _end, keySelector),
+				types::chunk_by_it<TIterator, TFunction>(_end, _end, keySelector)
+				);
+		}
+
+		// keys are sorted and values keep their order in the source, all groups share one buffer of values
+		template<typename TFunction>
+		auto group_by(const TFunction& keySelector)const
+			->linq_enumerable<types::storage_it<group_pair<typename std::remove_cv<typename std::remove_reference<decltype(keySelector(*(TElement*)0))>::type>::type, TElement>>>
+		{
+			typedef typename std::remove_cv<typename std::remove_reference<decltype(keySelector(*(TElement*)0))>::type>::type		TKey;
+			typedef group_pair<TKey, TElement>														TGroup;
+
+			grouped_storage<TKey, TElement> groups(_begin, _end, keySelector);
+			linq_vector<int> order(groups.size());
+			for (int i = 0; i < groups.size(); i++)
+			{
+				order[i] = i;
+			}
+			std::sort(order.begin(), order.end(), [&](int a, int b){return groups.index.key(a) < groups.index.key(b); });
+
+			auto result = linq_make_shared<linq_vector<TGroup>>();
+			result->reserve(order.size());
+			for (auto i : order)
+			{
+				result->push_back(TGroup(groups.index.key(i), from(groups.begin(i), groups.end(i))));
+			}
+			return linq_enumerable<types::storage_it<TGroup>>(
+				types::storage_it<TGroup>(result, result->begin()),
+				types::storage_it<TGroup>(result, result->end())
+				);
+		}
+
+		template<typename TIterator2, typename TFunction1, typename TFunction2>
+		auto full_join_(const linq_enumerable<TIterator2>& e, const TFunction1& keySelector1, const TFunction2& keySelector2)const
+			->linq<join_pair<
+				typename std::remove_reference<decltype(keySelector1(*(TElement*)0))>::type,
+				linq<typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type>,
+				linq<typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator2>>::type>::type>
+				>>
+		{
+			typedef typename std::remove_reference<decltype(keySelector1(*(TElement*)0))>::type		TKey;
+			typedef typename std::remove_cv<TKey>::type												TIndexKey;
+			typedef typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type					TValue1;
+			typedef typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator2>>::type>::type					TValue2;
+			typedef join_pair<TKey, linq<TValue1>, linq<TValue2>>									TFullJoinPair;
+			typedef std::pair<int, int>																TGroups;
+
+			// every group is in the result so both sides are grouped, then keys of the side with more keys probe the other one
+			grouped_storage<TIndexKey, TValue1> outers(_begin, _end, keySelector1);
+			grouped_storage<TIndexKey, TValue2> inners(e.begin(), e.end(), keySelector2);
+			bool outerSmaller = outers.size() < inners.size();
+			auto& build = outerSmaller ? outers.index : inners.index;
+			auto& probe = outerSmaller ? inners.index : outers.index;
+
+			linq_vector<TGroups> groups;
+			linq_vector<bool> matched(build.size(), false);
+			for (int i = 0; i < probe.size(); i++)
+			{
+				int j = build.find(probe.key(i));
+				if (j != -1) matched[j] = true;
+				groups.push_back(outerSmaller ? TGroups(j, i) : TGroups(i, j));
+			}
+			for (int j = 0; j < build.size(); j++)
+			{
+				if (!matched[j]) groups.push_back(outerSmaller ? TGroups(j, -1) : TGroups(-1, j));
+			}
+
+			// only distinct keys are sorted
+			auto key = [&](const TGroups& g)->const TIndexKey&
+			{
+				return g.first == -1 ? inners.index.key(g.second) : outers.index.key(g.first);
+			};
+			std::sort(groups.begin(), groups.end(), [&](const TGroups& a, const TGroups& b){return key(a) < key(b); });
+
+			auto result = linq_make_shared<linq_vector<TFullJoinPair>>();
+			result->reserve(groups.size());
+			for (auto& g : groups)
+			{
+				result->push_back(TFullJoinPair({ key(g), {
+					g.first == -1 ? from_empty<TValue1>() : linq<TValue1>(from(outers.begin(g.first), outers.end(g.first))),
+					g.second == -1 ? from_empty<TValue2>() : linq<TValue2>(from(inners.begin(g.second), inners.end(g.second)))
+					} }));
+			}
+			return from_values(result);
+		}
+		SUPPORT_STL_CONTAINERS_EX(
+			full_join,
+			PROTECT_PARAMETERS(typename TFunction1, typename TFunction2),
+			PROTECT_PARAMETERS(const TFunction1& keySelector1, const TFunction2& keySelector2),
+			PROTECT_PARAMETERS(keySelector1, keySelector2)
+			)
+
+		template<typename TIterator2, typename TFunction1, typename TFunction2>
+		auto group_join_(const linq_enumerable<TIterator2>& e, const TFunction1& keySelector1, const TFunction2& keySelector2)const
+			->linq<join_pair<
+				typename std::remove_reference<decltype(keySelector1(*(TElement*)0))>::type,
+				typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type,
+				linq<typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator2>>::type>::type>
+				>>
+		{
+			typedef typename std::remove_reference<decltype(keySelector1(*(TElement*)0))>::type		TKey;
+			typedef typename std::remove_cv<TKey>::type												TIndexKey;
+			typedef typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type					TValue1;
+			typedef typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator2>>::type>::type					TValue2;
+			typedef join_pair<TKey, TValue1, linq<TValue2>>											TGroupJoinPair;
+
+			if (smaller_than(e))
+			{
+				// inner values are only kept when their keys are in the hash table of outer values, and are grouped by the same indices
+				grouped_storage<TIndexKey, TValue1> outers(_begin, _end, keySelector1);
+				grouped_storage<TIndexKey, TValue2> inners;
+				auto sink = [&](iterator_type<TIterator2> y)
+				{
+					int k = outers.index.find(keySelector2(y));
+					if (k != -1) inners.add_to(k, y);
+					return true;
+				};
+				iterators::push(e.begin(), e.end(), sink);
+				inners.build(outers.size());
+
+				auto result = linq_make_shared<linq_vector<TGroupJoinPair>>();
+				result->reserve(outers.values->size());
+				for (auto k : sorted_keys(outers.index))
+				{
+					auto values = linq<TValue2>(from(inners.begin(k), inners.end(k)));
+					for (int i = outers.offsets[k]; i < outers.offsets[k + 1]; i++)
+					{
+						result->push_back(TGroupJoinPair({ outers.index.key(k), { (*outers.values)[i], values } }));
+					}
+				}
+				return from_values(result);
+			}
+			else
+			{
+				// keys of outer values without inner values get buckets after keys in the hash table
+				grouped_storage<TIndexKey, TValue2> inners(e.begin(), e.end(), keySelector2);
+				linq_index<TIndexKey> missing;
+				linq_vector<TGroupJoinPair> rows;
+				linq_vector<int> buckets;
+				auto sink = [&](iterator_type<TIterator> x)
+				{
+					auto key = keySelector1(x);
+					int g = inners.index.find(key);
+					if (g == -1)
+					{
+						buckets.push_back(inners.size() + missing.insert(key).first);
+						rows.push_back(TGroupJoinPair({ key, { x, from_empty<TValue2>() } }));
+					}
+					else
+					{
+						buckets.push_back(g);
+						rows.push_back(TGroupJoinPair({ key, { x, linq<TValue2>(from(inners.begin(g), inners.end(g))) } }));
+					}
+					return true;
+				};
+				iterators::push(_begin, _end, sink);
+
+				linq_vector<int> order(inners.size() + missing.size());
+				for (int i = 0; i < (int)order.size(); i++)
+				{
+					order[i] = i;
+				}
+				auto key = [&](int bucket)->const TIndexKey&
+				{
+					return bucket < inners.size() ? inners.index.key(bucket) : missing.key(bucket - inners.size());
+				};
+				std::sort(order.begin(), order.end(), [&](int a, int b){return key(a) < key(b); });
+				linq_vector<int> ranks(order.size());
+				for (int i = 0; i < (int)order.size(); i++)
+				{
+					ranks[order[i]] = i;
+				}
+				for (auto& bucket : buckets)
+				{
+					bucket = ranks[bucket];
+				}
+				return from_values(sort_rows(rows, buckets, (int)order.size()));
+			}
+		}
+		SUPPORT_STL_CONTAINERS_EX(
+			group_join,
+			PROTECT_PARAMETERS(typename TFunction1, typename TFunction2),
+			PROTECT_PARAMETERS(const TFunction1& keySelector1, const TFunction2& keySelector2),
+			PROTECT_PARAMETERS(keySelector1, keySelector2)
+			)
+
+		template<typename TIterator2, typename TFunction1, typename TFunction2>
+		auto join_(const linq_enumerable<TIterator2>& e, const TFunction1& keySelector1, const TFunction2& keySelector2)const
+			->linq<join_pair<
+				typename std::remove_reference<decltype(keySelector1(*(TElement*)0))>::type,
+				typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type,
+				typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator2>>::type>::type
+				>>
+		{
+			typedef typename std::remove_reference<decltype(keySelector1(*(TElement*)0))>::type		TKey;
+			typedef typename std::remove_cv<TKey>::type												TIndexKey;
+			typedef typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type					TValue1;
+			typedef typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator2>>::type>::type					TValue2;
+			typedef join_pair<TKey, TValue1, TValue2>												TJoinPair;
+
+			linq_vector<TJoinPair> rows;
+			linq_vector<int> buckets;
+			int bucketCount = 0;
+			if (smaller_than(e))
+			{
+				// every outer value is a bucket, so pairs of one key are ordered by outer values before inner values
+				grouped_storage<TIndexKey, TValue1> outers(_begin, _end, keySelector1);
+				linq_vector<int> firsts(outers.size());
+				for (auto k : sorted_keys(outers.index))
+				{
+					firsts[k] = bucketCount;
+					bucketCount += outers.offsets[k + 1] - outers.offsets[k];
+				}
+				auto sink = [&](iterator_type<TIterator2> y)
+				{
+					int k = outers.index.find(keySelector2(y));
+					if (k == -1) return true;
+					for (int i = outers.offsets[k]; i < outers.offsets[k + 1]; i++)
+					{
+						buckets.push_back(firsts[k] + i - outers.offsets[k]);
+						rows.push_back(TJoinPair({ outers.index.key(k), { (*outers.values)[i], y } }));
+					}
+					return true;
+				};
+				iterators::push(e.begin(), e.end(), sink);
+			}
+			else
+			{
+				// every key is a bucket, and outer values are probed in order
+				grouped_storage<TIndexKey, TValue2> inners(e.begin(), e.end(), keySelector2);
+				auto order = sorted_keys(inners.index);
+				linq_vector<int> ranks(order.size());
+				for (int i = 0; i < (int)order.size(); i++)
+				{
+					ranks[order[i]] = i;
+				}
+				bucketCount = inners.size();
+				auto sink = [&](iterator_type<TIterator> x)
+				{
+					int k = inners.index.find(keySelector1(x));
+					if (k == -1) return true;
+					for (int i = inners.offsets[k]; i < inners.offsets[k + 1]; i++)
+					{
+						buckets.push_back(ranks[k]);
+						rows.push_back(TJoinPair({ inners.index.key(k), { x, (*inners.values)[i] } }));
+					}
+					return true;
+				};
+				iterators::push(_begin, _end, sink);
+			}
+			return from_values(sort_rows(rows, buckets, bucketCount));
+		}
+		SUPPORT_STL_CONTAINERS_EX(
+			join,
+			PROTECT_PARAMETERS(typename TFunction1, typename TFunction2),
+			PROTECT_PARAMETERS(const TFunction1& keySelector1, const TFunction2& keySelector2),
+			PROTECT_PARAMETERS(keySelector1, keySelector2)
+			)
+			
+		template<typename TFunction>
+		auto first_order_by(const TFunction& keySelector)const
+			->linq<linq<TElement>>
+		{
+			typedef typename std::remove_cv<typename std::remove_reference<decltype(keySelector(*(TElement*)0))>::type>::type		TKey;
+
+			return group_by(keySelector).select([](const group_pair<TKey, TElement>& p){return linq<TElement>(p.second); });
+		}
+
+		template<typename TFunction>
+		auto then_order_by(const TFunction& keySelector)const
+			->linq<iterator_type<TIterator>>
+		{
+			return select_many([keySelector](const TElement& values){return values.first_order_by(keySelector); });
+		}
+
+		template<typename TFunction>
+		linq_ordered<TElement> order_by(const TFunction& keySelector)const
+		{
+			return linq_ordered<TElement>(*this).then_by(keySelector);
+		}
+
+		template<typename TFunction>
+		linq_ordered<TElement> order_by_descending(const TFunction& keySelector)const
+		{
+			return linq_ordered<TElement>(*this).then_by_descending(keySelector);
+		}
+
+		// the <count> elements with the largest keys, from the largest
+		template<typename TFunction>
+		linq_enumerable<types::ordered_it<TElement>> top_k(int count, const TFunction& keySelector)const
+		{
+			return order_by_descending(keySelector).take(count);
+		}
+		
+		template<typename TIterator2>
+		linq_enumerable<types::zip_it<TIterator, TIterator2>> zip_with_(const linq_enumerable<TIterator2>& e)const
+		{
+			return linq_enumerable<types::zip_it<TIterator, TIterator2>>(
+				types::zip_it<TIterator, TIterator2>(_begin, _end, e.begin(), e.end()),
+				types::zip_it<TIterator, TIterator2>(_end, _end, e.end(), e.end())
+				);
+		}
+		SUPPORT_STL_CONTAINERS(zip_with)
+
+		//////////////////////////////////////////////////////////////////
+		// containers
+		//////////////////////////////////////////////////////////////////
+
+		std::vector<TElement> to_vector()const
+		{
+			std::vector<TElement> container;
+			if (is_random_access<TIterator>::value)
+			{
+				container.reserve(count());
+			}
+			auto sink = [&](iterator_type<TIterator> x){container.push_back(x); return true; };
+			iterators::push(_begin, _end, sink);
+			return std::move(container);
+		}
+
+		std::list<TElement> to_list()const
+		{
+			std::list<TElement> container;
+			auto sink = [&](iterator_type<TIterator> x){container.push_back(x); return true; };
+			iterators::push(_begin, _end, sink);
+			return std::move(container);
+		}
+
+		std::deque<TElement> to_deque()const
+		{
+			std::deque<TElement> container;
+			auto sink = [&](iterator_type<TIterator> x){container.push_back(x); return true; };
+			iterators::push(_begin, _end, sink);
+			return std::move(container);
+		}
+
+		template<typename TFunction>
+		auto to_map(const TFunction& keySelector)const->std::map<decltype(keySelector(*(TElement*)0)), TElement>
+		{
+			std::map<decltype(keySelector(*(TElement*)0)), TElement> container;
+			for (auto it = _begin; it != _end; ++it)
+			{
+				container.insert(std::make_pair(keySelector(*it), *it));
+			}
+			return std::move(container);
+		}
+
+		template<typename TFunction>
+		auto to_multimap(const TFunction& keySelector)const->std::multimap<decltype(keySelector(*(TElement*)0)), TElement>
+		{
+			std::multimap<decltype(keySelector(*(TElement*)0)), TElement> container;
+			for (auto it = _begin; it != _end; ++it)
+			{
+				container.insert(std::make_pair(keySelector(*it), *it));
+			}
+			return std::move(container);
+		}
+
+		template<typename TFunction>
+		auto to_unordered_map(const TFunction& keySelector)const->std::unordered_map<decltype(keySelector(*(TElement*)0)), TElement>
+		{
+			std::unordered_map<decltype(keySelector(*(TElement*)0)), TElement> container;
+			for (auto it = _begin; it != _end; ++it)
+			{
+				container.insert(std::make_pair(keySelector(*it), *it));
+			}
+			return std::move(container);
+		}
 
-		//////////////////////////////////////////////////////////////////
-		// iterating (lazy evaluation)
-		//////////////////////////////////////////////////////////////////
+		std::set<TElement> to_set()const
+		{
+			std::set<TElement> container;
+			for (auto it = _begin; it != _end; ++it)
+			{
+				container.insert(*it);
+			}
+			return std::move(container);
+		}
 
-		template<typename TFunction>
-		linq_enumerable<types::select_it<TIterator, TFunction>> select(const TFunction& f)const
+		std::multiset<TElement> to_multiset()const
 		{
-			return linq_enumerable<types::select_it<TIterator, TFunction>>(
-				types::select_it<TIterator, TFunction>(_begin, f),
-				types::select_it<TIterator, TFunction>(_end, f)
-				);
+			std::multiset<TElement> container;
+			for (auto it = _begin; it != _end; ++it)
+			{
+				container.insert(*it);
+			}
+			return std::move(container);
 		}
 
-		template<typename TFunction>
-		linq_enumerable<types::where_it<TIterator, TFunction>> where(const TFunction& f)const
+		std::unordered_set<TElement> to_unordered_set()const
 		{
-			return linq_enumerable<types::where_it<TIterator, TFunction>>(
-				types::where_it<TIterator, TFunction>(_begin, _end, f),
-				types::where_it<TIterator, TFunction>(_end, _end, f)
-				);
+			std::unordered_set<TElement> container;
+			for (auto it = _begin; it != _end; ++it)
+			{
+				container.insert(*it);
+			}
+			return std::move(container);
 		}
 
-		linq_enumerable<types::skip_it<TIterator>> skip(int count)const
+		//////////////////////////////////////////////////////////////////
+		// profiling
+		//////////////////////////////////////////////////////////////////
+
+		// counts elements, time and allocations of operators after the previous profile call while the result is iterated
+		linq_enumerable<types::profile_it<TIterator>> profile(linq_profiler& profiler, const std::string& name)const
 		{
-			return linq_enumerable<types::skip_it<TIterator>>(
-				types::skip_it<TIterator>(_begin, _end, count),
-				types::skip_it<TIterator>(_end, _end, count)
+			auto stage = profiler.stage(name);
+			return linq_enumerable<types::profile_it<TIterator>>(
+				types::profile_it<TIterator>(_begin, stage),
+				types::profile_it<TIterator>(_end, stage)
 				);
 		}
 
-		template<typename TFunction>
-		linq_enumerable<types::skip_while_it<TIterator, TFunction>> skip_while(const TFunction& f)const
+		// the tree of iterators of the query, with the type of elements of each iterator
+		std::string explain()const
 		{
-			return linq_enumerable<types::skip_while_it<TIterator, TFunction>>(
-				types::skip_while_it<TIterator, TFunction>(_begin, _end, f),
-				types::skip_while_it<TIterator, TFunction>(_end, _end, f)
-				);
+			std::string output;
+			linq_explain::write<TIterator>(output, 0);
+			return output;
 		}
 
-		linq_enumerable<types::take_it<TIterator>> take(int count)const
+		//////////////////////////////////////////////////////////////////
+		// caching
+		//////////////////////////////////////////////////////////////////
+
+		// elements are computed when they are first reached, and shared by all copies and iterations of the result
+		linq_enumerable<types::cache_it<TIterator>> cache()const
 		{
-			return linq_enumerable<types::take_it<TIterator>>(
-				types::take_it<TIterator>(_begin, _end, count),
-				types::take_it<TIterator>(_end, _end, count)
+			auto storage = linq_make_shared<iterators::cache_storage<TIterator>>(_begin, _end, false);
+			return linq_enumerable<types::cache_it<TIterator>>(
+				types::cache_it<TIterator>(storage, 0),
+				types::cache_it<TIterator>(storage, -1)
 				);
 		}
 
-		template<typename TFunction>
-		linq_enumerable<types::take_while_it<TIterator, TFunction>> take_while(const TFunction& f)const
+		// the same as cache, but the result could be iterated by multiple threads at the same time
+		linq_enumerable<types::cache_it<TIterator>> cache_synchronized()const
 		{
-			return linq_enumerable<types::take_while_it<TIterator, TFunction>>(
-				types::take_while_it<TIterator, TFunction>(_begin, _end, f),
-				types::take_while_it<TIterator, TFunction>(_end, _end, f)
+			auto storage = linq_make_shared<iterators::cache_storage<TIterator>>(_begin, _end, true);
+			return linq_enumerable<types::cache_it<TIterator>>(
+				types::cache_it<TIterator>(storage, 0),
+				types::cache_it<TIterator>(storage, -1)
 				);
 		}
 
-		template<typename TIterator2>
-		linq_enumerable<types::concat_it<TIterator, TIterator2>> concat_(const linq_enumerable<TIterator2>& e)const
+		// computes all elements now, the result supports random access
+		linq_enumerable<types::storage_it<TElement>> materialize()const
 		{
-			return linq_enumerable<types::concat_it<TIterator, TIterator2>>(
-				types::concat_it<TIterator, TIterator2>(_begin, _end, e.begin(), e.end()),
-				types::concat_it<TIterator, TIterator2>(_end, _end, e.end(), e.end())
+			auto xs = linq_make_shared<linq_vector<TElement>>();
+			if (is_random_access<TIterator>::value)
+			{
+				xs->reserve(count());
+			}
+			auto sink = [&](iterator_type<TIterator> x){xs->push_back(x); return true; };
+			iterators::push(_begin, _end, sink);
+			return linq_enumerable<types::storage_it<TElement>>(
+				types::storage_it<TElement>(xs, xs->begin()),
+				types::storage_it<TElement>(xs, xs->end())
 				);
 		}
-		SUPPORT_STL_CONTAINERS(concat)
 
 		//////////////////////////////////////////////////////////////////
-		// counting
+		// parallel
 		//////////////////////////////////////////////////////////////////
 
-		template<typename T>
-		bool contains(const T& t)const
+	private:
+		typedef typename std::conditional<
+			is_random_access<TIterator>::value || is_splittable<TIterator>::value,
+			TIterator,
+			types::storage_it<TElement>
+			>::type																TParallelIterator;
+
+		linq_enumerable<TIterator> parallel_source(std::true_type)const
 		{
-			for (auto it = _begin; it != _end; it++)
-			{
-				if (*it == t) return true;
-			}
-			return false;
+			return *this;
 		}
 
-		int count()const
+		linq_enumerable<types::storage_it<TElement>> parallel_source(std::false_type)const
 		{
-			int counter = 0;
-			for (auto it = _begin; it != _end; it++)
-			{
-				counter++;
-			}
-			return counter;
+			return materialize();
 		}
+	public:
 
-		linq<TElement> default_if_empty(const TElement& value)const
+		// random access and splittable sources are split into chunks directly, others are copied to a buffer first
+		// threads is the number of threads including the calling one, 0 for all cores
+		linq_parallel<TParallelIterator, parallel_identity> as_parallel(int threads = 0)const
 		{
-			if (count() == 0)
-			{
-				return from_value(value);
-			}
-			else
-			{
-				return *this;
-			}
+			if (threads <= 0) threads = (int)std::thread::hardware_concurrency();
+			auto source = parallel_source(std::integral_constant<bool, is_random_access<TIterator>::value || is_splittable<TIterator>::value>());
+			return linq_parallel<TParallelIterator, parallel_identity>(
+				source.begin(),
+				source.end(),
+				parallel_identity(),
+				parallel_pool::get(threads < 1 ? 1 : threads)
+				);
 		}
 
-		TElement element_at(int index)const
+#undef SUPPORT_STL_CONTAINERS
+#undef PROTECT_PARAMETERS
+#undef SUPPORT_STL_CONTAINERS_EX
+	};
+
+	template<typename T>
+	class linq : public linq_enumerable<iterators::hide_type_iterator<T>>
+	{
+	public:
+		linq()
 		{
-			if (index >= 0)
-			{
-				int counter = 0;
-				for (auto it = _begin; it != _end; it++)
-				{
-					if (counter == index) return *it;
-					counter++;
-				}
-			}
-			throw linq_exception("Argument out of range: index.");
 		}
 
-		bool empty()const
+		template<typename TIterator>
+		linq(const linq_enumerable<TIterator>& e)
+			:linq_enumerable<iterators::hide_type_iterator<T>>(
+			iterators::hide_type_iterator<T>(e.begin()),
+			iterators::hide_type_iterator<T>(e.end())
+			)
 		{
-			return _begin == _end;
 		}
+	};
 
-		TElement first()const
+	template<typename T>
+	class linq_ordered : public linq_enumerable<iterators::ordered_iterator<T>>
+	{
+		template<typename TIterator>
+		friend class linq_enumerable;
+
+		typedef linq_ordered<T>										TSelf;
+		typedef linq_vector<std::shared_ptr<iterators::order_key<T>>>	TKeys;
+	private:
+		linq<T>						source;
+		TKeys						keys;
+
+		// the source is read when the result is iterated for the first time, after that only the sorted copy is kept
+		static linq_enumerable<iterators::ordered_iterator<T>> order(const linq<T>& source, const TKeys& keys)
 		{
-			if (empty()) throw linq_exception("Failed to get a value from an empty collection.");
-			return *_begin;
+			auto storage = linq_make_shared<iterators::order_storage<T>>(source.begin(), source.end(), keys, -1);
+			return linq_enumerable<iterators::ordered_iterator<T>>(
+				iterators::ordered_iterator<T>(storage, 0),
+				iterators::ordered_iterator<T>(storage, -1)
+				);
 		}
 
-		TElement first_or_default(const TElement& value)const
+		linq_ordered(const linq<T>& _source, const TKeys& _keys = TKeys())
+			:linq_enumerable<iterators::ordered_iterator<T>>(order(_source, _keys))
+			, source(_source)
+			, keys(_keys)
 		{
-			return empty() ? value : *_begin;
 		}
 
-		TElement last()const
+		template<typename TFunction>
+		TSelf then_by(const TFunction& keySelector, bool descending)const
 		{
-			if (empty()) throw linq_exception("Failed to get a value from an empty collection.");
-			auto it = _begin;
-			TElement result = *it;
-			while (++it != _end)
-			{
-				result = *it;
-			}
-			return result;
+			auto newKeys = keys;
+			newKeys.push_back(linq_make_shared<iterators::order_key_implement<T, TFunction>>(keySelector, descending));
+			return TSelf(source, newKeys);
+		}
+	public:
+		template<typename TFunction>
+		TSelf then_by(const TFunction& keySelector)const
+		{
+			return then_by(keySelector, false);
 		}
 
-		TElement last_or_default(const TElement& value)const
+		template<typename TFunction>
+		TSelf then_by_descending(const TFunction& keySelector)const
 		{
-			auto result = value;
-			for (auto it = _begin; it != _end; it++)
-			{
-				result = *it;
-			}
-			return result;
+			return then_by(keySelector, true);
 		}
 
-		linq_enumerable<TIterator> single()const
+		// the source is read once into a heap of the best <count> elements when this function is called
+		// only they are kept, so the result does not depend on the source any more
+		linq_enumerable<iterators::ordered_iterator<T>> take(int count)const
 		{
-			auto it = _begin;
-			if (it == _end) throw linq_exception("Failed to get a value from an empty collection.");
+			auto storage = linq_make_shared<iterators::order_storage<T>>(source.begin(), source.end(), keys, count < 0 ? 0 : count);
+			storage->get();
+			return linq_enumerable<iterators::ordered_iterator<T>>(
+				iterators::ordered_iterator<T>(storage, 0),
+				iterators::ordered_iterator<T>(storage, -1)
+				);
+		}
 
-			it++;
-			if (it != _end) throw linq_exception("The collection should have exactly one value.");
+		// sorted runs of about <memoryBudget> bytes are written to a temporary file by linq_serializer when this function is called
+		// and merged while the result is iterated, the source is streamed into runs, so only the budget is kept in memory
+		// call then_by before this function
+		linq_enumerable<iterators::external_ordered_iterator<T>> with_memory_budget(size_t memoryBudget)const
+		{
+			size_t budget = memoryBudget / sizeof(T);
+			if (budget < 1) budget = 1;
+			if (budget > INT_MAX) budget = INT_MAX;
+			auto storage = linq_make_shared<iterators::external_order_storage<T>>(source.begin(), source.end(), keys, (int)budget);
+			return linq_enumerable<iterators::external_ordered_iterator<T>>(
+				iterators::external_ordered_iterator<T>(storage, 0),
+				iterators::external_ordered_iterator<T>(storage, -1)
+				);
+		}
 
-			return *this;
+		// only the best element is kept instead of sorting all of them
+		T first()const
+		{
+			return take(1).first();
 		}
 
-		linq<TElement> single_or_default(const TElement& value)const
+		T first_or_default(const T& value)const
 		{
-			auto it = _begin;
-			if (it == _end) return from_value(value);
+			return take(1).first_or_default(value);
+		}
+	};
 
-			it++;
-			if (it != _end) throw linq_exception("The collection should have exactly one value.");
+	// a query whose select and where run on chunks of a random access source in parallel
+	// results keep the order of the source unless as_unordered is called
+	// reductions combine chunks in order, so floating point results only depend on the number of threads
+	// as_deterministic uses chunks of a fixed size, so they do not even depend on the number of threads
+	template<typename TIterator, typename TPipeline>
+	class linq_parallel
+	{
+		template<typename TIterator2>
+		friend class linq_enumerable;
 
-			return *this;
+		template<typename TIterator2, typename TPipeline2>
+		friend class linq_parallel;
+
+		typedef linq_parallel<TIterator, TPipeline>								TSelf;
+		typedef decltype(std::declval<const TPipeline&>()(std::declval<const linq_enumerable<TIterator>&>()))	TChunk;
+		typedef typename std::remove_cv<typename std::remove_reference<iterator_type<decltype(std::declval<const TChunk&>().begin())>>::type>::type	TElement;
+
+		static const int						deterministic_chunk_size = 16384;
+		static const int						chunks_per_thread = 8;
+	private:
+		TIterator								_begin;
+		TIterator								_end;
+		TPipeline								pipeline;
+		std::shared_ptr<parallel_pool>			pool;
+		bool									ordered;
+		bool									deterministic;
+
+		linq_parallel(const TIterator& _begin_, const TIterator& _end_, const TPipeline& _pipeline, const std::shared_ptr<parallel_pool>& _pool, bool _ordered = true, bool _deterministic = false)
+			:_begin(_begin_), _end(_end_), pipeline(_pipeline), pool(_pool), ordered(_ordered), deterministic(_deterministic)
+		{
 		}
 
-		template<typename TIterator2>
-		bool sequence_equal_(const linq_enumerable<TIterator2>& e)const
+		// elements of random access sources, or positions of splittable sources
+		long long source_size(std::true_type)const
 		{
-			auto x = _begin;
-			auto xe = _end;
-			auto y = e.begin();
-			auto ye = e.end();
+			return is_splittable<TIterator>::size(_begin, _end);
+		}
 
-			while (x != xe && y != ye)
-			{
-				if (*x++ != *y++) return false;
-			}
-			return x == xe && y == ye;
+		long long source_size(std::false_type)const
+		{
+			return iterators::range_size(_begin, _end);
 		}
-		SUPPORT_STL_CONTAINERS(sequence_equal)
 
-		//////////////////////////////////////////////////////////////////
-		// set
-		//////////////////////////////////////////////////////////////////
+		long long source_size()const
+		{
+			return source_size(std::integral_constant<bool, is_splittable<TIterator>::value>());
+		}
 
-		linq<TElement> distinct()const
+		int chunk_count()const
 		{
-			std::set<TElement> set;
-			auto xs = std::make_shared<std::vector<TElement>>();
-			for (auto it = _begin; it != _end; it++)
+			long long size = source_size();
+			if (deterministic)
 			{
-				if (set.insert(*it).second)
-				{
-					xs->push_back(*it);
-				}
+				return (int)((size + deterministic_chunk_size - 1) / deterministic_chunk_size);
 			}
-			return from_values(xs);
+			int chunks = pool->size() * chunks_per_thread;
+			return size < chunks ? (int)size : chunks;
 		}
 
-		template<typename TIterator2>
-		linq<TElement> except_with_(const linq_enumerable<TIterator2>& e)const
+		long long chunk_begin(long long size, int chunk, int chunks)const
 		{
-			std::set<TElement> set(e.begin(), e.end());
-			auto xs = std::make_shared<std::vector<TElement>>();
-			for (auto it = _begin; it != _end; it++)
+			if (chunk == 0) return 0;
+			if (deterministic)
 			{
-				if (set.insert(*it).second)
-				{
-					xs->push_back(*it);
-				}
+				long long begin = (long long)chunk * deterministic_chunk_size;
+				return begin < size ? begin : size;
 			}
-			return from_values(xs);
+			return size * chunk / chunks;
 		}
-		SUPPORT_STL_CONTAINERS(except_with)
 
-		template<typename TIterator2>
-		linq<TElement> intersect_with_(const linq_enumerable<TIterator2>& e)const
+		// the i-th chunk is [bounds[i], bounds[i + 1])
+		std::vector<TIterator> chunk_bounds(int chunks, std::true_type)const
 		{
-			std::set<TElement> seti, set(e.begin(), e.end());
-			auto xs = std::make_shared<std::vector<TElement>>();
-			for (auto it = _begin; it != _end; it++)
+			long long size = source_size();
+			std::vector<long long> offsets;
+			for (int i = 0; i <= chunks; i++)
 			{
-				if (seti.insert(*it).second && !set.insert(*it).second)
-				{
-					xs->push_back(*it);
-				}
+				offsets.push_back(chunk_begin(size, i, chunks));
 			}
-			return from_values(xs);
+			return is_splittable<TIterator>::split(_begin, _end, offsets, *pool);
 		}
-		SUPPORT_STL_CONTAINERS(intersect_with)
 
-		template<typename TIterator2>
-		linq<TElement> union_with_(const linq_enumerable<TIterator2>& e)const
+		std::vector<TIterator> chunk_bounds(int chunks, std::false_type)const
 		{
-			return concat(e).distinct();
+			long long size = source_size();
+			std::vector<TIterator> bounds;
+			for (int i = 0; i <= chunks; i++)
+			{
+				bounds.push_back(iterators::range_advance(_begin, _end, (int)chunk_begin(size, i, chunks)));
+			}
+			return bounds;
 		}
-		SUPPORT_STL_CONTAINERS(union_with)
-
-		//////////////////////////////////////////////////////////////////
-		// aggregating
-		//////////////////////////////////////////////////////////////////
 
+		// calls f(chunk index, query on the chunk) for every chunk in parallel
 		template<typename TFunction>
-		TElement aggregate(const TFunction& f)const
+		void run(int chunks, const TFunction& f)const
 		{
-			auto it = _begin;
-			if (it == _end) throw linq_exception("Failed to get a value from an empty collection.");
-
-			TElement result = *it;
-			while (++it != _end)
+			auto bounds = chunk_bounds(chunks, std::integral_constant<bool, is_splittable<TIterator>::value>());
+			pool->run(chunks, [&](int chunk)
 			{
-				result = f(result, *it);
-			}
-			return result;
+				f(chunk, pipeline(linq_enumerable<TIterator>(bounds[chunk], bounds[chunk + 1])));
+			});
 		}
 
-		template<typename TResult, typename TFunction>
-		TResult aggregate(const TResult& init, const TFunction& f)const
+		template<typename TResult, typename TCombine>
+		static void merge(iterators::optional_value<TResult>& result, const iterators::optional_value<TResult>& partial, const TCombine& combine)
 		{
-			TResult result = init;
-			for (auto it = _begin; it != _end; it++)
+			if (!partial) return;
+			if (result)
 			{
-				result = f(result, *it);
+				result.emplace(combine(*result, *partial));
+			}
+			else
+			{
+				result = partial;
 			}
-			return result;
-		}
-
-		template<typename TFunction>
-		bool all(const TFunction& f)const
-		{
-			return select(f).aggregate(true, [](bool a, bool b){return a&&b; });
 		}
 
-		template<typename TFunction>
-		bool any(const TFunction& f)const
+		// map(query on a chunk, optional partial result) produces partial results, which are combined in the order of chunks unless unordered
+		template<typename TResult, typename TMap, typename TCombine>
+		iterators::optional_value<TResult> reduce(const TMap& map, const TCombine& combine)const
 		{
-			return !where(f).empty();
+			int chunks = chunk_count();
+			iterators::optional_value<TResult> result;
+			if (ordered || deterministic)
+			{
+				std::vector<iterators::optional_value<TResult>> partials(chunks);
+				run(chunks, [&](int chunk, const TChunk& e){map(e, partials[chunk]); });
+				for (auto& partial : partials)
+				{
+					merge(result, partial, combine);
+				}
+			}
+			else
+			{
+				std::mutex lock;
+				run(chunks, [&](int chunk, const TChunk& e)
+				{
+					iterators::optional_value<TResult> partial;
+					map(e, partial);
+					std::lock_guard<std::mutex> guard(lock);
+					merge(result, partial, combine);
+				});
+			}
+			return result;
 		}
 
-		template<typename TResult>
-		TResult average()const
+		// indices of items sorted by partitions, items of the p-th partition are in [offsets[p], offsets[p + 1])
+		static void split(const linq_vector<int>& parts, int partitions, linq_vector<int>& indices, linq_vector<int>& offsets)
 		{
-			if (_begin == _end) throw linq_exception("Failed to get a value from an empty collection.");
-			TResult sum = 0;
-			int counter = 0;
-			for (auto it = _begin; it != _end; it++)
+			offsets.assign(partitions + 1, 0);
+			for (auto part : parts)
 			{
-				sum += (TResult)*it;
-				counter++;
+				offsets[part + 1]++;
 			}
-			return sum / counter;
+			for (int p = 0; p < partitions; p++)
+			{
+				offsets[p + 1] += offsets[p];
+			}
+			linq_vector<int> positions(offsets.begin(), offsets.end() - 1);
+			indices.resize(parts.size());
+			for (int i = 0; i < (int)parts.size(); i++)
+			{
+				indices[positions[parts[i]]++] = i;
+			}
+		}
+	public:
+		TSelf as_unordered()const
+		{
+			return TSelf(_begin, _end, pipeline, pool, false, deterministic);
 		}
 
-		TElement max()const
+		TSelf as_deterministic()const
 		{
-			return aggregate([](const TElement& a, const TElement& b){return a > b ? a : b; });
+			return TSelf(_begin, _end, pipeline, pool, ordered, true);
 		}
 
-		TElement min()const
+		template<typename TFunction>
+		linq_parallel<TIterator, parallel_select<TPipeline, TFunction>> select(const TFunction& f)const
 		{
-			return aggregate([](const TElement& a, const TElement& b){return a < b ? a : b; });
+			return linq_parallel<TIterator, parallel_select<TPipeline, TFunction>>(_begin, _end, parallel_select<TPipeline, TFunction>(pipeline, f), pool, ordered, deterministic);
 		}
 
-		TElement sum()
+		template<typename TFunction>
+		linq_parallel<TIterator, parallel_where<TPipeline, TFunction>> where(const TFunction& f)const
 		{
-			return aggregate(0, [](const TElement& a, const TElement& b){return a + b; });
+			return linq_parallel<TIterator, parallel_where<TPipeline, TFunction>>(_begin, _end, parallel_where<TPipeline, TFunction>(pipeline, f), pool, ordered, deterministic);
 		}
 
-		TElement product()
+		// f is applied to elements of each chunk, and combine is applied to results of chunks
+		// every chunk starts from init, so init should be an identity of combine, like 0 for + or 1 for *
+		template<typename TResult, typename TFunction, typename TCombine>
+		TResult aggregate(const TResult& init, const TFunction& f, const TCombine& combine)const
 		{
-			return aggregate([](const TElement& a, const TElement& b){return a * b; });
+			auto result = reduce<TResult>([&](const TChunk& e, iterators::optional_value<TResult>& partial){partial.emplace(e.aggregate(init, f)); }, combine);
+			return result ? *result : init;
 		}
 
-		//////////////////////////////////////////////////////////////////
-		// restructuring
-		//////////////////////////////////////////////////////////////////
-
+		// f should be associative
 		template<typename TFunction>
-		auto select_many(const TFunction& f)const
-#ifdef _MSC_VER
-			->linq<decltype(*f(*(TElement*)0).begin())>
-#else
-			->linq<decltype(*((typename linq_lambda_retriver<decltype(&TFunction::operator())>::ResultType*)0)->begin())>
-#endif
+		TElement aggregate(const TFunction& f)const
 		{
-			typedef decltype(f(*(TElement*)0))				TCollection;
-			typedef decltype(*f(*(TElement*)0).begin())		TValue;
-			return select(f).aggregate(from_empty<TValue>(), [](const linq<TValue>& a, const TCollection& b){return a.concat(b); });
+			auto result = reduce<TElement>([&](const TChunk& e, iterators::optional_value<TElement>& partial){if (!e.empty()) partial.emplace(e.aggregate(f)); }, f);
+			if (!result) throw linq_exception("Failed to get a value from an empty collection.");
+			return *result;
 		}
 
-		template<typename TFunction>
-		auto group_by(const TFunction& keySelector)const->linq<zip_pair<decltype(keySelector(*(TElement*)0)), linq<TElement>>>
+		int count()const
 		{
-			typedef decltype(keySelector(*(TElement*)0))	TKey;
-			typedef std::vector<TElement>					TValueVector;
-			typedef std::shared_ptr<TValueVector>			TValueVectorPtr;
+			auto plus = [](int a, int b){return a + b; };
+			auto result = reduce<int>([](const TChunk& e, iterators::optional_value<int>& partial){partial.emplace(e.count()); }, plus);
+			return result ? *result : 0;
+		}
 
-			std::map<TKey, TValueVectorPtr> map;
-			for (auto it = _begin; it != _end; it++)
-			{
-				auto value = *it;
-				auto key = keySelector(value);
-				auto it2 = map.find(key);
-				if (it2 == map.end())
-				{
-					auto xs = std::make_shared<TValueVector>();
-					xs->push_back(value);
-					map.insert(std::make_pair(key, xs));
-				}
-				else
-				{
-					it2->second->push_back(value);
-				}
-			}
+		TElement max()const
+		{
+			auto result = reduce<TElement>([](const TChunk& e, iterators::optional_value<TElement>& partial){if (!e.empty()) partial.emplace(e.max()); }, simd::maximum());
+			if (!result) throw linq_exception("Failed to get a value from an empty collection.");
+			return *result;
+		}
 
-			auto result = std::make_shared<std::vector<zip_pair<TKey, linq<TElement>>>>();
-			for (auto p : map)
-			{
-				result->push_back(zip_pair<TKey, linq<TElement>>(p.first, from_values(p.second)));
-			}
-			return from_values(result);
+		TElement min()const
+		{
+			auto result = reduce<TElement>([](const TChunk& e, iterators::optional_value<TElement>& partial){if (!e.empty()) partial.emplace(e.min()); }, simd::minimum());
+			if (!result) throw linq_exception("Failed to get a value from an empty collection.");
+			return *result;
 		}
 
-		template<typename TIterator2, typename TFunction1, typename TFunction2>
-		auto full_join_(const linq_enumerable<TIterator2>& e, const TFunction1& keySelector1, const TFunction2& keySelector2)const
-			->linq<join_pair<
-				typename std::remove_reference<decltype(keySelector1(*(TElement*)0))>::type,
-				linq<typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type>,
-				linq<typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator2>>::type>::type>
-				>>
+		TElement sum()const
 		{
-			typedef typename std::remove_reference<decltype(keySelector1(*(TElement*)0))>::type		TKey;
-			typedef typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type					TValue1;
-			typedef typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator2>>::type>::type					TValue2;
-			typedef join_pair<TKey, linq<TValue1>, linq<TValue2>>									TFullJoinPair;
+			auto result = reduce<TElement>([](const TChunk& e, iterators::optional_value<TElement>& partial){partial.emplace(e.sum()); }, simd::add());
+			return result ? *result : TElement();
+		}
 
-			std::multimap<TKey, TValue1> map1;
-			std::multimap<TKey, TValue2> map2;
+		// the same result as accumulate_by of the sequential query when combine(accumulator, accumulator) is associative
+		// every chunk accumulates into its own hash table, then keys are split into partitions by hashes, and every partition is merged by one thread
+		template<typename TFunction, typename TFirst, typename TNext, typename TCombine>
+		auto accumulate_by(const TFunction& keySelector, const TFirst& first, const TNext& next, const TCombine& combine)const
+			->linq<zip_pair<
+				typename std::remove_cv<typename std::remove_reference<decltype(keySelector(*(TElement*)0))>::type>::type,
+				typename std::remove_cv<typename std::remove_reference<decltype(first(*(TElement*)0))>::type>::type
+				>>
+		{
+			typedef typename std::remove_cv<typename std::remove_reference<decltype(keySelector(*(TElement*)0))>::type>::type		TKey;
+			typedef typename std::remove_cv<typename std::remove_reference<decltype(first(*(TElement*)0))>::type>::type			TResult;
+			typedef linq_partitioner<TKey>																						TPartitioner;
 
-			for (auto it = _begin; it != _end; it++)
+			if (pool->size() == 1)
 			{
-				auto value = *it;
-				auto key = keySelector1(value);
-				map1.insert(std::make_pair(key, value));
+				return pipeline(linq_enumerable<TIterator>(_begin, _end)).accumulate_by(keySelector, first, next);
 			}
-			for (auto it = e.begin(); it != e.end(); it++)
+
+			struct table
 			{
-				auto value = *it;
-				auto key = keySelector2(value);
-				map2.insert(std::make_pair(key, value));
-			}
+				linq_index<TKey>				index;
+				linq_vector<TResult>			accumulators;
+				linq_vector<int>				keys;		// indices of keys sorted by partitions
+				linq_vector<int>				offsets;
+			};
 
-			auto result = std::make_shared<std::vector<TFullJoinPair>>();
-			auto lower1 = map1.begin();
-			auto lower2 = map2.begin();
-			while (lower1 != map1.end() && lower2 != map2.end())
+			int chunks = chunk_count();
+			int partitions = TPartitioner::partitions(pool->size());
+			std::vector<std::unique_ptr<table>> locals(chunks);
+			run(chunks, [&](int chunk, const TChunk& e)
 			{
-				auto key1 = lower1->first;
-				auto key2 = lower2->first;
-				auto upper1 = map1.upper_bound(key1);
-				auto upper2 = map2.upper_bound(key2);
-				if (key1 < key2)
+				locals[chunk].reset(new table);
+				auto& local = *locals[chunk];
+				auto sink = [&](const TElement& x)
 				{
-					auto outers = std::make_shared<std::vector<TValue1>>();
-					for (auto it = lower1; it != upper1; it++)
+					auto key = local.index.insert(keySelector(x));
+					if (key.second)
 					{
-						outers->push_back(it->second);
+						local.accumulators.push_back(first(x));
 					}
-					result->push_back(TFullJoinPair({ key1, { from_values(outers), from_empty<TValue2>() } }));
-					lower1 = upper1;
-				}
-				else if (key1 > key2)
-				{
-					auto inners = std::make_shared<std::vector<TValue2>>();
-					for (auto it = lower2; it != upper2; it++)
+					else
 					{
-						inners->push_back(it->second);
+						auto& accumulator = local.accumulators[key.first];
+						accumulator = next(accumulator, x);
 					}
-					result->push_back(TFullJoinPair({ key2, { from_empty<TValue1>(), from_values(inners) } }));
-					lower2 = upper2;
+					return true;
+				};
+				iterators::push(e.begin(), e.end(), sink);
+
+				linq_vector<int> parts(local.index.size());
+				for (int i = 0; i < local.index.size(); i++)
+				{
+					parts[i] = TPartitioner::partition(local.index.key(i), partitions);
 				}
-				else
+				split(parts, partitions, local.keys, local.offsets);
+			});
+
+			// the i-th key of a chunk is put in the slot bases[chunk] + i if it appears in this chunk for the first time
+			linq_vector<int> bases(chunks + 1, 0);
+			for (int c = 0; c < chunks; c++)
+			{
+				bases[c + 1] = bases[c] + locals[c]->index.size();
+			}
+			linq_vector<std::pair<int, int>> slots(bases[chunks], std::make_pair(-1, -1));
+
+			std::vector<std::unique_ptr<table>> merged(partitions);
+			pool->run(partitions, [&](int p)
+			{
+				merged[p].reset(new table);
+				auto& global = *merged[p];
+				for (int c = 0; c < chunks; c++)
 				{
-					auto outers = std::make_shared<std::vector<TValue1>>();
-					for (auto it = lower1; it != upper1; it++)
-					{
-						outers->push_back(it->second);
-					}
-					auto inners = std::make_shared<std::vector<TValue2>>();
-					for (auto it = lower2; it != upper2; it++)
+					auto& local = *locals[c];
+					for (int i = local.offsets[p]; i < local.offsets[p + 1]; i++)
 					{
-						inners->push_back(it->second);
+						int k = local.keys[i];
+						auto key = global.index.insert(local.index.key(k));
+						if (key.second)
+						{
+							global.accumulators.push_back(std::move(local.accumulators[k]));
+							slots[bases[c] + k] = std::make_pair(p, key.first);
+						}
+						else
+						{
+							auto& accumulator = global.accumulators[key.first];
+							accumulator = combine(accumulator, local.accumulators[k]);
+						}
 					}
-					result->push_back(TFullJoinPair({ key1, { from_values(outers), from_values(inners) } }));
-					lower2 = upper2;
-					lower1 = upper1;
+				}
+			});
+
+			auto result = linq_make_shared<linq_vector<zip_pair<TKey, TResult>>>();
+			int size = 0;
+			for (auto& global : merged)
+			{
+				size += global->index.size();
+			}
+			result->reserve(size);
+			for (auto& slot : slots)
+			{
+				if (slot.first != -1)
+				{
+					auto& global = *merged[slot.first];
+					result->push_back(zip_pair<TKey, TResult>(global.index.key(slot.second), std::move(global.accumulators[slot.second])));
 				}
 			}
 			return from_values(result);
 		}
-		SUPPORT_STL_CONTAINERS_EX(
-			full_join,
-			PROTECT_PARAMETERS(typename TFunction1, typename TFunction2),
-			PROTECT_PARAMETERS(const TFunction1& keySelector1, const TFunction2& keySelector2),
-			PROTECT_PARAMETERS(keySelector1, keySelector2)
-			)
 
-		template<typename TIterator2, typename TFunction1, typename TFunction2>
-		auto group_join_(const linq_enumerable<TIterator2>& e, const TFunction1& keySelector1, const TFunction2& keySelector2)const
-			->linq<join_pair<
-				typename std::remove_reference<decltype(keySelector1(*(TElement*)0))>::type,
-				typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type,
-				linq<typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator2>>::type>::type>
-				>>
+		// every chunk starts each key from init, so init should be an identity of combine, like 0 for + or 1 for *
+		// the result is the same as aggregate_by of the sequential query when combine(a, f(init, x)) equals f(a, x)
+		template<typename TFunction, typename TResult, typename TFunction2, typename TCombine>
+		auto aggregate_by(const TFunction& keySelector, const TResult& init, const TFunction2& f, const TCombine& combine)const
+			->linq<zip_pair<typename std::remove_cv<typename std::remove_reference<decltype(keySelector(*(TElement*)0))>::type>::type, TResult>>
 		{
-			typedef typename std::remove_reference<decltype(keySelector1(*(TElement*)0))>::type		TKey;
-			typedef typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type					TValue1;
-			typedef typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator2>>::type>::type					TValue2;
-			typedef join_pair<TKey, linq<TValue1>, linq<TValue2>>									TFullJoinPair;
-			typedef join_pair<TKey, TValue1, linq<TValue2>>											TGroupJoinPair;
-
-			auto f = full_join(e, keySelector1, keySelector2);
-			auto g = f.select_many([](const TFullJoinPair& item)->linq<TGroupJoinPair>
-				{
-					linq<TValue1> outers = item.second.first;
-					return outers.select([item](const TValue1& outer)->TGroupJoinPair
-						{
-							return TGroupJoinPair({ item.first, {outer, item.second.second} });
-						});
-				});
-			return g;
+			return accumulate_by(keySelector, [&](const TElement& x){return (TResult)f(init, x); }, [&](const TResult& a, const TElement& x){return (TResult)f(a, x); }, combine);
 		}
-		SUPPORT_STL_CONTAINERS_EX(
-			group_join,
-			PROTECT_PARAMETERS(typename TFunction1, typename TFunction2),
-			PROTECT_PARAMETERS(const TFunction1& keySelector1, const TFunction2& keySelector2),
-			PROTECT_PARAMETERS(keySelector1, keySelector2)
-			)
-
-		template<typename TIterator2, typename TFunction1, typename TFunction2>
-		auto join_(const linq_enumerable<TIterator2>& e, const TFunction1& keySelector1, const TFunction2& keySelector2)const
-			->linq<join_pair<
-				typename std::remove_reference<decltype(keySelector1(*(TElement*)0))>::type,
-				typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type,
-				typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator2>>::type>::type
-				>>
-		{
-			typedef typename std::remove_reference<decltype(keySelector1(*(TElement*)0))>::type		TKey;
-			typedef typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator>>::type>::type					TValue1;
-			typedef typename std::remove_cv<typename std::remove_reference<iterator_type<TIterator2>>::type>::type					TValue2;
-			typedef join_pair<TKey, TValue1, linq<TValue2>>											TGroupJoinPair;
-			typedef join_pair<TKey, TValue1, TValue2>												TJoinPair;
 
-			auto g = group_join(e, keySelector1, keySelector2);
-			auto j = g.select_many([](const TGroupJoinPair& item)->linq<TJoinPair>
-				{
-					linq<TValue2> inners = item.second.second;
-					return inners.select([item](const TValue2& inner)->TJoinPair
-						{
-							return TJoinPair({ item.first, {item.second.first, inner} });
-						});
-				});
-			return j;
-		}
-		SUPPORT_STL_CONTAINERS_EX(
-			join,
-			PROTECT_PARAMETERS(typename TFunction1, typename TFunction2),
-			PROTECT_PARAMETERS(const TFunction1& keySelector1, const TFunction2& keySelector2),
-			PROTECT_PARAMETERS(keySelector1, keySelector2)
-			)
-			
 		template<typename TFunction>
-		auto first_order_by(const TFunction& keySelector)const
-			->linq<linq<TElement>>
+		auto count_by(const TFunction& keySelector)const
+			->linq<zip_pair<typename std::remove_cv<typename std::remove_reference<decltype(keySelector(*(TElement*)0))>::type>::type, int>>
 		{
-			typedef typename std::remove_reference<decltype(keySelector(*(TElement*)0))>::type		TKey;
-
-			return group_by(keySelector).select([](const zip_pair<TKey, linq<TElement>>& p){return p.second; });
+			return accumulate_by(keySelector, [](const TElement&){return 1; }, [](int a, const TElement&){return a + 1; }, [](int a, int b){return a + b; });
 		}
 
-		template<typename TFunction>
-		auto then_order_by(const TFunction& keySelector)const
-			->linq<iterator_type<TIterator>>
+		template<typename TFunction, typename TFunction2>
+		auto sum_by(const TFunction& keySelector, const TFunction2& valueSelector)const
+			->linq<zip_pair<
+				typename std::remove_cv<typename std::remove_reference<decltype(keySelector(*(TElement*)0))>::type>::type,
+				typename std::remove_cv<typename std::remove_reference<decltype(valueSelector(*(TElement*)0))>::type>::type
+				>>
 		{
-			return select_many([keySelector](const TElement& values){return values.first_order_by(keySelector); });
+			typedef typename std::remove_cv<typename std::remove_reference<decltype(valueSelector(*(TElement*)0))>::type>::type		TValue;
+			return accumulate_by(keySelector, [&](const TElement& x){return (TValue)valueSelector(x); }, [&](const TValue& a, const TElement& x){return (TValue)(a + valueSelector(x)); }, simd::add());
 		}
 
-		template<typename TFunction>
-		auto order_by(const TFunction& keySelector)const
-			->linq<TElement>
+		template<typename TFunction, typename TFunction2>
+		auto min_by(const TFunction& keySelector, const TFunction2& valueSelector)const
+			->linq<zip_pair<
+				typename std::remove_cv<typename std::remove_reference<decltype(keySelector(*(TElement*)0))>::type>::type,
+				typename std::remove_cv<typename std::remove_reference<decltype(valueSelector(*(TElement*)0))>::type>::type
+				>>
 		{
-			return first_order_by(keySelector).select_many([](const linq<TElement>& values){return values; });
+			typedef typename std::remove_cv<typename std::remove_reference<decltype(valueSelector(*(TElement*)0))>::type>::type		TValue;
+			return accumulate_by(keySelector, [&](const TElement& x){return (TValue)valueSelector(x); }, [&](const TValue& a, const TElement& x){return simd::minimum::apply(a, (TValue)valueSelector(x)); }, simd::minimum());
 		}
-		
-		template<typename TIterator2>
-		linq_enumerable<types::zip_it<TIterator, TIterator2>> zip_with_(const linq_enumerable<TIterator2>& e)const
+
+		template<typename TFunction, typename TFunction2>
+		auto max_by(const TFunction& keySelector, const TFunction2& valueSelector)const
+			->linq<zip_pair<
+				typename std::remove_cv<typename std::remove_reference<decltype(keySelector(*(TElement*)0))>::type>::type,
+				typename std::remove_cv<typename std::remove_reference<decltype(valueSelector(*(TElement*)0))>::type>::type
+				>>
 		{
-			return linq_enumerable<types::zip_it<TIterator, TIterator2>>(
-				types::zip_it<TIterator, TIterator2>(_begin, _end, e.begin(), e.end()),
-				types::zip_it<TIterator, TIterator2>(_end, _end, e.end(), e.end())
-				);
+			typedef typename std::remove_cv<typename std::remove_reference<decltype(valueSelector(*(TElement*)0))>::type>::type		TValue;
+			return accumulate_by(keySelector, [&](const TElement& x){return (TValue)valueSelector(x); }, [&](const TValue& a, const TElement& x){return simd::maximum::apply(a, (TValue)valueSelector(x)); }, simd::maximum());
 		}
-		SUPPORT_STL_CONTAINERS(zip_with)
-
-		//////////////////////////////////////////////////////////////////
-		// containers
-		//////////////////////////////////////////////////////////////////
 
-		std::vector<TElement> to_vector()const
+		// the same result as group_by of the sequential query, keys are sorted and values keep their order in the source
+		// every chunk splits its elements into partitions by hashes of keys, then every partition is grouped by one thread
+		template<typename TFunction>
+		auto group_by(const TFunction& keySelector)const
+			->linq_enumerable<types::storage_it<group_pair<typename std::remove_cv<typename std::remove_reference<decltype(keySelector(*(TElement*)0))>::type>::type, TElement>>>
 		{
-			std::vector<TElement> container;
-			for (auto it = _begin; it != _end; it++)
+			typedef typename std::remove_cv<typename std::remove_reference<decltype(keySelector(*(TElement*)0))>::type>::type		TKey;
+			typedef group_pair<TKey, TElement>																					TGroup;
+			typedef zip_pair<TKey, TElement>																					TEntry;
+			typedef linq_partitioner<TKey>																						TPartitioner;
+
+			if (pool->size() == 1)
 			{
-				container.push_back(*it);
+				return pipeline(linq_enumerable<TIterator>(_begin, _end)).group_by(keySelector);
 			}
-			return std::move(container);
-		}
 
-		std::list<TElement> to_list()const
-		{
-			std::list<TElement> container;
-			for (auto it = _begin; it != _end; it++)
+			struct split_chunk
 			{
-				container.push_back(*it);
-			}
-			return std::move(container);
-		}
+				linq_vector<TEntry>							entries;	// sorted by partitions
+				linq_vector<int>							offsets;
+			};
 
-		std::deque<TElement> to_deque()const
-		{
-			std::deque<TElement> container;
-			for (auto it = _begin; it != _end; it++)
+			struct partition_groups
 			{
-				container.push_back(*it);
-			}
-			return std::move(container);
-		}
+				grouped_storage<TKey, TElement>				groups;
+				linq_vector<int>							order;		// indices of keys in sorted order
+			};
 
-		template<typename TFunction>
-		auto to_map(const TFunction& keySelector)const->std::map<decltype(keySelector(*(TElement*)0)), TElement>
-		{
-			std::map<decltype(keySelector(*(TElement*)0)), TElement> container;
-			for (auto it = _begin; it != _end; it++)
+			int chunks = chunk_count();
+			int partitions = TPartitioner::partitions(pool->size());
+			std::vector<std::unique_ptr<split_chunk>> locals(chunks);
+			run(chunks, [&](int chunk, const TChunk& e)
 			{
-				container.insert(std::make_pair(keySelector(*it), *it));
-			}
-			return std::move(container);
-		}
+				locals[chunk].reset(new split_chunk);
+				auto& local = *locals[chunk];
+				linq_vector<TEntry> unordered;
+				linq_vector<int> parts;
+				auto sink = [&](const TElement& x)
+				{
+					unordered.push_back(TEntry(keySelector(x), x));
+					parts.push_back(TPartitioner::partition(unordered.back().first, partitions));
+					return true;
+				};
+				iterators::push(e.begin(), e.end(), sink);
+
+				linq_vector<int> indices;
+				split(parts, partitions, indices, local.offsets);
+				local.entries.reserve(unordered.size());
+				for (auto i : indices)
+				{
+					local.entries.push_back(std::move(unordered[i]));
+				}
+			});
 
-		template<typename TFunction>
-		auto to_multimap(const TFunction& keySelector)const->std::multimap<decltype(keySelector(*(TElement*)0)), TElement>
-		{
-			std::multimap<decltype(keySelector(*(TElement*)0)), TElement> container;
-			for (auto it = _begin; it != _end; it++)
+			std::vector<std::unique_ptr<partition_groups>> merged(partitions);
+			pool->run(partitions, [&](int p)
 			{
-				container.insert(std::make_pair(keySelector(*it), *it));
-			}
-			return std::move(container);
-		}
+				merged[p].reset(new partition_groups);
+				auto& global = *merged[p];
+				int size = 0;
+				for (auto& local : locals)
+				{
+					size += local->offsets[p + 1] - local->offsets[p];
+				}
+				global.groups.reserve(size);
+				for (auto& local : locals)
+				{
+					for (int i = local->offsets[p]; i < local->offsets[p + 1]; i++)
+					{
+						global.groups.add(local->entries[i].first, local->entries[i].second);
+					}
+				}
+				global.groups.build();
 
-		template<typename TFunction>
-		auto to_unordered_map(const TFunction& keySelector)const->std::unordered_map<decltype(keySelector(*(TElement*)0)), TElement>
-		{
-			std::unordered_map<decltype(keySelector(*(TElement*)0)), TElement> container;
-			for (auto it = _begin; it != _end; it++)
+				auto& groups = global.groups;
+				global.order.resize(groups.size());
+				for (int i = 0; i < groups.size(); i++)
+				{
+					global.order[i] = i;
+				}
+				std::sort(global.order.begin(), global.order.end(), [&](int a, int b){return groups.index.key(a) < groups.index.key(b); });
+			});
+
+			// partitions have different keys, so their sorted keys are merged by a heap
+			linq_vector<int> cursors(partitions, 0);
+			auto key = [&](int p)->const TKey&{return merged[p]->groups.index.key(merged[p]->order[cursors[p]]); };
+			auto after = [&](int a, int b){return key(b) < key(a); };
+			linq_vector<int> heap;
+			int size = 0;
+			for (int p = 0; p < partitions; p++)
 			{
-				container.insert(std::make_pair(keySelector(*it), *it));
+				size += merged[p]->groups.size();
+				if (merged[p]->groups.size() > 0) heap.push_back(p);
 			}
-			return std::move(container);
-		}
+			std::make_heap(heap.begin(), heap.end(), after);
 
-		std::set<TElement> to_set()const
-		{
-			std::set<TElement> container;
-			for (auto it = _begin; it != _end; it++)
+			auto result = linq_make_shared<linq_vector<TGroup>>();
+			result->reserve(size);
+			while (!heap.empty())
 			{
-				container.insert(*it);
+				std::pop_heap(heap.begin(), heap.end(), after);
+				int p = heap.back();
+				auto& groups = merged[p]->groups;
+				int i = merged[p]->order[cursors[p]++];
+				result->push_back(TGroup(groups.index.key(i), from(groups.begin(i), groups.end(i))));
+				if (cursors[p] < groups.size())
+				{
+					std::push_heap(heap.begin(), heap.end(), after);
+				}
+				else
+				{
+					heap.pop_back();
+				}
 			}
-			return std::move(container);
+			return linq_enumerable<types::storage_it<TGroup>>(
+				types::storage_it<TGroup>(result, result->begin()),
+				types::storage_it<TGroup>(result, result->end())
+				);
 		}
 
-		std::multiset<TElement> to_multiset()const
+		std::vector<TElement> to_vector()const
 		{
-			std::multiset<TElement> container;
-			for (auto it = _begin; it != _end; it++)
+			std::vector<TElement> container;
+			int chunks = chunk_count();
+			if (ordered)
 			{
-				container.insert(*it);
+				std::vector<std::vector<TElement>> partials(chunks);
+				run(chunks, [&](int chunk, const TChunk& e){partials[chunk] = e.to_vector(); });
+				size_t size = 0;
+				for (auto& partial : partials)
+				{
+					size += partial.size();
+				}
+				container.reserve(size);
+				for (auto& partial : partials)
+				{
+					container.insert(container.end(), partial.begin(), partial.end());
+				}
 			}
-			return std::move(container);
-		}
-
-		std::unordered_set<TElement> to_unordered_set()const
-		{
-			std::unordered_set<TElement> container;
-			for (auto it = _begin; it != _end; it++)
+			else
 			{
-				container.insert(*it);
+				std::mutex lock;
+				run(chunks, [&](int chunk, const TChunk& e)
+				{
+					auto partial = e.to_vector();
+					std::lock_guard<std::mutex> guard(lock);
+					container.insert(container.end(), partial.begin(), partial.end());
+				});
 			}
 			return std::move(container);
 		}
-
-#undef SUPPORT_STL_CONTAINERS
-#undef PROTECT_PARAMETERS
-#undef SUPPORT_STL_CONTAINERS_EX
-	};
-
-	template<typename T>
-	class linq : public linq_enumerable<iterators::hide_type_iterator<T>>
-	{
-	public:
-		linq()
-		{
-		}
-
-		template<typename TIterator>
-		linq(const linq_enumerable<TIterator>& e)
-			:linq_enumerable<iterators::hide_type_iterator<T>>(
-			iterators::hide_type_iterator<T>(e.begin()),
-			iterators::hide_type_iterator<T>(e.end())
-			)
-		{
-		}
 	};
 
 	template<typename T>
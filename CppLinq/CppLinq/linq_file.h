@@ -0,0 +1,583 @@
+#pragma once
+
+#include "linq.h"
+#include <cstring>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace vczh
+{
+	//////////////////////////////////////////////////////////////////
+	// string_slice
+	//////////////////////////////////////////////////////////////////
+
+	// characters owned by someone else, slices from files are valid while any iterator of the file is alive
+	class string_slice
+	{
+	private:
+		const char*				buffer;
+		int						length;
+
+	public:
+		string_slice()
+			:buffer(nullptr), length(0)
+		{
+		}
+
+		string_slice(const char* _buffer, int _length)
+			:buffer(_buffer), length(_length)
+		{
+		}
+
+		string_slice(const char* _buffer)
+			:buffer(_buffer), length((int)strlen(_buffer))
+		{
+		}
+
+		string_slice(const std::string& value)
+			:buffer(value.data()), length((int)value.size())
+		{
+		}
+
+		const char* begin()const
+		{
+			return buffer;
+		}
+
+		const char* end()const
+		{
+			return buffer + length;
+		}
+
+		int size()const
+		{
+			return length;
+		}
+
+		bool empty()const
+		{
+			return length == 0;
+		}
+
+		char operator[](int index)const
+		{
+			return buffer[index];
+		}
+
+		std::string str()const
+		{
+			return std::string(buffer, length);
+		}
+
+		int compare(const string_slice& value)const
+		{
+			int result = memcmp(buffer, value.buffer, length < value.length ? length : value.length);
+			if (result != 0) return result;
+			return length < value.length ? -1 : length > value.length ? 1 : 0;
+		}
+
+		bool operator==(const string_slice& value)const { return length == value.length && memcmp(buffer, value.buffer, length) == 0; }
+		bool operator!=(const string_slice& value)const { return !(*this == value); }
+		bool operator<(const string_slice& value)const { return compare(value) < 0; }
+		bool operator<=(const string_slice& value)const { return compare(value) <= 0; }
+		bool operator>(const string_slice& value)const { return compare(value) > 0; }
+		bool operator>=(const string_slice& value)const { return compare(value) >= 0; }
+	};
+
+	//////////////////////////////////////////////////////////////////
+	// file_mapping
+	//////////////////////////////////////////////////////////////////
+
+	// a whole file mapped into memory for reading
+	class file_mapping
+	{
+	private:
+		const char*				buffer;
+		size_t					length;
+#ifdef _WIN32
+		HANDLE					file;
+		HANDLE					mapping;
+#endif
+
+		file_mapping(const file_mapping&) = delete;
+		file_mapping& operator=(const file_mapping&) = delete;
+	public:
+		file_mapping(const std::string& path)
+			:buffer(nullptr), length(0)
+		{
+#ifdef _WIN32
+			mapping = NULL;
+			file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+			if (file == INVALID_HANDLE_VALUE) throw linq_exception("Failed to open file: " + path + ".");
+			LARGE_INTEGER size;
+			GetFileSizeEx(file, &size);
+			length = (size_t)size.QuadPart;
+			if (length == 0) return;
+			mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+			buffer = mapping ? (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+			if (!buffer)
+			{
+				if (mapping) CloseHandle(mapping);
+				CloseHandle(file);
+				throw linq_exception("Failed to map file: " + path + ".");
+			}
+#else
+			int file = open(path.c_str(), O_RDONLY);
+			if (file == -1) throw linq_exception("Failed to open file: " + path + ".");
+			struct stat info;
+			if (fstat(file, &info) == -1)
+			{
+				close(file);
+				throw linq_exception("Failed to open file: " + path + ".");
+			}
+			length = (size_t)info.st_size;
+			if (length > 0)
+			{
+				void* address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, file, 0);
+				if (address == MAP_FAILED)
+				{
+					close(file);
+					throw linq_exception("Failed to map file: " + path + ".");
+				}
+				madvise(address, length, MADV_SEQUENTIAL);
+				buffer = (const char*)address;
+			}
+			close(file);
+#endif
+		}
+
+		~file_mapping()
+		{
+#ifdef _WIN32
+			if (buffer) UnmapViewOfFile(buffer);
+			if (mapping) CloseHandle(mapping);
+			CloseHandle(file);
+#else
+			if (buffer) munmap((void*)buffer, length);
+#endif
+		}
+
+		const char* data()const
+		{
+			return buffer;
+		}
+
+		size_t size()const
+		{
+			return length;
+		}
+	};
+
+	namespace iterators
+	{
+		//////////////////////////////////////////////////////////////////
+		// lines
+		//////////////////////////////////////////////////////////////////
+
+		// lines end with "\n" or "\r\n", the line break after the last line is optional
+		class line_iterator
+		{
+			typedef line_iterator										TSelf;
+		private:
+			std::shared_ptr<file_mapping>		file;
+			const char*							current;
+			const char*							next;
+
+			const char* eof()const
+			{
+				return file->data() + file->size();
+			}
+
+			void read()
+			{
+				auto lineBreak = current == eof() ? nullptr : (const char*)memchr(current, '\n', eof() - current);
+				next = lineBreak ? lineBreak + 1 : eof();
+			}
+		public:
+			line_iterator(const std::shared_ptr<file_mapping>& _file, const char* _current)
+				:file(_file), current(_current)
+			{
+				read();
+			}
+
+			TSelf& operator++()
+			{
+				current = next;
+				read();
+				return *this;
+			}
+
+			TSelf operator++(int)
+			{
+				TSelf t = *this;
+				++*this;
+				return t;
+			}
+
+			string_slice operator*()const
+			{
+				auto end = next;
+				if (end > current && end[-1] == '\n') end--;
+				if (end > current && end[-1] == '\r') end--;
+				return string_slice(current, (int)(end - current));
+			}
+
+			long long distance(const TSelf& it)const
+			{
+				return it.current - current;
+			}
+
+			// the first line starting at or after every offset in bytes from this line, lines after end are not read
+			std::vector<TSelf> split(const TSelf& end, const std::vector<long long>& offsets, parallel_pool& pool)const
+			{
+				std::vector<TSelf> bounds;
+				for (auto offset : offsets)
+				{
+					if (offset <= 0)
+					{
+						bounds.push_back(*this);
+					}
+					else if (offset >= distance(end))
+					{
+						bounds.push_back(end);
+					}
+					else
+					{
+						auto position = current + offset - 1;
+						auto lineBreak = (const char*)memchr(position, '\n', end.current - position);
+						bounds.push_back(TSelf(file, lineBreak ? lineBreak + 1 : end.current));
+					}
+				}
+				return bounds;
+			}
+
+			bool operator==(const TSelf& it)const
+			{
+				return current == it.current;
+			}
+
+			bool operator!=(const TSelf& it)const
+			{
+				return current != it.current;
+			}
+		};
+
+		//////////////////////////////////////////////////////////////////
+		// records
+		//////////////////////////////////////////////////////////////////
+
+		// a file of T stored one after another, from_records throws when the size of the file is not a multiple of sizeof(T)
+		template<typename T>
+		class record_iterator
+		{
+			typedef record_iterator<T>									TSelf;
+		private:
+			std::shared_ptr<file_mapping>		file;
+			int									index;
+
+		public:
+			typedef std::random_access_iterator_tag						iterator_category;
+
+			record_iterator(const std::shared_ptr<file_mapping>& _file, int _index)
+				:file(_file), index(_index)
+			{
+			}
+
+			TSelf& operator++()
+			{
+				++index;
+				return *this;
+			}
+
+			TSelf operator++(int)
+			{
+				TSelf t = *this;
+				++index;
+				return t;
+			}
+
+			const T& operator*()const
+			{
+				return reinterpret_cast<const T*>(file->data())[index];
+			}
+
+			int operator-(const TSelf& it)const
+			{
+				return index - it.index;
+			}
+
+			TSelf& operator+=(int count)
+			{
+				index += count;
+				return *this;
+			}
+
+			bool operator==(const TSelf& it)const
+			{
+				return index == it.index;
+			}
+
+			bool operator!=(const TSelf& it)const
+			{
+				return index != it.index;
+			}
+		};
+
+		//////////////////////////////////////////////////////////////////
+		// csv
+		//////////////////////////////////////////////////////////////////
+
+		// rows are split by line breaks outside of quotes, and fields are split by the delimiter
+		// quotes around a field are removed, but doubled quotes inside are kept because fields are not copied
+		class csv_iterator
+		{
+			typedef csv_iterator										TSelf;
+		private:
+			std::shared_ptr<file_mapping>		file;
+			const char*							current;
+			const char*							next;
+			char								delimiter;
+
+			const char* eof()const
+			{
+				return file->data() + file->size();
+			}
+
+			void read()
+			{
+				bool quoted = false;
+				next = current;
+				while (next != eof())
+				{
+					char c = *next++;
+					if (c == '"') quoted = !quoted;
+					else if (c == '\n' && !quoted) break;
+				}
+			}
+		public:
+			csv_iterator(const std::shared_ptr<file_mapping>& _file, const char* _current, char _delimiter)
+				:file(_file), current(_current), delimiter(_delimiter)
+			{
+				read();
+			}
+
+			TSelf& operator++()
+			{
+				current = next;
+				read();
+				return *this;
+			}
+
+			TSelf operator++(int)
+			{
+				TSelf t = *this;
+				++*this;
+				return t;
+			}
+
+			std::vector<string_slice> operator*()const
+			{
+				auto end = next;
+				if (end > current && end[-1] == '\n') end--;
+				if (end > current && end[-1] == '\r') end--;
+
+				std::vector<string_slice> fields;
+				auto reading = current;
+				while (true)
+				{
+					auto field = reading;
+					if (reading != end && *reading == '"')
+					{
+						field = ++reading;
+						while (reading != end && !(*reading == '"' && (reading + 1 == end || reading[1] != '"')))
+						{
+							reading += *reading == '"' ? 2 : 1;
+						}
+						fields.push_back(string_slice(field, (int)(reading - field)));
+						while (reading != end && *reading != delimiter) reading++;
+					}
+					else
+					{
+						while (reading != end && *reading != delimiter) reading++;
+						fields.push_back(string_slice(field, (int)(reading - field)));
+					}
+					if (reading == end) break;
+					reading++;
+				}
+				return fields;
+			}
+
+			long long distance(const TSelf& it)const
+			{
+				return it.current - current;
+			}
+
+			// the first row starting at or after every offset in bytes from this row, lines after end are not read
+			// a line break only ends a row when there are even quotes before it, so quotes in every chunk of bytes are counted in parallel first
+			std::vector<TSelf> split(const TSelf& end, const std::vector<long long>& offsets, parallel_pool& pool)const
+			{
+				int chunks = (int)offsets.size() - 1;
+				auto position = [&](int i)
+				{
+					auto offset = offsets[i] < 0 ? 0 : offsets[i] > distance(end) ? distance(end) : offsets[i];
+					return current + offset;
+				};
+
+				std::vector<char> quoted(chunks < 0 ? 0 : chunks + 1, 0);
+				pool.run(chunks, [&](int i)
+				{
+					bool odd = false;
+					auto reading = position(i);
+					auto stop = position(i + 1);
+					while ((reading = (const char*)memchr(reading, '"', stop - reading)))
+					{
+						odd = !odd;
+						reading++;
+					}
+					quoted[i + 1] = odd;
+				});
+				for (int i = 1; i <= chunks; i++)
+				{
+					quoted[i] ^= quoted[i - 1];
+				}
+
+				std::vector<TSelf> bounds;
+				for (int i = 0; i <= chunks; i++)
+				{
+					auto reading = position(i);
+					if (reading == current || reading == end.current)
+					{
+						bounds.push_back(TSelf(file, reading, delimiter));
+						continue;
+					}
+
+					// a row starts here when the character before is a line break outside of quotes
+					bool inside = quoted[i] != (reading[-1] == '"');
+					reading--;
+					while (reading != end.current)
+					{
+						char c = *reading++;
+						if (c == '"') inside = !inside;
+						else if (c == '\n' && !inside) break;
+					}
+					bounds.push_back(TSelf(file, reading, delimiter));
+				}
+				return bounds;
+			}
+
+			bool operator==(const TSelf& it)const
+			{
+				return current == it.current;
+			}
+
+			bool operator!=(const TSelf& it)const
+			{
+				return current != it.current;
+			}
+		};
+	}
+
+	template<typename T>
+	struct is_contiguous<iterators::record_iterator<T>, T, true> : std::true_type
+	{
+		static const T* data(const iterators::record_iterator<T>& begin)
+		{
+			return &*begin;
+		}
+	};
+
+	template<>
+	struct is_splittable<iterators::line_iterator> : std::true_type
+	{
+		static long long size(const iterators::line_iterator& begin, const iterators::line_iterator& end)
+		{
+			return begin.distance(end);
+		}
+
+		static std::vector<iterators::line_iterator> split(const iterators::line_iterator& begin, const iterators::line_iterator& end, const std::vector<long long>& offsets, parallel_pool& pool)
+		{
+			return begin.split(end, offsets, pool);
+		}
+	};
+
+	template<>
+	struct is_splittable<iterators::csv_iterator> : std::true_type
+	{
+		static long long size(const iterators::csv_iterator& begin, const iterators::csv_iterator& end)
+		{
+			return begin.distance(end);
+		}
+
+		static std::vector<iterators::csv_iterator> split(const iterators::csv_iterator& begin, const iterators::csv_iterator& end, const std::vector<long long>& offsets, parallel_pool& pool)
+		{
+			return begin.split(end, offsets, pool);
+		}
+	};
+
+	//////////////////////////////////////////////////////////////////
+	// sources
+	//////////////////////////////////////////////////////////////////
+
+	// lines of a text file without line breaks, the file is not copied, and as_parallel splits it by bytes
+	inline linq_enumerable<iterators::line_iterator> from_lines(const std::string& path)
+	{
+		auto file = std::make_shared<file_mapping>(path);
+		auto eof = file->data() + file->size();
+		return linq_enumerable<iterators::line_iterator>(
+			iterators::line_iterator(file, file->data()),
+			iterators::line_iterator(file, eof)
+			);
+	}
+
+	// fixed size binary records, they support random access so as_parallel splits the file without copying
+	template<typename T>
+	linq_enumerable<iterators::record_iterator<T>> from_records(const std::string& path)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "Records should be trivially copyable.");
+		auto file = std::make_shared<file_mapping>(path);
+		if (file->size() % sizeof(T) != 0) throw linq_exception("File size is not a multiple of the record size: " + path + ".");
+		if (file->size() / sizeof(T) > INT_MAX) throw linq_exception("Too many records in file: " + path + ".");
+		return linq_enumerable<iterators::record_iterator<T>>(
+			iterators::record_iterator<T>(file, 0),
+			iterators::record_iterator<T>(file, (int)(file->size() / sizeof(T)))
+			);
+	}
+
+	// rows of a csv file, each row is a vector of fields, and as_parallel splits the file by bytes
+	inline linq_enumerable<iterators::csv_iterator> from_csv(const std::string& path, char delimiter = ',')
+	{
+		auto file = std::make_shared<file_mapping>(path);
+		auto eof = file->data() + file->size();
+		return linq_enumerable<iterators::csv_iterator>(
+			iterators::csv_iterator(file, file->data(), delimiter),
+			iterators::csv_iterator(file, eof, delimiter)
+			);
+	}
+}
+
+namespace std
+{
+	template<>
+	struct hash<vczh::string_slice>
+	{
+		size_t operator()(const vczh::string_slice& value)const
+		{
+			// FNV-1a
+			unsigned long long result = 14695981039346656037ULL;
+			for (auto c : value)
+			{
+				result = (result ^ (unsigned char)c) * 1099511628211ULL;
+			}
+			return (size_t)result;
+		}
+	};
+}